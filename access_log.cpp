@@ -0,0 +1,223 @@
+/*
+	access_log.cpp
+	per-thread record rings drained by one writer thread
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include "access_log.h"
+#include "metrics.h"
+
+namespace mj{
+	bool access_log::log_enabled = false;
+	std::atomic< int > access_log::log_sample( 1 );
+	std::atomic< bool > access_log::log_reopen( false );
+	thread_local unsigned access_log::log_sample_count = 0;
+	thread_local access_log::ring* access_log::log_local = NULL;
+	std::atomic< access_log::ring* > access_log::log_rings( NULL );
+	size_t access_log::log_ring_size = 4096;
+	const char* access_log::log_path = NULL;
+	int access_log::log_fd = -1;
+	long long access_log::log_size = 0;
+	long long access_log::log_rotate_bytes = 0;
+	int access_log::log_keep = 1;
+
+	//the writer sleeps this long when a pass found less than half a batch
+	static const int FLUSH_INTERVAL_US = 10000;
+	static const size_t BATCH_SIZE = 256 * 1024;
+	static const size_t LINE_SIZE = 512;
+
+	//in http_business::METHOD order
+	static const char* const method_names[] = { "GET", "POST", "HEAD", "PUT", "DELETE", "TRACE", "OPTIONS",
+	                                            "CONNECT", "PATCH" };
+
+	bool access_log::start( const char* path, int ring_size, int rotate_mb, int keep )
+	{
+		log_path = strdup( path );
+		log_ring_size = ring_size;
+		log_rotate_bytes = ( long long )rotate_mb << 20;
+		log_keep = keep;
+		if ( ! open_file() )
+		{
+		    return false;
+		}
+		pthread_t thread;
+		if ( pthread_create( &thread, NULL, writer, NULL ) != 0 )
+		{
+		    return false;
+		}
+		pthread_detach( thread );
+		log_enabled = true;
+		return true;
+	}
+
+	access_log::ring* access_log::attach()
+	{
+		ring* r = new ring( log_ring_size );
+		r->next = log_rings.load();
+		while ( ! log_rings.compare_exchange_weak( r->next, r ) )
+		{
+		}
+		log_local = r;
+		return r;
+	}
+
+	void access_log::record( const access_record& record )
+	{
+		ring* r = log_local ? log_local : attach();
+		if ( ! r->queue.push( record ) )
+		{
+		    r->dropped.fetch_add( 1, std::memory_order_relaxed );
+		    metrics::count( COUNTER_LOG_DROPPED );
+		}
+	}
+
+	bool access_log::open_file()
+	{
+		int fd = open( log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+		if ( fd < 0 )
+		{
+		    printf( "can't open access log %s: %s\n", log_path, strerror( errno ) );
+		    return false;
+		}
+		if ( log_fd != -1 )
+		{
+		    close( log_fd );
+		}
+		log_fd = fd;
+		log_size = lseek( fd, 0, SEEK_END );
+		return true;
+	}
+
+	//path.keep-1 -> path.keep ... path -> path.1, then a fresh path
+	void access_log::rotate()
+	{
+		char from[ PATH_MAX + 16 ];
+		char to[ PATH_MAX + 16 ];
+		size_t len = sizeof( to );
+		for ( int i = log_keep; i > 1; --i )
+		{
+		    snprintf( from, len, "%s.%d", log_path, i - 1 );
+		    snprintf( to, len, "%s.%d", log_path, i );
+		    rename( from, to );
+		}
+		snprintf( to, len, "%s.1", log_path );
+		rename( log_path, to );
+		open_file();
+	}
+
+	void access_log::write_batch( const char* data, size_t len )
+	{
+		while ( len > 0 )
+		{
+		    ssize_t n = ::write( log_fd, data, len );
+		    if ( n < 0 )
+		    {
+		        if ( errno == EINTR )
+		        {
+		            continue;
+		        }
+		        //a full disk loses the batch, the server keeps going
+		        return;
+		    }
+		    data += n;
+		    len -= n;
+		    log_size += n;
+		}
+		if ( log_rotate_bytes && log_size >= log_rotate_bytes )
+		{
+		    rotate();
+		}
+	}
+
+	static size_t format_record( char* line, const access_record& r, long long wall_offset )
+	{
+		long long wall_ns = r.served_ns + wall_offset;
+		time_t sec = wall_ns / 1000000000LL;
+		struct tm tm;
+		gmtime_r( &sec, &tm );
+		char address[ INET_ADDRSTRLEN ];
+		inet_ntop( AF_INET, &r.address, address, sizeof( address ) );
+
+		//the url came off the wire: quotes, backslashes and control bytes are replaced
+		char url[ access_record::URL_LEN ];
+		size_t i = 0;
+		for ( ; i < sizeof( url ) - 1 && r.url[i]; ++i )
+		{
+		    unsigned char c = r.url[i];
+		    url[i] = ( c < 0x20 || c == 0x7f || c == '"' || c == '\\' ) ? '?' : c;
+		}
+		url[i] = '\0';
+
+		const char* method = ( unsigned )r.method < sizeof( method_names ) / sizeof( method_names[0] )
+		        ? method_names[ r.method ] : "-";
+		int len = snprintf( line, LINE_SIZE, "time=%04d-%02d-%02dT%02d:%02d:%02d.%06dZ client=%s:%u method=%s "
+		        "url=\"%s\" status=%u bytes=%lld queue_us=%d parse_us=%d service_us=%d send_us=%d\n",
+		        tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+		        ( int )( wall_ns % 1000000000LL / 1000 ), address, ntohs( r.port ), method, url, r.status, r.bytes,
+		        r.queue_us, r.parse_us, r.service_us, r.send_us );
+		return len < ( int )LINE_SIZE ? len : LINE_SIZE - 1;
+	}
+
+	void* access_log::writer( void* arg )
+	{
+		char* batch = new char[ BATCH_SIZE ];
+		unsigned long reported = 0;
+		while ( true )
+		{
+		    if ( log_reopen.exchange( false ) )
+		    {
+		        open_file();
+		    }
+		    struct timespec real;
+		    clock_gettime( CLOCK_REALTIME, &real );
+		    long long wall_offset = real.tv_sec * 1000000000LL + real.tv_nsec - metrics::now_ns();
+
+		    size_t used = 0;
+		    unsigned long dropped = 0;
+		    for ( ring* r = log_rings.load(); r; r = r->next )
+		    {
+		        access_record* record;
+		        while ( ( record = r->queue.front() ) )
+		        {
+		            if ( used + LINE_SIZE > BATCH_SIZE )
+		            {
+		                write_batch( batch, used );
+		                used = 0;
+		            }
+		            used += format_record( batch + used, *record, wall_offset );
+		            r->queue.pop();
+		        }
+		        dropped += r->dropped.load( std::memory_order_relaxed );
+		    }
+		    if ( dropped != reported )
+		    {
+		        if ( used + LINE_SIZE > BATCH_SIZE )
+		        {
+		            write_batch( batch, used );
+		            used = 0;
+		        }
+		        //in the log itself, where a reader notices the gap
+		        used += snprintf( batch + used, LINE_SIZE, "dropped=%lu total=%lu\n", dropped - reported, dropped );
+		        reported = dropped;
+		    }
+		    if ( used > 0 )
+		    {
+		        write_batch( batch, used );
+		    }
+		    if ( used < BATCH_SIZE / 2 )
+		    {
+		        usleep( FLUSH_INTERVAL_US );
+		    }
+		}
+		return arg;
+	}
+}
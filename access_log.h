@@ -0,0 +1,85 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stddef.h>
+#include <atomic>
+#include "spsc_queue.h"
+#include "cache_aligned.h"
+
+namespace mj{
+	//one response, fixed size so a ring holds it by value
+	struct access_record
+	{
+		static const int URL_LEN = 80;      //longer urls are cut
+
+		long long served_ns;        //metrics::now_ns() when the response was queued
+		long long bytes;            //response bytes queued, the first window of a stream
+		unsigned int address;       //client, network order
+		unsigned short port;
+		unsigned short status;
+		int method;                 //http_business::METHOD
+		int queue_us;               //waiting for a worker, 0 behind the first request of a pipeline
+		int parse_us;
+		int service_us;             //parse start to response queued
+		int send_us;                //response queued to sent, -1 when the connection closed first
+		char url[ URL_LEN ];
+	};
+
+	/*
+		asynchronous access log. every thread that answers requests pushes
+		records into a single-producer ring of its own, found like the
+		metrics slots, so the request path takes no lock and makes no system
+		call; a full ring drops the record and counts it instead of waiting.
+		one writer thread drains the rings, formats logfmt lines and writes
+		them in large batches, rotating the file by size and reopening it
+		when asked (SIGHUP, after an external rotation).
+	*/
+	class access_log
+	{
+	public:
+		//opens path and starts the writer, before the first loop opens
+		static bool start( const char* path, int ring_size, int rotate_mb, int keep );
+		static bool enabled() { return log_enabled; }
+		static void set_sample( int every ) { log_sample.store( every > 0 ? every : 1, std::memory_order_relaxed ); }
+		static void reopen() { log_reopen.store( true, std::memory_order_relaxed ); }
+
+		//one request in every sample is logged, counted per thread
+		static bool sampled()
+		{
+			return ++log_sample_count % ( unsigned )log_sample.load( std::memory_order_relaxed ) == 0;
+		}
+		static void record( const access_record& r );
+
+	private:
+		struct ring : public cache_aligned
+		{
+			explicit ring( size_t size ) : queue( size ), dropped( 0 ), next( NULL ) {}
+			spsc_queue< access_record > queue;
+			std::atomic< unsigned long > dropped;
+			ring* next;
+		};
+
+		static ring* attach();
+		static void* writer( void* arg );
+		static bool open_file();
+		static void rotate();
+		static void write_batch( const char* data, size_t len );
+
+	private:
+		static bool log_enabled;
+		static std::atomic< int > log_sample;
+		static std::atomic< bool > log_reopen;
+		static thread_local unsigned log_sample_count;
+		static thread_local ring* log_local;
+		static std::atomic< ring* > log_rings;
+		static size_t log_ring_size;
+
+		//writer thread only
+		static const char* log_path;
+		static int log_fd;
+		static long long log_size;
+		static long long log_rotate_bytes;     //0 never rotates
+		static int log_keep;                   //rotated files kept as path.1 ... path.keep
+	};
+}
+#endif
@@ -0,0 +1,162 @@
+/*
+	block_pool.cpp
+	slab allocator for connection buffers
+*/
+
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "block_pool.h"
+
+namespace mj{
+	static size_t align16( size_t size )
+	{
+		return ( size + 15 ) & ~( size_t )15;
+	}
+
+	block_pool::block_pool( size_t block_size, int max_free_slabs ) :
+		    pool_block_size( block_size ),
+		    pool_stride( align16( sizeof( block_header ) ) + align16( block_size ) ),
+		    pool_max_free_slabs( max_free_slabs ), pool_free_slabs( 0 ), pool_used( 0 ),
+		    pool_partial( NULL ), pool_full( NULL )
+	{
+	}
+
+	block_pool::~block_pool()
+	{
+		size_t size = align16( sizeof( slab ) ) + SLAB_BLOCKS * pool_stride;
+		slab* lists[ 2 ] = { pool_partial, pool_full };
+		for ( int i = 0; i < 2; ++i )
+		{
+		    slab* s = lists[i];
+		    while ( s )
+		    {
+		        slab* next = s->next;
+		        munmap( s, size );
+		        s = next;
+		    }
+		}
+	}
+
+	block_pool::slab* block_pool::new_slab()
+	{
+		size_t size = align16( sizeof( slab ) ) + SLAB_BLOCKS * pool_stride;
+		void* mem = mmap( 0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+		if ( mem == MAP_FAILED )
+		{
+		    return NULL;
+		}
+
+		slab* s = ( slab* )mem;
+		s->prev = NULL;
+		s->next = NULL;
+		s->free_list = NULL;
+		s->free_count = SLAB_BLOCKS;
+		char* base = ( char* )mem + align16( sizeof( slab ) );
+		for ( int i = SLAB_BLOCKS - 1; i >= 0; --i )
+		{
+		    block_header* hdr = ( block_header* )( base + i * pool_stride );
+		    hdr->owner = s;
+		    hdr->next = s->free_list;
+		    s->free_list = hdr;
+		}
+		pool_free_slabs++;
+		return s;
+	}
+
+	void block_pool::unlink( slab* s )
+	{
+		if ( s->prev )
+		{
+		    s->prev->next = s->next;
+		}
+		else if ( pool_partial == s )
+		{
+		    pool_partial = s->next;
+		}
+		else
+		{
+		    pool_full = s->next;
+		}
+		if ( s->next )
+		{
+		    s->next->prev = s->prev;
+		}
+		s->prev = NULL;
+		s->next = NULL;
+	}
+
+	void block_pool::push( slab** list, slab* s )
+	{
+		s->prev = NULL;
+		s->next = *list;
+		if ( *list )
+		{
+		    ( *list )->prev = s;
+		}
+		*list = s;
+	}
+
+	char* block_pool::get()
+	{
+		pool_lock.lock();
+		if ( ! pool_partial )
+		{
+		    slab* s = new_slab();
+		    if ( ! s )
+		    {
+		        pool_lock.unlock();
+		        return NULL;
+		    }
+		    push( &pool_partial, s );
+		}
+
+		slab* s = pool_partial;
+		if ( s->free_count == SLAB_BLOCKS )
+		{
+		    pool_free_slabs--;
+		}
+		block_header* hdr = s->free_list;
+		s->free_list = hdr->next;
+		s->free_count--;
+		if ( s->free_count == 0 )
+		{
+		    unlink( s );
+		    push( &pool_full, s );
+		}
+		pool_used++;
+		pool_lock.unlock();
+		return ( char* )hdr + align16( sizeof( block_header ) );
+	}
+
+	void block_pool::put( char* block )
+	{
+		if ( ! block )
+		{
+		    return;
+		}
+		block_header* hdr = ( block_header* )( block - align16( sizeof( block_header ) ) );
+		pool_lock.lock();
+		slab* s = hdr->owner;
+		if ( s->free_count == 0 )
+		{
+		    unlink( s );
+		    push( &pool_partial, s );
+		}
+		hdr->next = s->free_list;
+		s->free_list = hdr;
+		s->free_count++;
+		pool_used--;
+
+		if ( s->free_count == SLAB_BLOCKS )
+		{
+		    pool_free_slabs++;
+		    if ( pool_free_slabs > pool_max_free_slabs )
+		    {
+		        unlink( s );
+		        munmap( s, align16( sizeof( slab ) ) + SLAB_BLOCKS * pool_stride );
+		        pool_free_slabs--;
+		    }
+		}
+		pool_lock.unlock();
+	}
+}
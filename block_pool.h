@@ -0,0 +1,58 @@
+#ifndef BLOCK_POOL_H
+#define BLOCK_POOL_H
+
+#include <stddef.h>
+#include "locker.h"
+
+namespace mj{
+	/*
+		fixed-size buffer blocks for connections. blocks are carved from
+		slabs of SLAB_BLOCKS on demand and go back to a free list when a
+		connection goes idle; a slab is returned to the system once all of
+		its blocks are free and enough spare blocks remain cached.
+		one pool per event loop, shared by the workers serving its connections.
+	*/
+	class block_pool
+	{
+	public:
+		static const int SLAB_BLOCKS = 32;
+
+		block_pool( size_t block_size, int max_free_slabs );
+		~block_pool();
+
+		char* get();
+		void put( char* block );
+		size_t block_size() const { return pool_block_size; }
+		size_t used() const { return pool_used; }
+
+	private:
+		struct slab;
+		struct block_header
+		{
+			slab* owner;
+			block_header* next;
+		};
+		struct slab
+		{
+			slab* prev;
+			slab* next;
+			block_header* free_list;
+			int free_count;
+		};
+
+		slab* new_slab();
+		void unlink( slab* s );
+		void push( slab** list, slab* s );
+
+	private:
+		size_t pool_block_size;
+		size_t pool_stride;
+		int pool_max_free_slabs;
+		int pool_free_slabs;
+		size_t pool_used;
+		slab* pool_partial;         //slabs with at least one free block
+		slab* pool_full;            //slabs with every block handed out
+		locker pool_lock;
+	};
+}
+#endif
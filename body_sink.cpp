@@ -0,0 +1,113 @@
+/*
+	body_sink.cpp
+	request bodies stored as files under the upload root
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include "body_sink.h"
+
+namespace mj{
+	std::atomic< const char* > file_sink::upload_root( NULL );
+
+	file_sink::file_sink( int fd, const char* temp, const char* path ) :
+		    sink_fd( fd ), sink_done( false )
+	{
+		strcpy( sink_temp, temp );
+		strcpy( sink_path, path );
+	}
+
+	file_sink::~file_sink()
+	{
+		close( sink_fd );
+		if ( ! sink_done )
+		{
+		    unlink( sink_temp );
+		}
+	}
+
+	body_sink* file_sink::create( const char* url, long long length, int& status )
+	{
+		const char* root = upload_root.load( std::memory_order_acquire );
+		if ( ! root )
+		{
+		    status = 403;
+		    return NULL;
+		}
+		//no way out of the upload root, and no name that can't be a file
+		size_t url_len = strlen( url );
+		if ( strstr( url, "/../" ) || ( url_len >= 3 && strcmp( url + url_len - 3, "/.." ) == 0 )
+		        || url[ url_len - 1 ] == '/' )
+		{
+		    status = 403;
+		    return NULL;
+		}
+
+		//a cut name would store the body somewhere else
+		char path[ PATH_LEN ];
+		char temp[ PATH_LEN ];
+		int path_len = snprintf( path, sizeof( path ), "%s%s", root, url );
+		int temp_len = path_len < 0 ? -1 : snprintf( temp, sizeof( temp ), "%s.upload.XXXXXX", path );
+		if ( path_len < 0 || temp_len < 0 )
+		{
+		    status = 500;
+		    return NULL;
+		}
+		if ( temp_len >= ( int )sizeof( temp ) )
+		{
+		    status = 414;
+		    return NULL;
+		}
+		int fd = mkostemp( temp, O_CLOEXEC );
+		if ( fd == -1 )
+		{
+		    status = ( errno == ENOENT || errno == ENOTDIR ) ? 404 : ( errno == EACCES ? 403 : 500 );
+		    return NULL;
+		}
+		if ( length > 0 )
+		{
+		    //one extent for the whole body when the filesystem can do it
+		    posix_fallocate( fd, 0, length );
+		}
+		return new file_sink( fd, temp, path );
+	}
+
+	bool file_sink::write( const char* data, size_t len )
+	{
+		while ( len > 0 )
+		{
+		    ssize_t n = ::write( sink_fd, data, len );
+		    if ( n < 0 )
+		    {
+		        if ( errno == EINTR )
+		        {
+		            continue;
+		        }
+		        return false;
+		    }
+		    data += n;
+		    len -= n;
+		}
+		return true;
+	}
+
+	bool file_sink::finish()
+	{
+		//mkostemp makes the file private, the upload is served like any other file
+		if ( fchmod( sink_fd, 0644 ) != 0 )
+		{
+		    return false;
+		}
+		if ( rename( sink_temp, sink_path ) != 0 )
+		{
+		    return false;
+		}
+		sink_done = true;
+		return true;
+	}
+}
@@ -0,0 +1,55 @@
+#ifndef BODY_SINK_H
+#define BODY_SINK_H
+
+#include <stddef.h>
+#include <atomic>
+
+namespace mj{
+	/*
+		where the body of a POST or PUT goes. a sink is opened once the
+		headers are in and gets the body in the pieces it arrives in, a read
+		block or a chunk at most, so an upload holds no more memory than a
+		request does. finish() is called once the whole body is there,
+		deleting an unfinished sink throws away what was written.
+		a sink backed by a file can hand out its fd, the epoll backend then
+		splices the socket into it without copying through user space.
+	*/
+	class body_sink
+	{
+	public:
+		virtual ~body_sink() {}
+		virtual bool write( const char* data, size_t len ) = 0;
+		virtual bool finish() = 0;
+		virtual int splice_fd() const { return -1; }
+	};
+
+	/*
+		stores the body as upload_root + url. it is written to a temporary
+		file next to the target and renamed over it when complete, readers
+		never see half an upload. the directory has to exist.
+	*/
+	class file_sink : public body_sink
+	{
+	public:
+		static body_sink* create( const char* url, long long length, int& status );
+		~file_sink();
+
+		bool write( const char* data, size_t len );
+		bool finish();
+		int splice_fd() const { return sink_fd; }
+
+	public:
+		static const int PATH_LEN = 2048;
+		static std::atomic< const char* > upload_root;     //NULL refuses uploads, swapped on reload
+
+	private:
+		file_sink( int fd, const char* temp, const char* path );
+
+	private:
+		int sink_fd;
+		bool sink_done;
+		char sink_temp[ PATH_LEN ];
+		char sink_path[ PATH_LEN ];
+	};
+}
+#endif
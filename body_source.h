@@ -0,0 +1,24 @@
+#ifndef BODY_SOURCE_H
+#define BODY_SOURCE_H
+
+#include <sys/types.h>
+
+namespace mj{
+	/*
+		a response body made while it is sent, for output whose length is not
+		known up front; it goes out with chunked transfer-encoding. a worker
+		pulls from it a window at a time and only comes back for more once
+		the socket has taken that window, so a slow client holds the producer
+		back instead of the output piling up. produce() runs on a worker and
+		may block.
+	*/
+	class body_source
+	{
+	public:
+		virtual ~body_source() {}
+		//up to len bytes into buf: how many, 0 at the end of the body, -1 on failure
+		virtual ssize_t produce( char* buf, size_t len ) = 0;
+		virtual const char* content_type() const { return "text/plain; charset=utf-8"; }
+	};
+}
+#endif
@@ -0,0 +1,31 @@
+#ifndef CACHE_ALIGNED_H
+#define CACHE_ALIGNED_H
+
+#include <stdlib.h>
+#include <new>
+
+namespace mj{
+	/*
+		base of classes holding alignas( 64 ) members, the queue positions
+		kept on cache lines of their own. a plain new only guarantees 16
+		bytes before C++17, so those lines could be shared with whatever
+		the allocator put next to the object; deriving from this sends new
+		and delete of the class through posix_memalign.
+	*/
+	struct cache_aligned
+	{
+		static const size_t CACHE_LINE = 64;
+
+		static void* operator new( size_t size )
+		{
+			void* memory;
+			if ( posix_memalign( &memory, CACHE_LINE, size ) != 0 )
+			{
+				throw std::bad_alloc();
+			}
+			return memory;
+		}
+		static void operator delete( void* memory ) { free( memory ); }
+	};
+}
+#endif
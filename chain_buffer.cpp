@@ -0,0 +1,351 @@
+/*
+	chain_buffer.cpp
+	block chain for connection input and output
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include "chain_buffer.h"
+
+namespace mj{
+	chain_buffer::chain_buffer() :
+		    chain_pool( NULL ), chain_head( NULL ), chain_tail( NULL ), chain_size( 0 )
+	{
+	}
+
+	chain_buffer::~chain_buffer()
+	{
+		clear();
+	}
+
+	void chain_buffer::init( block_pool* pool )
+	{
+		clear();
+		chain_pool = pool;
+	}
+
+	void chain_buffer::clear()
+	{
+		while ( chain_head )
+		{
+		    node* next = chain_head->next;
+		    free_node( chain_head );
+		    chain_head = next;
+		}
+		chain_tail = NULL;
+		chain_size = 0;
+	}
+
+	chain_buffer::node* chain_buffer::new_node( size_t cap )
+	{
+		node* n = NULL;
+		if ( cap <= block_cap() )
+		{
+		    n = ( node* )chain_pool->get();
+		    if ( ! n )
+		    {
+		        return NULL;
+		    }
+		    n->cap = block_cap();
+		    n->pooled = true;
+		}
+		else
+		{
+		    n = ( node* )malloc( sizeof( node ) + cap );
+		    if ( ! n )
+		    {
+		        return NULL;
+		    }
+		    n->cap = cap;
+		    n->pooled = false;
+		}
+		n->next = NULL;
+		n->begin = 0;
+		n->end = 0;
+		return n;
+	}
+
+	void chain_buffer::free_node( node* n )
+	{
+		if ( n->pooled )
+		{
+		    chain_pool->put( ( char* )n );
+		}
+		else
+		{
+		    free( n );
+		}
+	}
+
+	void chain_buffer::push_back( node* n )
+	{
+		if ( chain_tail )
+		{
+		    chain_tail->next = n;
+		}
+		else
+		{
+		    chain_head = n;
+		}
+		chain_tail = n;
+	}
+
+	//contiguous room for len bytes at the tail, NULL when out of memory
+	char* chain_buffer::reserve( size_t len )
+	{
+		if ( ! chain_tail || chain_tail->cap - chain_tail->end < len )
+		{
+		    node* n = new_node( len );
+		    if ( ! n )
+		    {
+		        return NULL;
+		    }
+		    push_back( n );
+		}
+		return chain_tail->data() + chain_tail->end;
+	}
+
+	void chain_buffer::commit( size_t len )
+	{
+		chain_tail->end += len;
+		chain_size += len;
+	}
+
+	char* chain_buffer::append( const char* data, size_t len )
+	{
+		char* dst = reserve( len );
+		if ( dst )
+		{
+		    memcpy( dst, data, len );
+		    commit( len );
+		}
+		return dst;
+	}
+
+	char* chain_buffer::front() const
+	{
+		return chain_head ? chain_head->data() + chain_head->begin : NULL;
+	}
+
+	size_t chain_buffer::front_size() const
+	{
+		return chain_head ? chain_head->end - chain_head->begin : 0;
+	}
+
+	/*
+		drop len bytes from the start of the first node. the bytes left in it
+		stay where they are; an emptied node is freed unless it is the last one,
+		which is rewound and reused for the next read.
+	*/
+	void chain_buffer::consume( size_t len )
+	{
+		if ( ! chain_head )
+		{
+		    return;
+		}
+		chain_head->begin += len;
+		chain_size -= len;
+		if ( chain_head->begin < chain_head->end )
+		{
+		    return;
+		}
+		if ( chain_head->next )
+		{
+		    node* next = chain_head->next;
+		    free_node( chain_head );
+		    chain_head = next;
+		}
+		else
+		{
+		    chain_head->begin = 0;
+		    chain_head->end = 0;
+		}
+	}
+
+	/*
+		move bytes of the following nodes into the first one, growing it up to
+		max_size when it is already full. returns false when nothing could move.
+		the bytes of the first node may change address.
+	*/
+	bool chain_buffer::pullup( size_t max_size )
+	{
+		node* f = chain_head;
+		if ( ! f || ! f->next )
+		{
+		    return false;
+		}
+
+		if ( f->begin > 0 )
+		{
+		    memmove( f->data(), f->data() + f->begin, f->end - f->begin );
+		    f->end -= f->begin;
+		    f->begin = 0;
+		}
+		if ( f->end == f->cap )
+		{
+		    if ( f->cap >= max_size )
+		    {
+		        return false;
+		    }
+		    size_t cap = f->cap * 2 < max_size ? f->cap * 2 : max_size;
+		    node* g = new_node( cap );
+		    if ( ! g )
+		    {
+		        return false;
+		    }
+		    memcpy( g->data(), f->data(), f->end );
+		    g->end = f->end;
+		    g->next = f->next;
+		    chain_head = g;
+		    free_node( f );
+		    f = g;
+		}
+
+		while ( f->next && f->end < f->cap )
+		{
+		    node* n = f->next;
+		    size_t take = n->end - n->begin;
+		    if ( take > f->cap - f->end )
+		    {
+		        take = f->cap - f->end;
+		    }
+		    memcpy( f->data() + f->end, n->data() + n->begin, take );
+		    f->end += take;
+		    n->begin += take;
+		    if ( n->begin == n->end )
+		    {
+		        f->next = n->next;
+		        if ( chain_tail == n )
+		        {
+		            chain_tail = f;
+		        }
+		        free_node( n );
+		    }
+		}
+		return true;
+	}
+
+	//take over a pool block someone else filled, e.g. an io_uring provided buffer
+	void chain_buffer::adopt( char* block, size_t len )
+	{
+		if ( chain_size == 0 )
+		{
+		    //an emptied block would only make the parser copy the new one into it
+		    clear();
+		}
+		node* n = ( node* )block;
+		n->next = NULL;
+		n->cap = block_cap();
+		n->begin = 0;
+		n->end = len;
+		n->pooled = true;
+		push_back( n );
+		chain_size += len;
+	}
+
+	//move all of other's bytes behind ours, other must draw from the same pool
+	void chain_buffer::splice( chain_buffer& other )
+	{
+		if ( ! other.chain_head )
+		{
+		    return;
+		}
+		if ( chain_size == 0 )
+		{
+		    clear();
+		}
+		push_back( other.chain_head );
+		chain_tail = other.chain_tail;
+		chain_size += other.chain_size;
+		other.chain_head = NULL;
+		other.chain_tail = NULL;
+		other.chain_size = 0;
+	}
+
+	/*
+		readv into the free end of the last node and a fresh block, until the
+		socket is drained or max_size bytes are buffered. returns the bytes read,
+		0 when the peer closed, -1 with errno set otherwise (EAGAIN included).
+	*/
+	ssize_t chain_buffer::read_fd( int fd, size_t max_size )
+	{
+		if ( chain_size >= max_size )
+		{
+		    errno = ENOBUFS;
+		    return -1;
+		}
+
+		ssize_t total = 0;
+		while ( chain_size < max_size )
+		{
+		    if ( ! chain_tail || chain_tail->end == chain_tail->cap )
+		    {
+		        node* n = new_node( block_cap() );
+		        if ( ! n )
+		        {
+		            errno = ENOMEM;
+		            return total > 0 ? total : -1;
+		        }
+		        push_back( n );
+		    }
+
+		    struct iovec iv[ 2 ];
+		    iv[ 0 ].iov_base = chain_tail->data() + chain_tail->end;
+		    iv[ 0 ].iov_len = chain_tail->cap - chain_tail->end;
+		    int count = 1;
+		    node* spare = NULL;
+		    if ( iv[ 0 ].iov_len < block_cap() )
+		    {
+		        spare = new_node( block_cap() );
+		        if ( spare )
+		        {
+		            iv[ 1 ].iov_base = spare->data();
+		            iv[ 1 ].iov_len = spare->cap;
+		            count = 2;
+		        }
+		    }
+
+		    ssize_t bytes_read = readv( fd, iv, count );
+		    if ( bytes_read <= 0 )
+		    {
+		        if ( spare )
+		        {
+		            free_node( spare );
+		        }
+		        if ( total > 0 && ( bytes_read == 0 || errno == EAGAIN || errno == EWOULDBLOCK ) )
+		        {
+		            //report the data now, a close is seen on the next read
+		            return total;
+		        }
+		        return bytes_read;
+		    }
+
+		    size_t first = ( size_t )bytes_read < iv[ 0 ].iov_len ? bytes_read : iv[ 0 ].iov_len;
+		    chain_tail->end += first;
+		    if ( spare )
+		    {
+		        if ( ( size_t )bytes_read > first )
+		        {
+		            spare->end = bytes_read - first;
+		            push_back( spare );
+		        }
+		        else
+		        {
+		            free_node( spare );
+		        }
+		    }
+		    chain_size += bytes_read;
+		    total += bytes_read;
+
+		    size_t asked = iv[ 0 ].iov_len + ( count == 2 ? iv[ 1 ].iov_len : 0 );
+		    if ( ( size_t )bytes_read < asked )
+		    {
+		        //short read, the socket is drained; the event loop rearms the fd anyway
+		        break;
+		    }
+		}
+		return total;
+	}
+}
@@ -0,0 +1,66 @@
+#ifndef CHAIN_BUFFER_H
+#define CHAIN_BUFFER_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "block_pool.h"
+
+namespace mj{
+	/*
+		byte queue made of blocks from a block_pool, with a heap node for the
+		rare piece that is larger than a block. bytes handed out by reserve()
+		or append() never move, so a writev can point straight at them; the
+		first node is where the request parser works in place, pullup() makes
+		it hold a request that was spread over several blocks.
+	*/
+	class chain_buffer
+	{
+	public:
+		chain_buffer();
+		~chain_buffer();
+
+		void init( block_pool* pool );
+		void clear();
+		size_t size() const { return chain_size; }
+
+		//write side
+		char* reserve( size_t len );
+		void commit( size_t len );
+		char* append( const char* data, size_t len );
+
+		//read side
+		char* front() const;
+		size_t front_size() const;
+		void consume( size_t len );
+		bool pullup( size_t max_size );
+		ssize_t read_fd( int fd, size_t max_size );
+
+		//blocks filled outside the chain: data starts block_offset() into a block of the pool
+		static size_t block_offset() { return sizeof( node ); }
+		void adopt( char* block, size_t len );
+		void splice( chain_buffer& other );
+
+	private:
+		struct node
+		{
+			node* next;
+			size_t cap;
+			size_t begin;
+			size_t end;
+			bool pooled;
+			char* data() { return ( char* )( this + 1 ); }
+		};
+
+		node* new_node( size_t cap );
+		void free_node( node* n );
+		void push_back( node* n );
+		size_t block_cap() const { return chain_pool->block_size() - sizeof( node ); }
+
+	private:
+		block_pool* chain_pool;
+		node* chain_head;
+		node* chain_tail;
+		size_t chain_size;
+	};
+}
+#endif
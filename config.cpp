@@ -0,0 +1,290 @@
+/*
+	config.cpp
+	settings table, config file parsing and key=value overrides
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "config.h"
+
+namespace mj{
+	enum SETTING_TYPE { SETTING_INT, SETTING_BOOL, SETTING_STRING, SETTING_CHOICE };
+
+	struct setting
+	{
+		const char* key;
+		SETTING_TYPE type;
+		size_t offset;
+		size_t size;
+		int min;                    //smallest value, shortest string accepted
+		const char* choices;        //SETTING_CHOICE: names separated by '|'
+		bool reloadable;
+		const char* help;
+	};
+
+#define INT_SETTING( field, min, reload, help ) \
+	{ #field, SETTING_INT, offsetof( server_config, field ), sizeof( int ), min, NULL, reload, help }
+#define CHOICE_SETTING( field, choices, help ) \
+	{ #field, SETTING_CHOICE, offsetof( server_config, field ), sizeof( int ), 0, choices, false, help }
+#define STRING_SETTING( field, min, reload, help ) \
+	{ #field, SETTING_STRING, offsetof( server_config, field ), sizeof( ( ( server_config* )0 )->field ), min, NULL, \
+	  reload, help }
+
+	static const setting settings[] = {
+		INT_SETTING( port, 1, false, "tcp port" ),
+		INT_SETTING( loops, 1, false, "event loops, each with its own listener" ),
+		CHOICE_SETTING( backend, "epoll|uring|coro", "event loop backend, coro needs make CORO=1" ),
+		CHOICE_SETTING( send_mode, "mmap|sendfile", "how large files are sent" ),
+		CHOICE_SETTING( queue_mode, "locked|lockfree", "worker queue implementation" ),
+		INT_SETTING( worker_threads, 1, false, "worker threads, split between nodes when pinned" ),
+		INT_SETTING( compress_threads, 0, false, "background gzip / br threads, 0 disables" ),
+		INT_SETTING( max_fd, 64, false, "size of each loop's connection table" ),
+		INT_SETTING( max_events, 1, false, "events taken per epoll_wait" ),
+		INT_SETTING( queue_size, 1, false, "requests a worker pool queues" ),
+		INT_SETTING( cache_mb, 0, false, "file cache size, 0 disables the cache" ),
+		INT_SETTING( cache_entries, 0, false, "file cache entries" ),
+		{ "pin_threads", SETTING_BOOL, offsetof( server_config, pin_threads ), sizeof( int ), 0, NULL, false,
+		  "pin loops and workers by NUMA node" },
+		INT_SETTING( read_block, 1024, false, "read buffer block bytes" ),
+		INT_SETTING( write_block, 2048, false, "write buffer block bytes" ),
+		INT_SETTING( max_header, 1024, false, "largest request header accepted" ),
+		INT_SETTING( backlog, 1, false, "listen queue length" ),
+		INT_SETTING( defer_accept, 0, false, "TCP_DEFER_ACCEPT seconds, 0 is off" ),
+		INT_SETTING( fastopen, 0, false, "TCP_FASTOPEN queue length, 0 is off" ),
+		STRING_SETTING( metrics_path, 1, false, "url answered with the metrics" ),
+		STRING_SETTING( pattern_path, 0, false, "path/<bytes> streams a generated body, empty is off" ),
+		INT_SETTING( max_body_mb, 0, false, "largest request body accepted" ),
+		STRING_SETTING( access_log, 0, false, "access log file, empty logs nothing" ),
+		INT_SETTING( access_log_ring, 2, false, "access log records each thread buffers before dropping" ),
+		INT_SETTING( access_log_rotate_mb, 0, false, "size the access log is rotated at, 0 never rotates" ),
+		INT_SETTING( access_log_keep, 1, false, "rotated access logs kept" ),
+		STRING_SETTING( doc_root, 1, true, "directory files are served from" ),
+		STRING_SETTING( upload_root, 0, true, "directory POST and PUT bodies are stored in, empty refuses them" ),
+		INT_SETTING( cache_ttl, 0, true, "seconds before a cached file is checked again" ),
+		INT_SETTING( header_timeout, 0, true, "seconds to receive a request header, 0 is off" ),
+		INT_SETTING( body_timeout, 0, true, "seconds between reads of a request body, 0 is off" ),
+		INT_SETTING( keep_alive_timeout, 0, true, "seconds an idle connection is kept, 0 is off" ),
+		INT_SETTING( write_timeout, 0, true, "seconds without write progress, 0 is off" ),
+		INT_SETTING( admission_target, 0, true, "queue wait ms before shedding, 0 disables admission control" ),
+		INT_SETTING( admission_interval, 1, true, "ms the wait must stay above target" ),
+		INT_SETTING( access_log_sample, 1, true, "log one request in this many" ),
+	};
+
+#undef INT_SETTING
+#undef CHOICE_SETTING
+#undef STRING_SETTING
+
+	void config_defaults( server_config& config )
+	{
+		memset( &config, 0, sizeof( config ) );
+		config.port = 0;
+		config.loops = 1;
+		config.backend = 0;
+		config.send_mode = 1;
+		config.queue_mode = 1;
+		config.worker_threads = 20;
+		config.compress_threads = 2;
+		config.max_fd = 65536;
+		config.max_events = 30000;
+		config.queue_size = 30000;
+		config.cache_mb = 64;
+		config.cache_entries = 4096;
+		config.pin_threads = 0;
+		config.read_block = 4096;
+		config.write_block = 2048;
+		config.max_header = 65536;
+		config.backlog = 4096;
+		config.defer_accept = 0;
+		config.fastopen = 0;
+		strcpy( config.metrics_path, "/metrics" );
+		config.max_body_mb = 1024;
+		config.access_log_ring = 4096;
+		config.access_log_rotate_mb = 0;
+		config.access_log_keep = 4;
+		strcpy( config.doc_root, "/var/www/html" );
+		config.cache_ttl = 2;
+		config.header_timeout = 10;
+		config.body_timeout = 30;
+		config.keep_alive_timeout = 60;
+		config.write_timeout = 30;
+		config.admission_target = 5;
+		config.admission_interval = 100;
+		config.access_log_sample = 1;
+	}
+
+	static const setting* find_setting( const char* key )
+	{
+		for ( size_t i = 0; i < sizeof( settings ) / sizeof( settings[0] ); ++i )
+		{
+		    if ( strcmp( settings[i].key, key ) == 0 )
+		    {
+		        return &settings[i];
+		    }
+		}
+		return NULL;
+	}
+
+	bool config_set( server_config& config, const char* key, const char* value, char* message, size_t len )
+	{
+		const setting* s = find_setting( key );
+		if ( ! s )
+		{
+		    snprintf( message, len, "unknown setting %s", key );
+		    return false;
+		}
+		char* field = ( char* )&config + s->offset;
+		switch ( s->type )
+		{
+		    case SETTING_INT:
+		    {
+		        char* end;
+		        errno = 0;
+		        long number = strtol( value, &end, 10 );
+		        if ( errno || end == value || *end || number < s->min || number > 0x7fffffff )
+		        {
+		            snprintf( message, len, "%s must be an integer of at least %d", key, s->min );
+		            return false;
+		        }
+		        *( int* )field = ( int )number;
+		        return true;
+		    }
+		    case SETTING_BOOL:
+		    {
+		        if ( strcmp( value, "1" ) == 0 || strcmp( value, "yes" ) == 0 || strcmp( value, "on" ) == 0 )
+		        {
+		            *( int* )field = 1;
+		        }
+		        else if ( strcmp( value, "0" ) == 0 || strcmp( value, "no" ) == 0 || strcmp( value, "off" ) == 0 )
+		        {
+		            *( int* )field = 0;
+		        }
+		        else
+		        {
+		            snprintf( message, len, "%s must be yes or no", key );
+		            return false;
+		        }
+		        return true;
+		    }
+		    case SETTING_STRING:
+		    {
+		        size_t value_len = strlen( value );
+		        if ( value_len < ( size_t )s->min || value_len >= s->size )
+		        {
+		            snprintf( message, len, "%s must be %d to %d characters", key, s->min, ( int )s->size - 1 );
+		            return false;
+		        }
+		        memcpy( field, value, value_len + 1 );
+		        return true;
+		    }
+		    case SETTING_CHOICE:
+		    {
+		        const char* p = s->choices;
+		        size_t value_len = strlen( value );
+		        for ( int index = 0; *p; ++index )
+		        {
+		            size_t choice_len = strcspn( p, "|" );
+		            if ( choice_len == value_len && strncmp( p, value, value_len ) == 0 )
+		            {
+		                *( int* )field = index;
+		                return true;
+		            }
+		            p += choice_len;
+		            p += ( *p == '|' );
+		        }
+		        snprintf( message, len, "%s must be one of %s", key, s->choices );
+		        return false;
+		    }
+		}
+		return false;
+	}
+
+	bool config_load( server_config& config, const char* path )
+	{
+		FILE* file = fopen( path, "r" );
+		if ( ! file )
+		{
+		    printf( "%s: cannot open, errno is: %d\n", path, errno );
+		    return false;
+		}
+		char line[ 2048 ];
+		int number = 0;
+		bool ok = true;
+		while ( fgets( line, sizeof( line ), file ) )
+		{
+		    number++;
+		    line[ strcspn( line, "#\r\n" ) ] = '\0';
+		    char* key = line + strspn( line, " \t" );
+		    if ( *key == '\0' )
+		    {
+		        continue;
+		    }
+		    char* equal = strchr( key, '=' );
+		    if ( ! equal )
+		    {
+		        printf( "%s:%d: expected key = value\n", path, number );
+		        ok = false;
+		        continue;
+		    }
+		    char* key_end = equal;
+		    while ( key_end > key && ( key_end[-1] == ' ' || key_end[-1] == '\t' ) )
+		    {
+		        key_end--;
+		    }
+		    *key_end = '\0';
+		    char* value = equal + 1;
+		    value += strspn( value, " \t" );
+		    size_t value_len = strlen( value );
+		    while ( value_len > 0 && ( value[ value_len - 1 ] == ' ' || value[ value_len - 1 ] == '\t' ) )
+		    {
+		        value[ --value_len ] = '\0';
+		    }
+
+		    char message[ 256 ];
+		    if ( ! config_set( config, key, value, message, sizeof( message ) ) )
+		    {
+		        printf( "%s:%d: %s\n", path, number, message );
+		        ok = false;
+		    }
+		}
+		fclose( file );
+		return ok;
+	}
+
+	bool config_structural_changes( const server_config& old_config, const server_config& new_config,
+	            char* names, size_t len )
+	{
+		size_t pos = 0;
+		names[0] = '\0';
+		for ( size_t i = 0; i < sizeof( settings ) / sizeof( settings[0] ); ++i )
+		{
+		    const setting& s = settings[i];
+		    const char* a = ( const char* )&old_config + s.offset;
+		    const char* b = ( const char* )&new_config + s.offset;
+		    bool same = ( s.type == SETTING_STRING ) ? strcmp( a, b ) == 0 : memcmp( a, b, s.size ) == 0;
+		    if ( s.reloadable || same )
+		    {
+		        continue;
+		    }
+		    int n = snprintf( names + pos, len - pos, "%s%s", pos ? " " : "", s.key );
+		    if ( n < 0 || ( size_t )n >= len - pos )
+		    {
+		        break;
+		    }
+		    pos += n;
+		}
+		return pos > 0;
+	}
+
+	void config_print_keys()
+	{
+		for ( size_t i = 0; i < sizeof( settings ) / sizeof( settings[0] ); ++i )
+		{
+		    const setting& s = settings[i];
+		    printf( "    %-20s %s%s%s%s\n", s.key, s.help, s.choices ? " (" : "", s.choices ? s.choices : "",
+		            s.choices ? ")" : "" );
+		}
+		printf( "    settings marked reloadable: doc_root upload_root cache_ttl *_timeout admission_* access_log_sample\n" );
+	}
+}
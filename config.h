@@ -0,0 +1,67 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stddef.h>
+
+namespace mj{
+	/*
+		every runtime setting of the server. the defaults are overridden by
+		the config file, then by the command line. on SIGHUP the file is
+		read again, the command line reapplied on top, and the reloadable
+		settings take effect; the others stay as they were until a restart.
+		enum settings hold the index of their name in the key's choices,
+		which follows the order of the matching enum.
+	*/
+	struct server_config
+	{
+		int port;
+		int loops;
+		int backend;                //event_loop::BACKEND
+		int send_mode;              //http_business::SEND_MODE
+		int queue_mode;             //threadpool::QUEUE_MODE
+		int worker_threads;
+		int compress_threads;
+		int max_fd;
+		int max_events;             //per epoll_wait
+		int queue_size;             //requests a worker pool queues
+		int cache_mb;
+		int cache_entries;
+		int pin_threads;
+		int read_block;
+		int write_block;
+		int max_header;
+		int backlog;
+		int defer_accept;
+		int fastopen;
+		char metrics_path[ 128 ];
+		char pattern_path[ 128 ];   //empty serves no generated bodies
+		int max_body_mb;
+		char access_log[ 1024 ];    //empty logs nothing
+		int access_log_ring;
+		int access_log_rotate_mb;
+		int access_log_keep;
+
+		//reloadable
+		char doc_root[ 1024 ];
+		char upload_root[ 1024 ];   //empty refuses POST and PUT
+		int cache_ttl;
+		int header_timeout;
+		int body_timeout;
+		int keep_alive_timeout;
+		int write_timeout;
+		int admission_target;
+		int admission_interval;
+		int access_log_sample;
+	};
+
+	void config_defaults( server_config& config );
+	//false for an unknown key or a value out of range, message says which
+	bool config_set( server_config& config, const char* key, const char* value, char* message, size_t len );
+	//"key = value" lines, '#' starts a comment
+	bool config_load( server_config& config, const char* path );
+	//names of the settings that differ and need a restart, false when there are none
+	bool config_structural_changes( const server_config& old_config, const server_config& new_config,
+	            char* names, size_t len );
+	void config_print_keys();
+}
+#endif
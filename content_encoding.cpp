@@ -0,0 +1,144 @@
+/*
+	content_encoding.cpp
+	gzip and brotli body compression, Accept-Encoding parsing
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include "content_encoding.h"
+
+namespace mj{
+	static const int GZIP_LEVEL = 9;
+	static const int BROTLI_QUALITY = 9;
+
+	const char* encoding_name( ENCODING encoding )
+	{
+		switch ( encoding )
+		{
+		    case ENCODING_GZIP:
+		        return "gzip";
+		    case ENCODING_BR:
+		        return "br";
+		    default:
+		        return "";
+		}
+	}
+
+	int parse_accept_encoding( const char* value )
+	{
+		int mask = 0;
+		const char* p = value;
+		while ( *p )
+		{
+		    p += strspn( p, " \t," );
+		    size_t len = strcspn( p, " \t,;" );
+		    const char* token = p;
+		    p += len;
+		    p += strspn( p, " \t" );
+
+		    bool refused = false;
+		    if ( *p == ';' )
+		    {
+		        //only q=0 matters, any other weight still allows the coding
+		        const char* q = p + 1 + strspn( p + 1, " \t" );
+		        if ( ( q[0] | 0x20 ) == 'q' && q[1] == '=' )
+		        {
+		            q += 2;
+		            refused = q[0] == '0' && ( q[1] != '.' || strspn( q + 2, "0" ) == strcspn( q + 2, " \t," ) );
+		        }
+		        p += strcspn( p, "," );
+		    }
+		    if ( refused || len == 0 )
+		    {
+		        continue;
+		    }
+		    if ( len == 4 && strncasecmp( token, "gzip", 4 ) == 0 )
+		    {
+		        mask |= 1 << ENCODING_GZIP;
+		    }
+		    else if ( len == 2 && strncasecmp( token, "br", 2 ) == 0 )
+		    {
+		        mask |= 1 << ENCODING_BR;
+		    }
+		    else if ( len == 1 && token[0] == '*' )
+		    {
+		        mask |= ( 1 << ENCODING_GZIP ) | ( 1 << ENCODING_BR );
+		    }
+		}
+		return mask;
+	}
+
+	static bool encode_gzip( const char* data, size_t len, char* out, size_t* out_len )
+	{
+		z_stream stream;
+		memset( &stream, 0, sizeof( stream ) );
+		//window bits 15 + 16 asks for the gzip wrapper instead of zlib's
+		if ( deflateInit2( &stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY ) != Z_OK )
+		{
+		    return false;
+		}
+		stream.next_in = ( Bytef* )data;
+		stream.avail_in = len;
+		stream.next_out = ( Bytef* )out;
+		stream.avail_out = *out_len;
+		int ret = deflate( &stream, Z_FINISH );
+		*out_len = stream.total_out;
+		deflateEnd( &stream );
+		return ret == Z_STREAM_END;
+	}
+
+	bool encode_buffer( ENCODING encoding, const char* data, size_t len, size_t max_len,
+	            char** out, size_t* out_len )
+	{
+		size_t bound;
+		if ( encoding == ENCODING_GZIP )
+		{
+		    //deflateBound() needs a stream, this is its documented worst case plus the gzip wrapper
+		    bound = len + ( len >> 12 ) + ( len >> 14 ) + ( len >> 25 ) + 13 + 18;
+		}
+		else if ( encoding == ENCODING_BR )
+		{
+		    bound = BrotliEncoderMaxCompressedSize( len );
+		}
+		else
+		{
+		    return false;
+		}
+		if ( bound == 0 )
+		{
+		    return false;
+		}
+
+		char* buf = ( char* )malloc( bound );
+		if ( ! buf )
+		{
+		    return false;
+		}
+		size_t size = bound;
+		bool ok;
+		if ( encoding == ENCODING_GZIP )
+		{
+		    ok = encode_gzip( data, len, buf, &size );
+		}
+		else
+		{
+		    ok = BrotliEncoderCompress( BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+		            len, ( const uint8_t* )data, &size, ( uint8_t* )buf ) == BROTLI_TRUE;
+		}
+		if ( ! ok || size >= max_len )
+		{
+		    free( buf );
+		    return false;
+		}
+		*out = ( char* )realloc( buf, size );
+		if ( ! *out )
+		{
+		    *out = buf;
+		}
+		*out_len = size;
+		return true;
+	}
+}
@@ -0,0 +1,23 @@
+#ifndef CONTENT_ENCODING_H
+#define CONTENT_ENCODING_H
+
+#include <stddef.h>
+
+namespace mj{
+	/*
+		gzip (zlib) and brotli compression of whole bodies, for the encoded
+		variants the file cache keeps next to the plain files.
+	*/
+	enum ENCODING { ENCODING_IDENTITY, ENCODING_GZIP, ENCODING_BR, ENCODING_COUNT };
+
+	//token for Content-Encoding, "" for identity
+	const char* encoding_name( ENCODING encoding );
+
+	//bit ( 1 << ENCODING ) for every coding an Accept-Encoding value allows
+	int parse_accept_encoding( const char* value );
+
+	//malloc'd output in *out, false when it fails or doesn't come out smaller than max_len
+	bool encode_buffer( ENCODING encoding, const char* data, size_t len, size_t max_len,
+	            char** out, size_t* out_len );
+}
+#endif
@@ -0,0 +1,319 @@
+/*
+	coro_loop.cpp
+	one coroutine per connection on an edge-triggered epoll loop
+*/
+
+#include "coro_loop.h"
+#include "public_func.h"
+
+namespace mj{
+	coro_loop::coro_loop( int port, threadpool< http_business >* pool, int max_fd, int max_events ) :
+		    event_loop( port, pool, max_fd, max_events ), loop_epollfd( -1 ), loop_events( NULL ),
+		    loop_accept_pending( false ), loop_states( NULL )
+	{
+	}
+
+	coro_loop::~coro_loop()
+	{
+		if( loop_states )
+		{
+		    //the connections themselves are closed by ~event_loop
+		    for( int i = 0; i < loop_max_fd; ++i )
+		    {
+		        if( loop_states[i] )
+		        {
+		            loop_states[i]->coro.destroy();
+		            delete loop_states[i];
+		        }
+		    }
+		    free( loop_states );
+		}
+		if( loop_epollfd != -1 )
+		{
+		    close( loop_epollfd );
+		}
+		delete [] loop_events;
+	}
+
+	bool coro_loop::open_backend()
+	{
+		loop_states = ( conn_state** )calloc( loop_max_fd, sizeof( conn_state* ) );
+		loop_epollfd = epoll_create( 5 );
+		if( ! loop_states || loop_epollfd == -1 )
+		{
+		    return false;
+		}
+		addfd( loop_epollfd, loop_listenfd, false );
+		addfd( loop_epollfd, loop_wake_fd, false );
+		loop_events = new epoll_event[ loop_max_events ];
+		return true;
+	}
+
+	/*
+		the life of a connection, one request after another: its request
+		line and headers line by line, routing it, its body as it comes,
+		then the next. the answers queue up and go out together whenever
+		the input runs out, the table is full or the connection is to close.
+	*/
+	coro_loop::conn_task coro_loop::serve( conn_state& s )
+	{
+		http_business& conn = *s.conn;
+		while( true )
+		{
+		    if( ! conn.room_for_response() && ! co_await sent( s ) )
+		    {
+		        co_return;
+		    }
+
+		    //the request line, then header lines up to the empty one
+		    http_business::HTTP_CODE code = http_business::INCOMPLETE_REQUEST;
+		    for( bool first = true; code == http_business::INCOMPLETE_REQUEST && ! conn.reading_body(); first = false )
+		    {
+		        char* text;
+		        http_business::LINE_STATUS line = conn.next_line( text );
+		        while( line == http_business::LINE_OPEN && ! conn.header_full() )
+		        {
+		            if( ! co_await more_input( s ) )
+		            {
+		                co_return;
+		            }
+		            line = conn.next_line( text );
+		        }
+		        if( line != http_business::LINE_OK )
+		        {
+		            code = line == http_business::LINE_BAD ? http_business::BAD_REQUEST : http_business::TOO_LARGE_REQUEST;
+		            break;
+		        }
+		        code = first ? conn.request_line( text ) : conn.header( text );
+		    }
+
+		    //routed here when the file cache has what it takes, by a worker otherwise
+		    if( code == http_business::GET_REQUEST || code == http_business::INCOMPLETE_REQUEST )
+		    {
+		        code = co_await step( s, &http_business::route );
+		    }
+		    else
+		    {
+		        code = conn.answer( code );
+		    }
+
+		    //the body: read past here, or written to a sink by a worker
+		    while( code == http_business::INCOMPLETE_REQUEST )
+		    {
+		        code = co_await step( s, &http_business::take_content );
+		        if( code == http_business::INCOMPLETE_REQUEST && ! co_await more_input( s ) )
+		        {
+		            co_return;
+		        }
+		    }
+		    if( code == http_business::CLOSED_CONNECTION )
+		    {
+		        co_return;
+		    }
+
+		    //a source produces on a worker, a window at a time once the last one went out
+		    while( conn.producing() )
+		    {
+		        if( ! co_await sent( s ) || co_await on_worker( s, &http_business::produce ) == http_business::CLOSED_CONNECTION )
+		        {
+		            co_return;
+		        }
+		    }
+		    if( conn.last_response() )
+		    {
+		        co_await sent( s );
+		        co_return;
+		    }
+		}
+	}
+
+	/*
+		the socket i/o of progress(), by the coroutine before it suspends and
+		by the loop on each edge while it is suspended. true when the
+		coroutine can go on: input was read, the connection is done with, or
+		all that was queued went out and it waits for nothing else.
+	*/
+	bool coro_loop::advance( conn_state& s )
+	{
+		http_business& conn = *s.conn;
+		if( conn.writing() && ( s.ready & EPOLLOUT ) )
+		{
+		    if( ! conn.write() )
+		    {
+		        s.open = false;
+		        return true;
+		    }
+		    if( conn.writing() )
+		    {
+		        s.ready &= ~EPOLLOUT;
+		    }
+		    else
+		    {
+		        //the last response takes the connection with it
+		        s.open = conn.finish_response();
+		        if( ! s.open )
+		        {
+		            return true;
+		        }
+		        after_write( conn );
+		    }
+		}
+		if( s.ready & s.wanted & EPOLLIN )
+		{
+		    s.ready &= ~EPOLLIN;
+		    size_t before = conn.input_size();
+		    s.open = conn.read();
+		    if( s.open && conn.input_size() >= http_business::max_input_buffered() )
+		    {
+		        //what is left in the socket won't raise another edge; a full buffer that
+		        //nothing could be taken from will never make a request
+		        s.open = conn.input_size() > before;
+		        s.ready |= EPOLLIN;
+		    }
+		    if( s.open )
+		    {
+		        after_read( conn );
+		    }
+		    return true;
+		}
+		s.open = ! ( s.ready & HANGUP );
+		return ! s.open || ( ! s.wanted && ! conn.writing() );
+	}
+
+	bool coro_loop::step_run::await_ready()
+	{
+		code = on_loop ? state.conn->step_cached( step ) : http_business::DEFERRED_REQUEST;
+		return code != http_business::DEFERRED_REQUEST;
+	}
+
+	bool coro_loop::step_run::await_suspend( std::coroutine_handle<> )
+	{
+		state.conn->offload( step );
+		if( ! loop.submit( *state.conn ) )
+		{
+		    state.conn->offload( NULL );
+		    code = http_business::CLOSED_CONNECTION;
+		    return false;
+		}
+		return true;
+	}
+
+	void coro_loop::handle_resumed( http_business& conn )
+	{
+		wake( *loop_states[ conn.sockfd() ] );
+	}
+
+	//runs the coroutine to its next suspension, a finished one takes its connection with it
+	void coro_loop::wake( conn_state& s )
+	{
+		s.coro.resume();
+		if( ! s.coro.done() )
+		{
+		    return;
+		}
+		loop_states[ s.conn->sockfd() ] = NULL;
+		s.coro.destroy();
+		close_conn( *s.conn );
+		delete &s;
+	}
+
+	void coro_loop::handle_accept()
+	{
+		loop_accept_pending = true;
+		while( ! accepts_held() )
+		{
+		    struct sockaddr_in client_address;
+		    socklen_t client_addrlength = sizeof( client_address );
+		    int connfd = accept4( loop_listenfd, ( struct sockaddr* )&client_address, &client_addrlength,
+		            SOCK_NONBLOCK | SOCK_CLOEXEC );
+		    if ( connfd < 0 )
+		    {
+		        if( errno == EINTR || errno == ECONNABORTED )
+		        {
+		            continue;
+		        }
+		        if( errno == EAGAIN || errno == EWOULDBLOCK )
+		        {
+		            loop_accept_pending = false;
+		        }
+		        else
+		        {
+		            printf( "errno is: %d\n", errno );
+		        }
+		        return;
+		    }
+		    http_business* conn = add_conn( connfd, client_address );
+		    if( conn )
+		    {
+		        conn_state* s = new conn_state;
+		        s->conn = conn;
+		        s->ready = EPOLLOUT;
+		        s->wanted = 0;
+		        s->waiting = false;
+		        s->open = true;
+		        loop_states[ connfd ] = s;
+		        addfd_rw( loop_epollfd, connfd );
+		        //runs up to its first wait for input
+		        s->coro = serve( *s ).handle;
+		    }
+		}
+	}
+
+	void coro_loop::run()
+	{
+		while( true )
+		{
+		    if( loop_accept_pending )
+		    {
+		        handle_accept();
+		    }
+		    int timeout = 0;
+		    if( begin_wait() )
+		    {
+		        timeout = loop_wheel->empty() ? -1 : loop_wheel->tick();
+		        if( loop_accept_pending && ( timeout < 0 || timeout > ACCEPT_RETRY_MS ) )
+		        {
+		            timeout = ACCEPT_RETRY_MS;
+		        }
+		    }
+		    int number = epoll_wait( loop_epollfd, loop_events, loop_max_events, timeout );
+		    end_wait();
+		    if ( ( number < 0 ) && ( errno != EINTR ) )
+		    {
+		        printf( "epoll failure\n" );
+		        break;
+		    }
+		    loop_now = timer_wheel::now_ms();
+
+		    for ( int i = 0; i < number; i++ )
+		    {
+		        int sockfd = loop_events[i].data.fd;
+		        if( sockfd == loop_listenfd )
+		        {
+		            handle_accept();
+		            continue;
+		        }
+		        if( sockfd == loop_wake_fd )
+		        {
+		            unsigned long long count;
+		            ::read( loop_wake_fd, &count, sizeof( count ) );
+		            continue;
+		        }
+
+		        conn_state* s = loop_states[sockfd];
+		        if( ! s )
+		        {
+		            continue;
+		        }
+		        //kept while a worker has the connection, the coroutine looks at them when it is back
+		        s->ready |= loop_events[i].events;
+		        if( s->waiting && advance( *s ) )
+		        {
+		            wake( *s );
+		        }
+		    }
+
+		    loop_wheel->advance( loop_now, on_expire, this );
+		}
+	}
+}
@@ -0,0 +1,114 @@
+#ifndef CORO_LOOP_H
+#define CORO_LOOP_H
+
+#include <sys/epoll.h>
+#include <coroutine>
+#include <exception>
+#include "event_loop.h"
+
+namespace mj{
+	/*
+		coroutine backend, built with make CORO=1 (C++20). every connection
+		is a stackless coroutine on its loop that parses its requests
+		straight through, the request line and then each header line as
+		the input comes, co_await-ing more of it in between, and has each
+		one served in steps: routing, the body, a stream's windows. a step
+		runs inline when the file cache has all it needs; anything that may
+		block, a cache miss, the metrics, a custom handler, a sink or a
+		source, is sent to the worker pool explicitly with co_await. the
+		answers of pipelined requests are sent together once the input runs
+		out. readiness is the same edge-triggered, register-once epoll as
+		epoll_loop's, the loop does the socket i/o a suspended coroutine
+		waits on and resumes it once it can go on.
+	*/
+	class coro_loop : public event_loop
+	{
+	public:
+		coro_loop( int port, threadpool< http_business >* pool, int max_fd, int max_events );
+		~coro_loop();
+
+		void run();
+
+	protected:
+		bool open_backend();
+		void handle_resumed( http_business& conn );
+
+	private:
+		//the frame stays after co_return, the loop closes the connection and destroys it
+		struct conn_task
+		{
+			struct promise_type
+			{
+				conn_task get_return_object() { return conn_task( std::coroutine_handle< promise_type >::from_promise( *this ) ); }
+				std::suspend_never initial_suspend() noexcept { return std::suspend_never(); }
+				std::suspend_always final_suspend() noexcept { return std::suspend_always(); }
+				void return_void() {}
+				void unhandled_exception() { std::terminate(); }
+			};
+
+			explicit conn_task( std::coroutine_handle< promise_type > h ) : handle( h ) {}
+			std::coroutine_handle< promise_type > handle;
+		};
+
+		struct conn_state
+		{
+			http_business* conn;
+			std::coroutine_handle<> coro;
+			int ready;              //edges seen and not used up yet; EPOLLOUT stays while the socket has room
+			int wanted;             //what progress() the coroutine waits on reads, EPOLLIN or nothing
+			bool waiting;           //suspended in progress(), false while it runs or a worker has it
+			bool open;              //false once the connection is done with
+		};
+
+		/*
+			sends what is queued and, when events has EPOLLIN, reads what came
+			in; suspends until either can go on. false once the connection is
+			done with: a hang-up, a socket error or the last response sent.
+		*/
+		struct progress
+		{
+			coro_loop& loop;
+			conn_state& state;
+			int events;
+
+			bool await_ready() { state.wanted = events; return loop.advance( state ); }
+			void await_suspend( std::coroutine_handle<> ) { state.waiting = true; }
+			bool await_resume() { state.waiting = false; return state.open; }
+		};
+
+		//runs a step on the loop, on a worker when it asks for one or on_loop is false; CLOSED_CONNECTION when shed
+		struct step_run
+		{
+			coro_loop& loop;
+			conn_state& state;
+			http_business::STEP step;
+			bool on_loop;
+			http_business::HTTP_CODE code;
+
+			bool await_ready();
+			bool await_suspend( std::coroutine_handle<> );
+			http_business::HTTP_CODE await_resume() const
+			{
+				return code == http_business::DEFERRED_REQUEST ? state.conn->step_result() : code;
+			}
+		};
+
+		static const int HANGUP = EPOLLRDHUP | EPOLLHUP | EPOLLERR;
+
+		conn_task serve( conn_state& s );
+		progress more_input( conn_state& s ) { return progress{ *this, s, EPOLLIN }; }
+		progress sent( conn_state& s ) { return progress{ *this, s, 0 }; }
+		step_run step( conn_state& s, http_business::STEP fn ) { return step_run{ *this, s, fn, true, http_business::DEFERRED_REQUEST }; }
+		step_run on_worker( conn_state& s, http_business::STEP fn ) { return step_run{ *this, s, fn, false, http_business::DEFERRED_REQUEST }; }
+		bool advance( conn_state& s );
+		void wake( conn_state& s );
+		void handle_accept();
+
+	private:
+		int loop_epollfd;
+		epoll_event* loop_events;
+		bool loop_accept_pending;       //the listen queue may hold connections no edge will report
+		conn_state** loop_states;       //indexed by fd like loop_users
+	};
+}
+#endif
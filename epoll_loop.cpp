@@ -0,0 +1,260 @@
+/*
+	epoll_loop.cpp
+	edge-triggered epoll reactor
+*/
+
+#include "epoll_loop.h"
+#include "public_func.h"
+
+namespace mj{
+	epoll_loop::epoll_loop( int port, threadpool< http_business >* pool, int max_fd, int max_events ) :
+		    event_loop( port, pool, max_fd, max_events ), loop_epollfd( -1 ), loop_events( NULL ),
+		    loop_accept_pending( false )
+	{
+	}
+
+	epoll_loop::~epoll_loop()
+	{
+		if( loop_epollfd != -1 )
+		{
+		    close( loop_epollfd );
+		}
+		delete [] loop_events;
+	}
+
+	bool epoll_loop::open_backend()
+	{
+		loop_epollfd = epoll_create( 5 );
+		if( loop_epollfd == -1 )
+		{
+		    return false;
+		}
+		addfd( loop_epollfd, loop_listenfd, false );
+		addfd( loop_epollfd, loop_wake_fd, false );
+		loop_events = new epoll_event[ loop_max_events ];
+		return true;
+	}
+
+	epoll_loop::FLUSH_RESULT epoll_loop::flush( http_business& conn )
+	{
+		if( ! conn.writing() )
+		{
+		    return FLUSH_NONE;
+		}
+		if( ! conn.write() )
+		{
+		    return FLUSH_CLOSE;
+		}
+		if( conn.writing() )
+		{
+		    return FLUSH_BLOCKED;
+		}
+		return conn.finish_response() ? FLUSH_DONE : FLUSH_CLOSE;
+	}
+
+	//false when the request was shed and the connection closed
+	bool epoll_loop::dispatch( http_business& conn )
+	{
+		conn.http_busy = submit( conn );
+		if( ! conn.http_busy )
+		{
+		    close_conn( conn );
+		    return false;
+		}
+		return true;
+	}
+
+	/*
+		one edge stands for every connection queued behind it, so the queue
+		is drained until EAGAIN. when that is cut short, by held accepts or
+		running out of fds, run() comes back to it on a short timeout.
+	*/
+	void epoll_loop::handle_accept()
+	{
+		loop_accept_pending = true;
+		while( ! accepts_held() )
+		{
+		    struct sockaddr_in client_address;
+		    socklen_t client_addrlength = sizeof( client_address );
+		    int connfd = accept4( loop_listenfd, ( struct sockaddr* )&client_address, &client_addrlength,
+		            SOCK_NONBLOCK | SOCK_CLOEXEC );
+		    if ( connfd < 0 )
+		    {
+		        if( errno == EINTR || errno == ECONNABORTED )
+		        {
+		            continue;
+		        }
+		        if( errno == EAGAIN || errno == EWOULDBLOCK )
+		        {
+		            loop_accept_pending = false;
+		        }
+		        else
+		        {
+		            printf( "errno is: %d\n", errno );
+		        }
+		        return;
+		    }
+		    http_business* conn = add_conn( connfd, client_address );
+		    if( conn )
+		    {
+		        conn->http_busy = false;
+		        conn->http_events = 0;
+		        addfd_rw( loop_epollfd, connfd );
+		    }
+		}
+	}
+
+	//false when the connection was closed
+	bool epoll_loop::handle_read( http_business& conn )
+	{
+		if( conn.splicing_body() && ! conn.writing() )
+		{
+		    //the worker splices the socket into the upload, nothing is read here
+		    after_read( conn );
+		    return dispatch( conn );
+		}
+		if( ! conn.read() )
+		{
+		    close_conn( conn );
+		    return false;
+		}
+		if( conn.input_size() >= http_business::max_input_buffered() )
+		{
+		    //what is left in the socket won't raise another edge
+		    conn.http_events |= EPOLLIN;
+		}
+		if( conn.writing() )
+		{
+		    //pipelined input waits until the queued output drains
+		    return true;
+		}
+		after_read( conn );
+		return dispatch( conn );
+	}
+
+	void epoll_loop::handle_write( http_business& conn )
+	{
+		after_flush( conn, flush( conn ) );
+	}
+
+	void epoll_loop::after_flush( http_business& conn, FLUSH_RESULT result )
+	{
+		int events = conn.http_events;
+		conn.http_events = 0;
+		if( result == FLUSH_CLOSE || ( events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) ) )
+		{
+		    close_conn( conn );
+		    return;
+		}
+		if( result != FLUSH_NONE )
+		{
+		    after_write( conn );
+		}
+		if( events & EPOLLIN )
+		{
+		    if( ! handle_read( conn ) )
+		    {
+		        return;
+		    }
+		}
+		else if( result == FLUSH_DONE && ( conn.pending_input() || conn.producing() ) && ! dispatch( conn ) )
+		{
+		    return;
+		}
+		if( ( events & EPOLLOUT ) && ! conn.http_busy && conn.writing() )
+		{
+		    handle_write( conn );
+		}
+	}
+
+	//worker side: the response goes out right away, EPOLLOUT is only waited for on EAGAIN
+	void epoll_loop::resume( http_business& conn )
+	{
+		conn.http_flushed = flush( conn );
+		event_loop::resume( conn );
+	}
+
+	void epoll_loop::handle_resumed( http_business& conn )
+	{
+		conn.http_busy = false;
+		if( conn.http_read_direct )
+		{
+		    //the worker stopped reading at the end of a body, no edge will report what follows
+		    conn.http_read_direct = false;
+		    conn.http_events |= EPOLLIN;
+		}
+		after_flush( conn, ( FLUSH_RESULT )conn.http_flushed );
+	}
+
+	void epoll_loop::run()
+	{
+		while( true )
+		{
+		    if( loop_accept_pending )
+		    {
+		        handle_accept();
+		    }
+		    int timeout = 0;
+		    if( begin_wait() )
+		    {
+		        timeout = loop_wheel->empty() ? -1 : loop_wheel->tick();
+		        if( loop_accept_pending && ( timeout < 0 || timeout > ACCEPT_RETRY_MS ) )
+		        {
+		            timeout = ACCEPT_RETRY_MS;
+		        }
+		    }
+		    int number = epoll_wait( loop_epollfd, loop_events, loop_max_events, timeout );
+		    end_wait();
+		    if ( ( number < 0 ) && ( errno != EINTR ) )
+		    {
+		        printf( "epoll failure\n" );
+		        break;
+		    }
+		    loop_now = timer_wheel::now_ms();
+
+		    for ( int i = 0; i < number; i++ )
+		    {
+		        int sockfd = loop_events[i].data.fd;
+		        if( sockfd == loop_listenfd )
+		        {
+		            handle_accept();
+		            continue;
+		        }
+		        if( sockfd == loop_wake_fd )
+		        {
+		            unsigned long long count;
+		            ::read( loop_wake_fd, &count, sizeof( count ) );
+		            continue;
+		        }
+
+		        http_business* conn = loop_users[sockfd];
+		        if( ! conn )
+		        {
+		            continue;
+		        }
+		        int events = loop_events[i].events;
+		        if( conn->http_busy )
+		        {
+		            conn->http_events |= events;
+		        }
+		        else if( events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
+		        {
+		            close_conn( *conn );
+		        }
+		        else
+		        {
+		            if( ( events & EPOLLIN ) && ! handle_read( *conn ) )
+		            {
+		                continue;
+		            }
+		            if( ( events & EPOLLOUT ) && ! conn->http_busy && conn->writing() )
+		            {
+		                handle_write( *conn );
+		            }
+		        }
+		    }
+
+		    loop_wheel->advance( loop_now, on_expire, this );
+		}
+	}
+}
@@ -0,0 +1,46 @@
+#ifndef EPOLL_LOOP_H
+#define EPOLL_LOOP_H
+
+#include <sys/epoll.h>
+#include "event_loop.h"
+
+namespace mj{
+	/*
+		readiness backend: every fd is registered once, edge-triggered for
+		both directions, and never modified again. a worker sends what it
+		produced itself, the loop only gets involved when the socket is full.
+		edges that arrive while a worker owns a connection are recorded and
+		acted on when it is handed back.
+	*/
+	class epoll_loop : public event_loop
+	{
+	public:
+		epoll_loop( int port, threadpool< http_business >* pool, int max_fd, int max_events );
+		~epoll_loop();
+
+		void run();
+		void resume( http_business& conn );
+		bool direct_input() const { return true; }
+
+	protected:
+		bool open_backend();
+		void handle_resumed( http_business& conn );
+
+	private:
+		//how a flush of the queued output ended
+		enum FLUSH_RESULT { FLUSH_NONE, FLUSH_DONE, FLUSH_BLOCKED, FLUSH_CLOSE };
+
+		static FLUSH_RESULT flush( http_business& conn );
+		void handle_accept();
+		bool handle_read( http_business& conn );
+		void handle_write( http_business& conn );
+		void after_flush( http_business& conn, FLUSH_RESULT result );
+		bool dispatch( http_business& conn );
+
+	private:
+		int loop_epollfd;
+		epoll_event* loop_events;
+		bool loop_accept_pending;       //the listen queue may hold connections no edge will report
+	};
+}
+#endif
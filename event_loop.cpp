@@ -0,0 +1,345 @@
+/*
+	event_loop.cpp
+	listener, connection table and timeouts shared by the reactor backends
+*/
+
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
+#include "event_loop.h"
+#include "epoll_loop.h"
+#include "uring_loop.h"
+#ifdef HTTP_CORO
+#include "coro_loop.h"
+#endif
+#include "public_func.h"
+#include "metrics.h"
+
+namespace mj{
+	conn_timeouts event_loop::loop_timeouts = { { 10 }, { 30 }, { 60 }, { 30 } };
+	listen_options event_loop::loop_listen = { 4096, 0, 0 };
+
+	event_loop* event_loop::create( BACKEND backend, int port, threadpool< http_business >* pool,
+		        int max_fd, int max_events )
+	{
+		if ( backend == BACKEND_URING )
+		{
+		    return new uring_loop( port, pool, max_fd, max_events );
+		}
+#ifdef HTTP_CORO
+		if ( backend == BACKEND_CORO )
+		{
+		    return new coro_loop( port, pool, max_fd, max_events );
+		}
+#endif
+		return new epoll_loop( port, pool, max_fd, max_events );
+	}
+
+	//the mailbox holds what the pool can hand back at once, +1 as the locked queue takes one over its size
+	event_loop::event_loop( int port, threadpool< http_business >* pool, int max_fd, int max_events ) :
+		    loop_port( port ), loop_listenfd( -1 ),
+		    loop_max_fd( max_fd ), loop_max_events( max_events ), loop_users( NULL ),
+		    loop_read_pool( NULL ), loop_write_pool( NULL ), loop_table_pool( NULL ), loop_pool( pool ),
+		    loop_wheel( NULL ), loop_now( 0 ), loop_accepts_held( false ), loop_wake_fd( -1 ), loop_waiting( false ),
+		    loop_mailbox( pool->queue_size() + pool->thread_count() + 1 )
+	{
+	}
+
+	event_loop::~event_loop()
+	{
+		if( loop_listenfd != -1 )
+		{
+		    close( loop_listenfd );
+		}
+		if( loop_users )
+		{
+		    for ( int i = 0; i < loop_max_fd; ++i )
+		    {
+		        if( loop_users[i] )
+		        {
+		            close_conn( *loop_users[i] );
+		        }
+		    }
+		    free( loop_users );
+		}
+		delete loop_read_pool;
+		delete loop_write_pool;
+		delete loop_table_pool;
+		delete loop_wheel;
+		if( loop_wake_fd != -1 )
+		{
+		    close( loop_wake_fd );
+		}
+	}
+
+	bool event_loop::open()
+	{
+		loop_listenfd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+		if( loop_listenfd < 0 )
+		{
+		    return false;
+		}
+		int reuse = 1;
+		if( setsockopt( loop_listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof( reuse ) ) < 0 )
+		{
+		    return false;
+		}
+
+		struct sockaddr_in address;
+		bzero( &address, sizeof( address ) );
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl( INADDR_ANY );
+		address.sin_port = htons( loop_port );
+
+		if( bind( loop_listenfd, ( struct sockaddr* )&address, sizeof( address ) ) < 0 )
+		{
+		    return false;
+		}
+		//both are hints, a kernel without them still serves the port
+		if( loop_listen.defer_accept > 0 )
+		{
+		    setsockopt( loop_listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+		            &loop_listen.defer_accept, sizeof( loop_listen.defer_accept ) );
+		}
+		if( loop_listen.fastopen > 0 )
+		{
+		    setsockopt( loop_listenfd, IPPROTO_TCP, TCP_FASTOPEN,
+		            &loop_listen.fastopen, sizeof( loop_listen.fastopen ) );
+		}
+		if( listen( loop_listenfd, loop_listen.backlog ) < 0 )
+		{
+		    return false;
+		}
+
+		//calloc'd pages stay untouched until a connection lands on them
+		loop_users = ( http_business** )calloc( loop_max_fd, sizeof( http_business* ) );
+		if( ! loop_users )
+		{
+		    return false;
+		}
+		loop_read_pool = new block_pool( http_business::http_read_block_size, POOL_FREE_SLABS );
+		loop_write_pool = new block_pool( http_business::http_write_block_size, POOL_FREE_SLABS );
+		loop_table_pool = new block_pool( http_business::table_size(), POOL_FREE_SLABS );
+		loop_wheel = new timer_wheel( WHEEL_SLOTS, WHEEL_TICK_MS );
+		loop_now = timer_wheel::now_ms();
+		loop_wake_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+		if( loop_wake_fd == -1 )
+		{
+		    return false;
+		}
+		return open_backend();
+	}
+
+	//NULL when the connection was refused, connfd is closed then
+	http_business* event_loop::add_conn( int connfd, const sockaddr_in& addr )
+	{
+		if( connfd >= loop_max_fd )
+		{
+		    send_error( connfd, "Internal server busy" );
+		    metrics::count( COUNTER_REFUSED );
+		    return NULL;
+		}
+		metrics::count( COUNTER_ACCEPTS );
+
+		http_business* conn = new http_business;
+		loop_users[connfd] = conn;
+		conn->init( connfd, addr, this, loop_read_pool, loop_write_pool, loop_table_pool );
+		set_deadline( *conn, http_business::TIMER_HEADER, loop_timeouts.header );
+		return conn;
+	}
+
+	void event_loop::close_conn( http_business& conn )
+	{
+		loop_wheel->remove( &conn.http_timer );
+		loop_users[ conn.sockfd() ] = NULL;
+		conn.close_conn();
+		delete &conn;
+		metrics::count( COUNTER_CLOSES );
+	}
+
+	void event_loop::set_deadline( http_business& conn, http_business::TIMER_PHASE phase, int timeout )
+	{
+		conn.http_timer_phase = phase;
+		if ( timeout <= 0 )
+		{
+		    conn.http_deadline = 0;
+		    loop_wheel->remove( &conn.http_timer );
+		    return;
+		}
+
+		long deadline = loop_now + timeout * 1000L;
+		//a later deadline is picked up lazily when the old one comes up
+		if ( ! loop_wheel->linked( &conn.http_timer ) || deadline < conn.http_timer.expire )
+		{
+		    loop_wheel->add( &conn.http_timer, deadline, loop_now );
+		}
+		conn.http_deadline = deadline;
+	}
+
+	void event_loop::after_read( http_business& conn )
+	{
+		if ( conn.reading_body() )
+		{
+		    set_deadline( conn, http_business::TIMER_BODY, loop_timeouts.body );
+		}
+		else if ( conn.http_timer_phase != http_business::TIMER_HEADER )
+		{
+		    //first bytes of a new request, the header deadline is not extended by later reads
+		    set_deadline( conn, http_business::TIMER_HEADER, loop_timeouts.header );
+		}
+	}
+
+	/*
+		hands a connection with a complete request in its input to the workers.
+		false when it was shed, by the pool's admission control or a full
+		queue: the client has its 503 and the caller closes the connection.
+	*/
+	bool event_loop::submit( http_business& conn )
+	{
+		if( access_log::enabled() )
+		{
+		    conn.http_queued_ns = metrics::now_ns();
+		}
+		if( loop_pool->admit() && loop_pool->append( &conn ) )
+		{
+		    return true;
+		}
+		conn.send_unavailable();
+		metrics::count( COUNTER_SHED );
+		return false;
+	}
+
+	//true while the workers are overloaded, new connections wait in the listen queue meanwhile
+	bool event_loop::accepts_held()
+	{
+		bool held = loop_pool->overloaded();
+		if( held && ! loop_accepts_held )
+		{
+		    metrics::count( COUNTER_ACCEPT_PAUSES );
+		}
+		loop_accepts_held = held;
+		return held;
+	}
+
+	void event_loop::after_write( http_business& conn )
+	{
+		if ( conn.writing() || conn.producing() )
+		{
+		    //each window of a streamed response has the write deadline to go out
+		    set_deadline( conn, http_business::TIMER_WRITE, loop_timeouts.write );
+		}
+		else if ( conn.pending_input() )
+		{
+		    set_deadline( conn, http_business::TIMER_HEADER, loop_timeouts.header );
+		}
+		else
+		{
+		    set_deadline( conn, http_business::TIMER_IDLE, loop_timeouts.keep_alive );
+		}
+	}
+
+	long event_loop::on_expire( wheel_node* node, long now, void* arg )
+	{
+		http_business* conn = ( http_business* )node->owner;
+		if ( conn->http_deadline == 0 )
+		{
+		    return 0;
+		}
+		if ( conn->http_deadline > now )
+		{
+		    return conn->http_deadline;
+		}
+		//a worker may own the connection right now, so don't close it here:
+		//the shutdown surfaces as a hang-up and the normal close path runs
+		shutdown( conn->sockfd(), SHUT_RDWR );
+		return 0;
+	}
+
+	void event_loop::resume( http_business& conn )
+	{
+		while( ! loop_mailbox.push( &conn ) )
+		{
+		    //full only while the loop is busy submitting, it drains before it waits
+		    sched_yield();
+		}
+		//pairs with the fence in begin_wait(): either the loop sees the mail or we see it waiting
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+		if( loop_waiting.load( std::memory_order_relaxed ) && loop_waiting.exchange( false ) )
+		{
+		    unsigned long long one = 1;
+		    ::write( loop_wake_fd, &one, sizeof( one ) );
+		}
+	}
+
+	//hands back what the workers returned, false when more came in and the loop must not block
+	bool event_loop::begin_wait()
+	{
+		http_business* conn;
+		while( loop_mailbox.pop( conn ) )
+		{
+		    handle_resumed( *conn );
+		}
+		loop_waiting.store( true );
+		std::atomic_thread_fence( std::memory_order_seq_cst );
+		if( loop_mailbox.size() > 0 )
+		{
+		    loop_waiting.store( false );
+		    return false;
+		}
+		return true;
+	}
+
+	void* event_loop::worker( void* arg )
+	{
+		event_loop* loop = ( event_loop* )arg;
+		loop->run();
+		return loop;
+	}
+
+	/*
+		classic BPF for the SO_REUSEPORT group: a connection goes to the loop
+		mapped to the cpu that handled its SYN, which RSS and irq affinity
+		tie to a NIC rx queue. the result indexes the group in listen order,
+		loops open one after another so it is the loop number. cpus left out
+		of the map fall back to the kernel's hash.
+	*/
+	bool event_loop::attach_steering( const std::vector< int >& loop_of_cpu )
+	{
+		std::vector< sock_filter > code;
+		sock_filter load = BPF_STMT( BPF_LD | BPF_W | BPF_ABS, ( unsigned )( SKF_AD_OFF + SKF_AD_CPU ) );
+		code.push_back( load );
+		for( size_t cpu = 0; cpu < loop_of_cpu.size(); ++cpu )
+		{
+		    if( loop_of_cpu[ cpu ] < 0 )
+		    {
+		        continue;
+		    }
+		    sock_filter match = BPF_JUMP( BPF_JMP | BPF_JEQ | BPF_K, ( unsigned )cpu, 0, 1 );
+		    sock_filter pick = BPF_STMT( BPF_RET | BPF_K, ( unsigned )loop_of_cpu[ cpu ] );
+		    code.push_back( match );
+		    code.push_back( pick );
+		}
+		sock_filter other = BPF_STMT( BPF_RET | BPF_K, 0xffffffff );
+		code.push_back( other );
+		if( code.size() > BPF_MAXINSNS )
+		{
+		    return false;
+		}
+
+		sock_fprog prog;
+		prog.len = code.size();
+		prog.filter = &code[0];
+		return setsockopt( loop_listenfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof( prog ) ) == 0;
+	}
+
+	bool event_loop::start()
+	{
+		return pthread_create( &loop_thread, NULL, worker, this ) == 0;
+	}
+
+	void event_loop::join()
+	{
+		pthread_join( loop_thread, NULL );
+	}
+}
@@ -0,0 +1,107 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+#include "threadpool.h"
+#include "mpmc_queue.h"
+#include "cache_aligned.h"
+#include "http_business.h"
+#include "timer_wheel.h"
+#include "block_pool.h"
+
+namespace mj{
+	//seconds, 0 disables the timeout. changed on reload while the loops run
+	struct conn_timeouts
+	{
+		std::atomic< int > header;      //from the first byte of a request to the end of its headers
+		std::atomic< int > body;        //between two reads of a request body
+		std::atomic< int > keep_alive;  //idle between requests
+		std::atomic< int > write;       //without write progress
+	};
+
+	struct listen_options
+	{
+		int backlog;                //listen queue, the kernel caps it at net.core.somaxconn
+		int defer_accept;           //seconds TCP_DEFER_ACCEPT holds a connection until data arrives, 0 is off
+		int fastopen;               //TCP_FASTOPEN queue length, 0 is off
+	};
+
+	/*
+		one reactor: its own SO_REUSEPORT listener, connection table, buffer
+		pools and timer wheel. several loops can serve the same port, the
+		kernel spreads new connections between their listeners, so no
+		connection state is shared between loops.
+		how readiness is waited for and i/o is issued is up to the backend,
+		epoll_loop, uring_loop or, in a C++20 build, coro_loop. workers hand a connection back with resume(),
+		through a mailbox the loop drains before it waits and an eventfd that
+		is written only while the loop sleeps.
+	*/
+	class event_loop : public cache_aligned
+	{
+	public:
+		enum BACKEND { BACKEND_EPOLL, BACKEND_URING, BACKEND_CORO };
+
+		static event_loop* create( BACKEND backend, int port, threadpool< http_business >* pool,
+		            int max_fd, int max_events );
+		virtual ~event_loop();
+
+		bool open();
+		virtual void run() = 0;
+		bool start();
+		void join();
+		bool attach_steering( const std::vector< int >& loop_of_cpu );
+
+		//called by a worker once process() is done with the connection
+		virtual void resume( http_business& conn );
+		//whether a worker may read the socket itself, splicing an upload into its file
+		virtual bool direct_input() const { return false; }
+
+	public:
+		static conn_timeouts loop_timeouts;
+		static listen_options loop_listen;
+		static const int WHEEL_SLOTS = 1024;
+		static const int WHEEL_TICK_MS = 100;
+		static const int POOL_FREE_SLABS = 4;
+		static const int ACCEPT_RETRY_MS = 10;     //how often held accepts look at the pool again
+
+	protected:
+		event_loop( int port, threadpool< http_business >* pool, int max_fd, int max_events );
+
+		virtual bool open_backend() = 0;
+		virtual void handle_resumed( http_business& conn ) = 0;
+		bool begin_wait();
+		void end_wait() { loop_waiting.store( false ); }
+		http_business* add_conn( int connfd, const sockaddr_in& addr );
+		void close_conn( http_business& conn );
+		void set_deadline( http_business& conn, http_business::TIMER_PHASE phase, int timeout );
+		void after_read( http_business& conn );
+		void after_write( http_business& conn );
+		bool submit( http_business& conn );
+		bool accepts_held();
+		static long on_expire( wheel_node* node, long now, void* arg );
+
+	private:
+		static void* worker( void* arg );
+
+	protected:
+		int loop_port;
+		int loop_listenfd;
+		int loop_max_fd;
+		int loop_max_events;
+		http_business** loop_users;         //indexed by fd, NULL when not connected
+		block_pool* loop_read_pool;
+		block_pool* loop_write_pool;
+		block_pool* loop_table_pool;        //http_business::response_table of connections with responses queued
+		threadpool< http_business >* loop_pool;
+		pthread_t loop_thread;
+		timer_wheel* loop_wheel;
+		long loop_now;
+		bool loop_accepts_held;
+		int loop_wake_fd;
+		std::atomic< bool > loop_waiting;
+		mpmc_queue< http_business* > loop_mailbox;      //no more come back than the pool holds queued and running
+	};
+}
+#endif
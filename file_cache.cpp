@@ -0,0 +1,672 @@
+/*
+	file_cache.cpp
+	sharded open-file / stat / mmap cache for doc_root, CLOCK eviction,
+	entries revalidated with stat() once their ttl has passed, gzip / br
+	variants from .gz / .br files or compressed in the background
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "file_cache.h"
+
+namespace mj{
+	file_cache::file_cache( size_t max_bytes, int max_entries, int ttl, bool map_files ) :
+		    cache_shard_bytes( max_bytes / SHARD_NUMBER ),
+		    cache_shard_entries( max_entries / SHARD_NUMBER ),
+		    cache_ttl( ttl ), cache_map_files( map_files ), cache_shards( NULL ),
+		    cache_compressors( NULL )
+	{
+		cache_shards = new shard[ SHARD_NUMBER ];
+		for ( int i = 0; i < SHARD_NUMBER; ++i )
+		{
+		    memset( cache_shards[i].buckets, 0, sizeof( cache_shards[i].buckets ) );
+		    cache_shards[i].clock_hand = NULL;
+		    cache_shards[i].bytes = 0;
+		    cache_shards[i].entries = 0;
+		}
+	}
+
+	file_cache::~file_cache()
+	{
+		for ( int i = 0; i < SHARD_NUMBER; ++i )
+		{
+		    shard& s = cache_shards[i];
+		    while ( s.clock_hand )
+		    {
+		        file_entry* entry = s.clock_hand;
+		        unlink( s, entry );
+		        release( entry );
+		    }
+		}
+		delete [] cache_shards;
+		delete cache_compressors;
+	}
+
+	bool file_cache::start_compressors( int thread_number )
+	{
+		if ( thread_number <= 0 || cache_shard_entries <= 0 )
+		{
+		    return true;
+		}
+		try
+		{
+		    cache_compressors = new threadpool< compress_job >( thread_number, COMPRESS_QUEUE );
+		}
+		catch( ... )
+		{
+		    return false;
+		}
+		return true;
+	}
+
+	unsigned int file_cache::hash_path( const char* path )
+	{
+		unsigned int hash = 2166136261u;
+		for ( ; *path; ++path )
+		{
+		    hash ^= ( unsigned char )*path;
+		    hash *= 16777619u;
+		}
+		return hash;
+	}
+
+	const char* file_cache::mime_type( const char* path )
+	{
+		static const struct
+		{
+			const char* ext;
+			const char* type;
+		} types[] = {
+			{ "html", "text/html; charset=utf-8" },
+			{ "htm", "text/html; charset=utf-8" },
+			{ "css", "text/css" },
+			{ "js", "application/javascript" },
+			{ "json", "application/json" },
+			{ "txt", "text/plain; charset=utf-8" },
+			{ "xml", "application/xml" },
+			{ "png", "image/png" },
+			{ "jpg", "image/jpeg" },
+			{ "jpeg", "image/jpeg" },
+			{ "gif", "image/gif" },
+			{ "svg", "image/svg+xml" },
+			{ "ico", "image/x-icon" },
+			{ "webp", "image/webp" },
+			{ "woff", "font/woff" },
+			{ "woff2", "font/woff2" },
+			{ "pdf", "application/pdf" },
+			{ "wasm", "application/wasm" },
+		};
+
+		const char* dot = strrchr( path, '.' );
+		if ( dot && ! strchr( dot, '/' ) )
+		{
+		    for ( size_t i = 0; i < sizeof( types ) / sizeof( types[0] ); ++i )
+		    {
+		        if ( strcasecmp( dot + 1, types[i].ext ) == 0 )
+		        {
+		            return types[i].type;
+		        }
+		    }
+		}
+		return "application/octet-stream";
+	}
+
+	bool file_cache::compressible_type( const char* type )
+	{
+		return strncmp( type, "text/", 5 ) == 0 || strcmp( type, "application/javascript" ) == 0
+		        || strcmp( type, "application/json" ) == 0 || strcmp( type, "application/xml" ) == 0
+		        || strcmp( type, "image/svg+xml" ) == 0 || strcmp( type, "application/wasm" ) == 0;
+	}
+
+	file_entry* file_cache::new_entry( const char* path, unsigned int hash, int fd, const struct stat& st )
+	{
+		file_entry* entry = new file_entry;
+		entry->path = strdup( path );
+		entry->hash = hash;
+		entry->fd = fd;
+		entry->st = st;
+		entry->length = st.st_size;
+		entry->address = NULL;
+		entry->copied = false;
+		entry->encoding = ENCODING_IDENTITY;
+		entry->compressible = false;
+		entry->siblings = 0;
+		entry->compressing = 0;
+		entry->refs = 1;
+		entry->referenced = true;
+		entry->checked = time( NULL );
+		entry->hash_next = NULL;
+		entry->clock_prev = NULL;
+		entry->clock_next = NULL;
+		return entry;
+	}
+
+	//formatted once per load, every response for the entry sends these bytes as they are
+	void file_cache::make_header( file_entry* entry )
+	{
+		struct tm tm_modified;
+		gmtime_r( &entry->st.st_mtime, &tm_modified );
+		strftime( entry->modified, sizeof( entry->modified ), "%a, %d %b %Y %H:%M:%S GMT", &tm_modified );
+
+		//a variant's tag names the coding, its bytes differ from the plain file's
+		const char* name = encoding_name( ( ENCODING )entry->encoding );
+		snprintf( entry->etag, sizeof( entry->etag ), *name ? "\"%lx-%lx-%s\"" : "\"%lx-%lx\"",
+		        ( long )entry->st.st_mtime, ( long )entry->st.st_size, name );
+
+		int len = snprintf( entry->header, sizeof( entry->header ),
+		        "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %ld\r\n", entry->type, ( long )entry->length );
+		entry->validators = len;
+		if ( *name )
+		{
+		    len += snprintf( entry->header + len, sizeof( entry->header ) - len, "Content-Encoding: %s\r\n", name );
+		}
+		len += snprintf( entry->header + len, sizeof( entry->header ) - len,
+		        "ETag: %s\r\nLast-Modified: %s\r\n", entry->etag, entry->modified );
+		if ( *name || entry->compressible || entry->siblings )
+		{
+		    len += snprintf( entry->header + len, sizeof( entry->header ) - len, "Vary: Accept-Encoding\r\n" );
+		}
+		entry->header_len = len;
+		entry->cost = sizeof( file_entry ) + strlen( entry->path ) + ( entry->address ? entry->length : 0 );
+	}
+
+	//small bodies are served from memory, no fd kept
+	bool file_cache::read_body( file_entry* entry, int fd, off_t length )
+	{
+		entry->address = ( char* )malloc( length );
+		off_t have_read = 0;
+		while ( entry->address && have_read < length )
+		{
+		    ssize_t ret = pread( fd, entry->address + have_read, length - have_read, have_read );
+		    if ( ret <= 0 )
+		    {
+		        break;
+		    }
+		    have_read += ret;
+		}
+		if ( have_read != length )
+		{
+		    free( entry->address );
+		    entry->address = NULL;
+		    return false;
+		}
+		entry->copied = true;
+		return true;
+	}
+
+	file_entry* file_cache::load( const char* path, unsigned int hash, FILE_STATUS& status )
+	{
+		struct stat st;
+		if ( stat( path, &st ) < 0 )
+		{
+		    status = FILE_MISSING;
+		    return NULL;
+		}
+		if ( ! ( st.st_mode & S_IROTH ) )
+		{
+		    status = FILE_FORBIDDEN;
+		    return NULL;
+		}
+		if ( S_ISDIR( st.st_mode ) )
+		{
+		    status = FILE_IS_DIR;
+		    return NULL;
+		}
+
+		int fd = open( path, O_RDONLY | O_CLOEXEC );
+		if ( fd < 0 )
+		{
+		    status = FILE_ERROR;
+		    return NULL;
+		}
+
+		file_entry* entry = new_entry( path, hash, fd, st );
+		if ( st.st_size > 0 && ( size_t )st.st_size <= COPY_LIMIT )
+		{
+		    if ( read_body( entry, fd, st.st_size ) )
+		    {
+		        close( fd );
+		        entry->fd = -1;
+		    }
+		}
+		else if ( st.st_size > 0 && cache_map_files )
+		{
+		    void* address = mmap( 0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		    if ( address != MAP_FAILED )
+		    {
+		        entry->address = ( char* )address;
+		        close( fd );
+		        entry->fd = -1;
+		    }
+		}
+
+		entry->type = mime_type( path );
+		entry->compressible = compressible_type( entry->type );
+
+		//precompressed files count only while they are at least as new as the original
+		char sibling[ 4096 ];
+		static const struct
+		{
+			ENCODING encoding;
+			const char* suffix;
+		} suffixes[] = { { ENCODING_GZIP, ".gz" }, { ENCODING_BR, ".br" } };
+		for ( size_t i = 0; i < sizeof( suffixes ) / sizeof( suffixes[0] ); ++i )
+		{
+		    struct stat sst;
+		    if ( snprintf( sibling, sizeof( sibling ), "%s%s", path, suffixes[i].suffix ) < ( int )sizeof( sibling )
+		            && stat( sibling, &sst ) == 0 && S_ISREG( sst.st_mode ) && ( sst.st_mode & S_IROTH )
+		            && sst.st_mtime >= st.st_mtime )
+		    {
+		        entry->siblings |= 1 << suffixes[i].encoding;
+		    }
+		}
+
+		make_header( entry );
+		status = FILE_OK;
+		return entry;
+	}
+
+	file_entry* file_cache::load_sibling( file_entry* plain, ENCODING encoding, const char* key, unsigned int hash )
+	{
+		char sibling[ 4096 ];
+		snprintf( sibling, sizeof( sibling ), "%s%s", plain->path, encoding == ENCODING_GZIP ? ".gz" : ".br" );
+		int fd = open( sibling, O_RDONLY | O_CLOEXEC );
+		if ( fd < 0 )
+		{
+		    return NULL;
+		}
+		struct stat sst;
+		if ( fstat( fd, &sst ) < 0 || ! S_ISREG( sst.st_mode ) )
+		{
+		    close( fd );
+		    return NULL;
+		}
+
+		file_entry* entry = new_entry( key, hash, fd, plain->st );
+		entry->length = sst.st_size;
+		entry->type = plain->type;
+		entry->encoding = encoding;
+		if ( sst.st_size > 0 && ( size_t )sst.st_size <= COPY_LIMIT )
+		{
+		    if ( read_body( entry, fd, sst.st_size ) )
+		    {
+		        close( fd );
+		        entry->fd = -1;
+		    }
+		}
+		else if ( sst.st_size > 0 && cache_map_files )
+		{
+		    void* address = mmap( 0, sst.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		    if ( address != MAP_FAILED )
+		    {
+		        entry->address = ( char* )address;
+		        close( fd );
+		        entry->fd = -1;
+		    }
+		}
+		make_header( entry );
+		return entry;
+	}
+
+	//body is a malloc'd buffer the entry takes over
+	file_entry* file_cache::make_variant( file_entry* plain, ENCODING encoding, char* body, size_t length )
+	{
+		char key[ 4096 ];
+		snprintf( key, sizeof( key ), "%s:%s", encoding == ENCODING_GZIP ? "gz" : "br", plain->path );
+		file_entry* entry = new_entry( key, hash_path( key ), -1, plain->st );
+		entry->length = length;
+		entry->address = body;
+		entry->copied = true;
+		entry->type = plain->type;
+		entry->encoding = encoding;
+		make_header( entry );
+		return entry;
+	}
+
+	void file_cache::destroy( file_entry* entry )
+	{
+		if ( entry->copied )
+		{
+		    free( entry->address );
+		}
+		else if ( entry->address )
+		{
+		    munmap( entry->address, entry->length );
+		}
+		if ( entry->fd != -1 )
+		{
+		    close( entry->fd );
+		}
+		free( entry->path );
+		delete entry;
+	}
+
+	void file_cache::release( file_entry* entry )
+	{
+		if ( entry && entry->refs.fetch_sub( 1 ) == 1 )
+		{
+		    destroy( entry );
+		}
+	}
+
+	file_entry* file_cache::find( shard& s, const char* path, unsigned int hash )
+	{
+		file_entry* entry = s.buckets[ ( hash / SHARD_NUMBER ) % BUCKET_NUMBER ];
+		for ( ; entry; entry = entry->hash_next )
+		{
+		    if ( entry->hash == hash && strcmp( entry->path, path ) == 0 )
+		    {
+		        return entry;
+		    }
+		}
+		return NULL;
+	}
+
+	void file_cache::insert( shard& s, file_entry* entry )
+	{
+		file_entry** bucket = &s.buckets[ ( entry->hash / SHARD_NUMBER ) % BUCKET_NUMBER ];
+		entry->hash_next = *bucket;
+		*bucket = entry;
+
+		if ( ! s.clock_hand )
+		{
+		    entry->clock_prev = entry;
+		    entry->clock_next = entry;
+		    s.clock_hand = entry;
+		}
+		else
+		{
+		    //new entries go right behind the hand, the last place it will reach
+		    entry->clock_next = s.clock_hand;
+		    entry->clock_prev = s.clock_hand->clock_prev;
+		    entry->clock_prev->clock_next = entry;
+		    s.clock_hand->clock_prev = entry;
+		}
+		s.bytes += entry->cost;
+		s.entries++;
+	}
+
+	void file_cache::unlink( shard& s, file_entry* entry )
+	{
+		file_entry** link = &s.buckets[ ( entry->hash / SHARD_NUMBER ) % BUCKET_NUMBER ];
+		while ( *link != entry )
+		{
+		    link = &( *link )->hash_next;
+		}
+		*link = entry->hash_next;
+
+		if ( entry->clock_next == entry )
+		{
+		    s.clock_hand = NULL;
+		}
+		else
+		{
+		    entry->clock_prev->clock_next = entry->clock_next;
+		    entry->clock_next->clock_prev = entry->clock_prev;
+		    if ( s.clock_hand == entry )
+		    {
+		        s.clock_hand = entry->clock_next;
+		    }
+		}
+		s.bytes -= entry->cost;
+		s.entries--;
+	}
+
+	void file_cache::evict( shard& s, size_t need )
+	{
+		while ( s.clock_hand && ( s.bytes + need > cache_shard_bytes || s.entries >= cache_shard_entries ) )
+		{
+		    file_entry* entry = s.clock_hand;
+		    if ( entry->referenced.exchange( false ) )
+		    {
+		        s.clock_hand = entry->clock_next;
+		        continue;
+		    }
+		    unlink( s, entry );
+		    release( entry );
+		}
+	}
+
+	bool file_cache::still_valid( file_entry* entry )
+	{
+		struct stat st;
+		if ( stat( entry->path, &st ) < 0 )
+		{
+		    return false;
+		}
+		return st.st_ino == entry->st.st_ino && st.st_dev == entry->st.st_dev
+		        && st.st_size == entry->st.st_size && st.st_mode == entry->st.st_mode
+		        && st.st_mtim.tv_sec == entry->st.st_mtim.tv_sec
+		        && st.st_mtim.tv_nsec == entry->st.st_mtim.tv_nsec;
+	}
+
+	file_entry* file_cache::acquire( const char* path, FILE_STATUS& status, bool cached_only )
+	{
+		unsigned int hash = hash_path( path );
+		shard& s = cache_shards[ hash % SHARD_NUMBER ];
+		time_t now = time( NULL );
+
+		s.lock.rdlock();
+		file_entry* entry = find( s, path, hash );
+		if ( entry )
+		{
+		    entry->refs++;
+		    entry->referenced.store( true, std::memory_order_relaxed );
+		}
+		s.lock.unlock();
+
+		if ( entry )
+		{
+		    if ( now - entry->checked < cache_ttl.load( std::memory_order_relaxed ) )
+		    {
+		        status = FILE_OK;
+		        return entry;
+		    }
+		    if ( cached_only )
+		    {
+		        //too old to be trusted without a stat
+		        release( entry );
+		        status = FILE_NOT_CACHED;
+		        return NULL;
+		    }
+		    if ( still_valid( entry ) )
+		    {
+		        entry->checked = now;
+		        status = FILE_OK;
+		        return entry;
+		    }
+
+		    s.lock.wrlock();
+		    if ( find( s, path, hash ) == entry )
+		    {
+		        unlink( s, entry );
+		        release( entry );
+		    }
+		    s.lock.unlock();
+		    release( entry );
+		}
+
+		if ( cached_only )
+		{
+		    status = FILE_NOT_CACHED;
+		    return NULL;
+		}
+		entry = load( path, hash, status );
+		return entry ? publish( entry ) : NULL;
+	}
+
+	//puts a fresh entry in the cache, or hands back the one that got there first
+	file_entry* file_cache::publish( file_entry* entry )
+	{
+		if ( entry->cost > cache_shard_bytes || cache_shard_entries <= 0 )
+		{
+		    //not cacheable, the caller owns the only reference
+		    return entry;
+		}
+
+		shard& s = cache_shards[ entry->hash % SHARD_NUMBER ];
+		s.lock.wrlock();
+		file_entry* exist = find( s, entry->path, entry->hash );
+		if ( exist )
+		{
+		    exist->refs++;
+		    s.lock.unlock();
+		    destroy( entry );
+		    return exist;
+		}
+		evict( s, entry->cost );
+		entry->refs++;
+		insert( s, entry );
+		s.lock.unlock();
+		return entry;
+	}
+
+	//cached variant made from the current plain entry, or one loaded from a sibling file
+	file_entry* file_cache::find_variant( file_entry* plain, ENCODING encoding, FILE_STATUS& status, bool cached_only )
+	{
+		char key[ 4096 ];
+		snprintf( key, sizeof( key ), "%s:%s", encoding == ENCODING_GZIP ? "gz" : "br", plain->path );
+		unsigned int hash = hash_path( key );
+		shard& s = cache_shards[ hash % SHARD_NUMBER ];
+
+		s.lock.rdlock();
+		file_entry* entry = find( s, key, hash );
+		if ( entry )
+		{
+		    entry->refs++;
+		    entry->referenced.store( true, std::memory_order_relaxed );
+		}
+		s.lock.unlock();
+
+		if ( entry )
+		{
+		    //plain was just validated, a variant is good while it was made from the same file
+		    if ( entry->st.st_ino == plain->st.st_ino && entry->st.st_dev == plain->st.st_dev
+		            && entry->st.st_size == plain->st.st_size
+		            && entry->st.st_mtim.tv_sec == plain->st.st_mtim.tv_sec
+		            && entry->st.st_mtim.tv_nsec == plain->st.st_mtim.tv_nsec )
+		    {
+		        return entry;
+		    }
+		    s.lock.wrlock();
+		    if ( find( s, key, hash ) == entry )
+		    {
+		        unlink( s, entry );
+		        release( entry );
+		    }
+		    s.lock.unlock();
+		    release( entry );
+		}
+
+		if ( ! ( plain->siblings & ( 1 << encoding ) ) )
+		{
+		    return NULL;
+		}
+		if ( cached_only )
+		{
+		    status = FILE_NOT_CACHED;
+		    return NULL;
+		}
+		entry = load_sibling( plain, encoding, key, hash );
+		return entry ? publish( entry ) : NULL;
+	}
+
+	bool file_cache::submit( file_entry* plain, ENCODING encoding )
+	{
+		unsigned char bit = 1 << encoding;
+		if ( ! cache_compressors || plain->length < COMPRESS_MIN || plain->length > COMPRESS_MAX
+		        || ( size_t )plain->length > cache_shard_bytes
+		        || ( plain->compressing.fetch_or( bit ) & bit ) )
+		{
+		    return false;
+		}
+		compress_job* job = new compress_job;
+		job->cache = this;
+		job->plain = plain;
+		job->encoding = encoding;
+		plain->refs++;
+		if ( ! cache_compressors->append( job ) )
+		{
+		    plain->compressing.fetch_and( ~bit );
+		    release( plain );
+		    delete job;
+		    return false;
+		}
+		return true;
+	}
+
+	file_entry* file_cache::acquire_encoded( file_entry* plain, int accepted, FILE_STATUS& status, bool cached_only )
+	{
+		static const ENCODING preference[] = { ENCODING_BR, ENCODING_GZIP };
+		status = FILE_OK;
+		if ( plain->encoding != ENCODING_IDENTITY || ( ! plain->compressible && ! plain->siblings ) )
+		{
+		    return NULL;
+		}
+		for ( int i = 0; i < 2; ++i )
+		{
+		    if ( accepted & ( 1 << preference[i] ) )
+		    {
+		        file_entry* variant = find_variant( plain, preference[i], status, cached_only );
+		        if ( variant || status == FILE_NOT_CACHED )
+		        {
+		            return variant;
+		        }
+		    }
+		}
+		//nothing to send yet, this response goes out plain while a worker compresses
+		for ( int i = 0; plain->compressible && i < 2; ++i )
+		{
+		    if ( ( accepted & ( 1 << preference[i] ) ) && submit( plain, preference[i] ) )
+		    {
+		        break;
+		    }
+		}
+		return NULL;
+	}
+
+	void file_cache::compress_job::process()
+	{
+		char* data = plain->address;
+		if ( ! data )
+		{
+		    data = ( char* )malloc( plain->length );
+		    off_t have_read = 0;
+		    while ( data && have_read < plain->length )
+		    {
+		        ssize_t ret = pread( plain->fd, data + have_read, plain->length - have_read, have_read );
+		        if ( ret <= 0 )
+		        {
+		            break;
+		        }
+		        have_read += ret;
+		    }
+		    if ( data && have_read != plain->length )
+		    {
+		        free( data );
+		        data = NULL;
+		    }
+		}
+
+		char* body;
+		size_t length;
+		if ( data && encode_buffer( encoding, data, plain->length, plain->length, &body, &length ) )
+		{
+		    cache->release( cache->publish( cache->make_variant( plain, encoding, body, length ) ) );
+		    //once cached it is found there, after an eviction it may be made again
+		    plain->compressing.fetch_and( ~( 1 << encoding ) );
+		}
+		if ( data != plain->address )
+		{
+		    free( data );
+		}
+		cache->release( plain );
+		delete this;
+	}
+}
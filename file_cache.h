@@ -0,0 +1,122 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <atomic>
+#include "locker.h"
+#include "threadpool.h"
+#include "content_encoding.h"
+
+namespace mj{
+	/*
+		one cached file under doc_root. readers hold a reference while the
+		response is in flight; the entry is freed when the last one drops it,
+		even if the cache has already evicted or replaced it.
+		a compressed variant is an entry of its own, keyed "<coding>:" + path,
+		that carries the stat of the file it was made from.
+	*/
+	struct file_entry
+	{
+		char* path;
+		unsigned int hash;
+		int fd;                     //-1 when the body is held in memory
+		struct stat st;
+		off_t length;               //body bytes, the compressed size for a variant
+		char* address;              //shared mapping or in-memory copy, NULL for sendfile
+		bool copied;
+		int encoding;               //ENCODING of the body
+		bool compressible;          //text-like type worth compressing on the fly
+		unsigned char siblings;     //bit per ENCODING, a fresh .gz / .br lies next to the file
+		std::atomic< unsigned char > compressing;   //bit per ENCODING, a job ran or is running
+		char header[ 320 ];         //status line, Content-Type, Content-Length, then the validators
+		int header_len;
+		int validators;             //offset of Content-Encoding / ETag in header, 304 and 206 reuse the rest
+		const char* type;           //Content-Type value
+		char etag[ 48 ];            //quoted, from mtime and size
+		char modified[ 32 ];        //Last-Modified value
+		size_t cost;
+
+		std::atomic< int > refs;
+		std::atomic< bool > referenced;
+		std::atomic< time_t > checked;
+		file_entry* hash_next;
+		file_entry* clock_prev;
+		file_entry* clock_next;
+	};
+
+	class file_cache
+	{
+	public:
+		enum FILE_STATUS { FILE_OK, FILE_MISSING, FILE_FORBIDDEN, FILE_IS_DIR, FILE_ERROR, FILE_NOT_CACHED };
+
+		file_cache( size_t max_bytes, int max_entries, int ttl, bool map_files );
+		~file_cache();
+
+		//cached_only is for a caller that must not block: nothing is opened, stat'ed or read,
+		//whatever would need it gives FILE_NOT_CACHED
+		file_entry* acquire( const char* path, FILE_STATUS& status, bool cached_only = false );
+		void release( file_entry* entry );
+
+		//the best variant of plain for the accepted codings, NULL serves plain as it is
+		file_entry* acquire_encoded( file_entry* plain, int accepted, FILE_STATUS& status, bool cached_only = false );
+		bool start_compressors( int thread_number );
+		void set_ttl( int ttl ) { cache_ttl.store( ttl, std::memory_order_relaxed ); }
+
+	public:
+		static const int SHARD_NUMBER = 16;
+		static const int BUCKET_NUMBER = 1024;
+		static const size_t COPY_LIMIT = 16 * 1024;
+		static const off_t COMPRESS_MIN = 256;
+		static const off_t COMPRESS_MAX = 8 * 1024 * 1024;
+		static const int COMPRESS_QUEUE = 64;
+
+	private:
+		struct shard
+		{
+			rwlocker lock;
+			file_entry* buckets[ BUCKET_NUMBER ];
+			file_entry* clock_hand;
+			size_t bytes;
+			int entries;
+		};
+
+		//one on-the-fly compression, holds a reference to the plain entry
+		struct compress_job
+		{
+			file_cache* cache;
+			file_entry* plain;
+			ENCODING encoding;
+			void process();
+		};
+
+		static unsigned int hash_path( const char* path );
+		static const char* mime_type( const char* path );
+		static bool compressible_type( const char* type );
+		static file_entry* new_entry( const char* path, unsigned int hash, int fd, const struct stat& st );
+		static void make_header( file_entry* entry );
+		static bool read_body( file_entry* entry, int fd, off_t length );
+		file_entry* load( const char* path, unsigned int hash, FILE_STATUS& status );
+		file_entry* load_sibling( file_entry* plain, ENCODING encoding, const char* key, unsigned int hash );
+		file_entry* make_variant( file_entry* plain, ENCODING encoding, char* body, size_t length );
+		file_entry* find_variant( file_entry* plain, ENCODING encoding, FILE_STATUS& status, bool cached_only );
+		bool submit( file_entry* plain, ENCODING encoding );
+		file_entry* publish( file_entry* entry );
+		void destroy( file_entry* entry );
+		file_entry* find( shard& s, const char* path, unsigned int hash );
+		void insert( shard& s, file_entry* entry );
+		void unlink( shard& s, file_entry* entry );
+		void evict( shard& s, size_t need );
+		bool still_valid( file_entry* entry );
+
+	private:
+		size_t cache_shard_bytes;
+		int cache_shard_entries;
+		std::atomic< int > cache_ttl;
+		bool cache_map_files;
+		shard* cache_shards;
+		threadpool< compress_job >* cache_compressors;
+	};
+}
+#endif
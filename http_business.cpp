@@ -4,46 +4,163 @@
 */
 
 #include "http_business.h"
+#include "event_loop.h"
 #include "public_func.h"
+#include "http_scan.h"
+#include "metrics.h"
+#include "router.h"
 
 namespace mj{
 	const char* ok_200_title = "OK";
+	const char* ok_200_form = "<html><body></body></html>";
+	const char* ok_201_title = "Created";
+	const char* ok_201_form = "The request body was stored.\n";
 	const char* error_400_title = "Bad Request";
 	const char* error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
 	const char* error_403_title = "Forbidden";
 	const char* error_403_form = "You do not have permission to get file from this server.\n";
 	const char* error_404_title = "Not Found";
 	const char* error_404_form = "The requested file was not found on this server.\n";
+	const char* error_413_title = "Payload Too Large";
+	const char* error_413_form = "The request body is larger than this server accepts.\n";
+	const char* error_431_title = "Request Header Fields Too Large";
+	const char* error_431_form = "The request headers are larger than this server accepts.\n";
 	const char* error_500_title = "Internal Error";
 	const char* error_500_form = "There was an unusual problem serving the requested file.\n";
-	const char* doc_root = "/var/www/html";
+	const char* error_405_title = "Method Not Allowed";
+	const char* error_405_form = "The requested method is not supported for this url.\n";
+	const char* error_414_title = "URI Too Long";
+	const char* error_414_form = "The requested url is longer than this server can store.\n";
+	const char* error_503_title = "Service Unavailable";
+	const char* error_503_form = "The server is overloaded, please retry shortly.\n";
 
 
-	int http_business::http_user_count = 0;
-	int http_business::http_epollfd = -1;
+	http_business::SEND_MODE http_business::http_send_mode = http_business::SEND_SENDFILE;
+	file_cache* http_business::http_file_cache = NULL;
+	router* http_business::http_router = NULL;
+	std::atomic< const char* > http_business::http_doc_root( "/var/www/html" );
+	int http_business::http_read_block_size = 4096;
+	int http_business::http_write_block_size = 2048;
+	int http_business::http_max_header_size = 65536;
+	long long http_business::http_max_body = 1024LL << 20;
+	http_business::prebuilt_response http_business::http_prebuilt[ SERVICE_UNAVAILABLE + 1 ][ 2 ];
+
+	//closes the header block of a file response, whose first lines come from the cache entry
+	static const char connection_close[] = "Connection: close\r\n\r\n";
+	static const char connection_keep_alive[] = "Connection: keep-alive\r\n\r\n";
+	static const char continue_status[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+	bool http_business::init_responses()
+	{
+		static const struct
+		{
+			HTTP_CODE code;
+			int status;
+			const char* title;
+			const char* form;
+			const char* extra;
+		} fixed[] = {
+			{ FILE_REQUEST, 200, ok_200_title, ok_200_form, "" },       //empty file
+			{ CREATED_REQUEST, 201, ok_201_title, ok_201_form, "" },
+			{ BAD_REQUEST, 400, error_400_title, error_400_form, "" },
+			{ FORBIDDEN_REQUEST, 403, error_403_title, error_403_form, "" },
+			{ NO_RESOURCE, 404, error_404_title, error_404_form, "" },
+			{ METHOD_NOT_ALLOWED, 405, error_405_title, error_405_form, "" },
+			{ BODY_TOO_LARGE, 413, error_413_title, error_413_form, "" },
+			{ URI_TOO_LONG, 414, error_414_title, error_414_form, "" },
+			{ TOO_LARGE_REQUEST, 431, error_431_title, error_431_form, "" },
+			{ INTERNAL_ERROR, 500, error_500_title, error_500_form, "" },
+			{ SERVICE_UNAVAILABLE, 503, error_503_title, error_503_form, "Retry-After: 1\r\n" },
+		};
+
+		for ( size_t i = 0; i < sizeof( fixed ) / sizeof( fixed[0] ); ++i )
+		{
+		    for ( int keep_alive = 0; keep_alive < 2; ++keep_alive )
+		    {
+		        const char* format = "HTTP/1.1 %d %s\r\nContent-Length: %d\r\n%sConnection: %s\r\n\r\n%s";
+		        const char* linger = keep_alive ? "keep-alive" : "close";
+		        int body_len = strlen( fixed[i].form );
+		        int len = snprintf( NULL, 0, format, fixed[i].status, fixed[i].title, body_len, fixed[i].extra,
+		                linger, fixed[i].form );
+		        char* data = ( char* )malloc( len + 1 );
+		        if ( ! data )
+		        {
+		            return false;
+		        }
+		        snprintf( data, len + 1, format, fixed[i].status, fixed[i].title, body_len, fixed[i].extra,
+		                linger, fixed[i].form );
+		        http_prebuilt[ fixed[i].code ][ keep_alive ].data = data;
+		        http_prebuilt[ fixed[i].code ][ keep_alive ].len = len;
+		    }
+		}
+		return true;
+	}
 
 	void http_business::close_conn( bool real_close )
 	{
 		if( real_close && ( http_sockfd != -1 ) )
 		{
-		    removefd( http_epollfd, http_sockfd );
+		    init_response();
+		    release_buffers();
+		    release_sink();
+		    delete http_source;
+		    http_source = 0;
+		    push_log( -1 );
+		    delete [] http_log_records;
+		    http_log_records = 0;
+		    close( http_sockfd );
 		    http_sockfd = -1;
-		    http_user_count--;
 		}
 	}
 
-	void http_business::init( int sockfd, const sockaddr_in& addr )
+	void http_business::init( int sockfd, const sockaddr_in& addr, event_loop* loop,
+		        block_pool* read_pool, block_pool* write_pool, block_pool* table_pool )
 	{
+		http_read_chain.init( read_pool );
+		http_write_chain.init( write_pool );
+		http_table_pool = table_pool;
+		http_table = 0;
+		http_cached_only = false;
+		http_step = 0;
+		http_read_buf = 0;
+		http_loop = loop;
 		http_sockfd = sockfd;
 		http_address = addr;
-		
-		addfd( http_epollfd, sockfd, true );
-		http_user_count++;
+		http_file_count = 0;
+		http_timer.prev = 0;
+		http_timer.next = 0;
+		http_timer.owner = this;
+		http_timer_phase = TIMER_HEADER;
+		http_deadline = 0;
+		http_read_direct = false;
+		http_sink = 0;
+		http_source = 0;
+		http_stream_keep_alive = false;
+		http_log_records = 0;
+		http_log_count = 0;
 
 		init();
 	}
 
 	void http_business::init()
+	{
+		http_start_line = 0;
+		http_checked_idx = 0;
+		http_read_idx = 0;
+		http_request_begin = 0;
+		init_request();
+		init_response();
+	}
+
+	void http_business::release_buffers()
+	{
+		http_read_chain.clear();
+		http_read_buf = 0;
+		http_read_idx = 0;
+		http_write_chain.clear();
+	}
+
+	void http_business::init_request()
 	{
 		http_check_state = CHECK_STATE_REQUESTLINE;
 		http_keep_alive = false;
@@ -52,14 +169,89 @@ namespace mj{
 		http_url = 0;
 		http_version = 0;
 		http_content_length = 0;
+		http_chunked = false;
+		http_chunk_state = CHUNK_SIZE;
+		http_body_size = 0;
+		http_expect_continue = false;
+		release_sink();
 		http_host = 0;
-		http_start_line = 0;
-		http_checked_idx = 0;
-		http_read_idx = 0;
-		http_write_idx = 0;
-		memset( http_read_buf, '\0', READ_BUFFER_SIZE );
-		memset( http_write_buf, '\0', WRITE_BUFFER_SIZE );
-		memset( http_real_file, '\0', FILENAME_LEN );
+		http_if_none_match = 0;
+		http_if_modified_since = 0;
+		http_range = 0;
+		http_if_range = 0;
+		http_accept_encoding = 0;
+		http_file = 0;
+		http_not_modified = false;
+		http_range_count = 0;
+		http_request_code = INCOMPLETE_REQUEST;
+		http_log_named = false;
+	}
+
+	void http_business::init_response()
+	{
+		release_files();
+		if ( http_table )
+		{
+		    http_table_pool->put( ( char* )http_table );
+		    http_table = 0;
+		}
+		http_write_chain.clear();
+		http_segment_count = 0;
+		http_segment_idx = 0;
+		http_linger = false;
+	}
+
+	/*
+		drop the requests already answered from the read chain. the bytes of
+		the next (possibly half parsed) request stay in place, only the
+		indices move; a used up block is replaced by the next one.
+	*/
+	void http_business::compact_read_buf()
+	{
+		int delta = http_request_begin;
+		if ( delta == 0 )
+		{
+		    return;
+		}
+		http_read_chain.consume( delta );
+		http_read_buf = http_read_chain.front();
+		http_read_idx = http_read_chain.front_size();
+		http_checked_idx -= delta;
+		http_start_line -= delta;
+		http_request_begin = 0;
+	}
+
+	/*
+		bring more input to the first block when the current request needs
+		it: either the next block once this one is used up, or the following
+		blocks copied behind a request that was split between them.
+	*/
+	bool http_business::pull_read_buf()
+	{
+		int unparsed = http_read_idx - http_checked_idx;
+		compact_read_buf();
+		if ( http_read_idx - http_checked_idx > unparsed )
+		{
+		    return true;
+		}
+
+		char* old_buf = http_read_buf;
+		if ( ! http_read_chain.pullup( http_max_header_size ) )
+		{
+		    return false;
+		}
+		http_read_buf = http_read_chain.front();
+		http_read_idx = http_read_chain.front_size();
+		char** fields[] = { &http_url, &http_version, &http_host, &http_if_none_match,
+		        &http_if_modified_since, &http_range, &http_if_range };
+		for ( size_t i = 0; i < sizeof( fields ) / sizeof( fields[0] ); ++i )
+		{
+		    if ( *fields[i] )
+		    {
+		        *fields[i] = http_read_buf + ( *fields[i] - old_buf );
+		    }
+		}
+		return true;
 	}
 
 	http_business::LINE_STATUS http_business::parse_line()
@@ -67,7 +259,13 @@ namespace mj{
 		char temp;
 		for ( ; http_checked_idx < http_read_idx; ++http_checked_idx )
 		{
-		    temp = http_read_buf[ http_checked_idx ];
+		    const char* hit = find_line_end( http_read_buf + http_checked_idx, http_read_buf + http_read_idx );
+		    http_checked_idx = hit - http_read_buf;
+		    if ( http_checked_idx == http_read_idx )
+		    {
+		        break;
+		    }
+		    temp = *hit;
 		    if ( temp == '\r' )
 		    {
 		        if ( ( http_checked_idx + 1 ) == http_read_idx )
@@ -100,31 +298,14 @@ namespace mj{
 
 	bool http_business::read()
 	{
-		if( http_read_idx >= READ_BUFFER_SIZE )
+		ssize_t bytes_read = http_read_chain.read_fd( http_sockfd, max_input_buffered() );
+		if ( bytes_read > 0 )
 		{
-		    return false;
-		}
-
-		int bytes_read = 0;
-		while( true )
-		{
-		    bytes_read = recv( http_sockfd, http_read_buf + http_read_idx, READ_BUFFER_SIZE - http_read_idx, 0 );
-		    if ( bytes_read == -1 )
-		    {
-		        if( errno == EAGAIN || errno == EWOULDBLOCK )
-		        {
-		            break;
-		        }
-		        return false;
-		    }
-		    else if ( bytes_read == 0 )
-		    {
-		        return false;
-		    }
-
-		    http_read_idx += bytes_read;
+		    metrics::count( COUNTER_BYTES_IN, bytes_read );
+		    return true;
 		}
-		return true;
+		//ENOBUFS: the buffered requests are parsed first, the rest is read once they drain
+		return bytes_read == -1 && ( errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS );
 	}
 
 	http_business::HTTP_CODE http_business::parse_request_line( char* text )
@@ -141,6 +322,18 @@ namespace mj{
 		{
 		    http_method = GET;
 		}
+		else if ( strcasecmp( method, "POST" ) == 0 )
+		{
+		    http_method = POST;
+		}
+		else if ( strcasecmp( method, "PUT" ) == 0 )
+		{
+		    http_method = PUT;
+		}
+		else if ( strcasecmp( method, "DELETE" ) == 0 )
+		{
+		    http_method = DELETE;
+		}
 		else
 		{
 		    return BAD_REQUEST;
@@ -183,7 +376,12 @@ namespace mj{
 		        return GET_REQUEST;
 		    }
 
-		    if ( http_content_length != 0 )
+		    if ( http_chunked && http_content_length != 0 )
+		    {
+		        //two framings for one body, a proxy may have picked the other one
+		        return BAD_REQUEST;
+		    }
+		    if ( http_content_length != 0 || http_chunked || http_method == POST || http_method == PUT )
 		    {
 		        http_check_state = CHECK_STATE_CONTENT;
 		        return INCOMPLETE_REQUEST;
@@ -191,44 +389,313 @@ namespace mj{
 
 		    return GET_REQUEST;
 		}
-		else if ( strncasecmp( text, "Connection:", 11 ) == 0 )
+
+		char* colon = strchr( text, ':' );
+		if ( ! colon )
+		{
+		    return INCOMPLETE_REQUEST;
+		}
+		char* value = colon + 1;
+		value += strspn( value, " \t" );
+		switch ( classify_header( text, colon - text ) )
 		{
-		    text += 11;
-		    text += strspn( text, " \t" );
-		    if ( strcasecmp( text, "keep-alive" ) == 0 )
+		    case HEADER_CONNECTION:
+		    {
+		        if ( strcasecmp( value, "keep-alive" ) == 0 )
+		        {
+		            http_keep_alive = true;
+		        }
+		        break;
+		    }
+		    case HEADER_CONTENT_LENGTH:
+		    {
+		        char* end;
+		        errno = 0;
+		        http_content_length = strtoll( value, &end, 10 );
+		        end += strspn( end, " \t" );
+		        if ( end == value || *end || errno || http_content_length < 0 )
+		        {
+		            return BAD_REQUEST;
+		        }
+		        break;
+		    }
+		    case HEADER_TRANSFER_ENCODING:
+		    {
+		        //chunked is the only coding taken, and it has to be the only one
+		        if ( strcasecmp( value, "chunked" ) != 0 )
+		        {
+		            return BAD_REQUEST;
+		        }
+		        http_chunked = true;
+		        break;
+		    }
+		    case HEADER_EXPECT:
+		    {
+		        http_expect_continue = strcasecmp( value, "100-continue" ) == 0;
+		        break;
+		    }
+		    case HEADER_HOST:
+		    {
+		        http_host = value;
+		        break;
+		    }
+		    case HEADER_IF_NONE_MATCH:
+		    {
+		        http_if_none_match = value;
+		        break;
+		    }
+		    case HEADER_IF_MODIFIED_SINCE:
+		    {
+		        http_if_modified_since = value;
+		        break;
+		    }
+		    case HEADER_RANGE:
+		    {
+		        http_range = value;
+		        break;
+		    }
+		    case HEADER_IF_RANGE:
+		    {
+		        http_if_range = value;
+		        break;
+		    }
+		    case HEADER_ACCEPT_ENCODING:
+		    {
+		        http_accept_encoding = parse_accept_encoding( value );
+		        break;
+		    }
+		    default:
 		    {
-		        http_keep_alive = true;
+		        //printf( "unknow header %s\n", text );
+		        break;
 		    }
 		}
-		else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 )
+
+		return INCOMPLETE_REQUEST;
+
+	}
+
+	http_business::HTTP_CODE http_business::parse_content()
+	{
+		if ( http_chunked )
 		{
-		    text += 15;
-		    text += strspn( text, " \t" );
-		    http_content_length = atol( text );
+		    return parse_chunked();
 		}
-		else if ( strncasecmp( text, "Host:", 5 ) == 0 )
+		long long take = http_read_idx - http_checked_idx;
+		if ( take > http_content_length )
 		{
-		    text += 5;
-		    text += strspn( text, " \t" );
-		    http_host = text;
+		    take = http_content_length;
 		}
-		else
+		if ( take > 0 && http_sink && ! http_sink->write( http_read_buf + http_checked_idx, take ) )
 		{
-		    //printf( "unknow header %s\n", text );
+		    return INTERNAL_ERROR;
 		}
+		http_checked_idx += take;
+		http_content_length -= take;
+		//nothing of this request is needed any more, the consumed bytes can go
+		http_start_line = http_checked_idx;
+		http_request_begin = http_checked_idx;
+		return http_content_length == 0 ? end_body() : INCOMPLETE_REQUEST;
+	}
+
+	/*
+		chunked body: a size line, the data and the CRLF behind it until a
+		chunk of size 0, then trailer fields up to an empty line. lines go
+		through parse_line() like the headers do, http_content_length counts
+		down the data left in the current chunk.
+	*/
+	http_business::HTTP_CODE http_business::parse_chunked()
+	{
+		while ( true )
+		{
+		    if ( http_chunk_state == CHUNK_DATA )
+		    {
+		        long long take = http_read_idx - http_checked_idx;
+		        if ( take > http_content_length )
+		        {
+		            take = http_content_length;
+		        }
+		        if ( take > 0 && http_sink && ! http_sink->write( http_read_buf + http_checked_idx, take ) )
+		        {
+		            return INTERNAL_ERROR;
+		        }
+		        http_checked_idx += take;
+		        http_content_length -= take;
+		        http_start_line = http_checked_idx;
+		        http_request_begin = http_checked_idx;
+		        if ( http_content_length > 0 )
+		        {
+		            return INCOMPLETE_REQUEST;
+		        }
+		        http_chunk_state = CHUNK_DATA_END;
+		    }
+
+		    LINE_STATUS line_status = parse_line();
+		    if ( line_status == LINE_OPEN )
+		    {
+		        return INCOMPLETE_REQUEST;
+		    }
+		    if ( line_status == LINE_BAD )
+		    {
+		        return BAD_REQUEST;
+		    }
+		    char* text = get_line();
+		    http_start_line = http_checked_idx;
+		    http_request_begin = http_checked_idx;
+		    switch ( http_chunk_state )
+		    {
+		        case CHUNK_SIZE:
+		        {
+		            long long size = 0;
+		            int digits = 0;
+		            for ( ; isxdigit( ( unsigned char )text[ digits ] ) && digits < 15; ++digits )
+		            {
+		                char c = text[ digits ] | 0x20;
+		                size = size * 16 + ( c <= '9' ? c - '0' : c - 'a' + 10 );
+		            }
+		            //chunk extensions are ignored
+		            if ( digits == 0 || ( text[ digits ] && ! strchr( "; \t", text[ digits ] ) ) )
+		            {
+		                return BAD_REQUEST;
+		            }
+		            if ( size > http_max_body - http_body_size )
+		            {
+		                return BODY_TOO_LARGE;
+		            }
+		            http_body_size += size;
+		            http_content_length = size;
+		            http_chunk_state = size > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+		            break;
+		        }
+		        case CHUNK_DATA_END:
+		        {
+		            if ( text[0] != '\0' )
+		            {
+		                return BAD_REQUEST;
+		            }
+		            http_chunk_state = CHUNK_SIZE;
+		            break;
+		        }
+		        default:
+		        {
+		            //trailer fields are read past
+		            if ( text[0] == '\0' )
+		            {
+		                return end_body();
+		            }
+		            break;
+		        }
+		    }
+		}
+	}
 
+	//routes a request that has a body, INCOMPLETE_REQUEST when a sink takes it
+	//routed at the end of the headers, they may be dropped while the body is read
+	http_business::HTTP_CODE http_business::route_body()
+	{
+		http_request_code = begin_body();
+		if ( http_request_code == DEFERRED_REQUEST || http_request_code == BODY_TOO_LARGE
+		        || ( http_request_code != INCOMPLETE_REQUEST && http_expect_continue ) )
+		{
+		    //left to a worker, too much to read through, or a client holding the body back for this answer
+		    return http_request_code;
+		}
 		return INCOMPLETE_REQUEST;
+	}
 
+	http_business::HTTP_CODE http_business::begin_body()
+	{
+		if ( http_content_length > http_max_body )
+		{
+		    return BODY_TOO_LARGE;
+		}
+		HTTP_CODE code = do_request();
+		if ( code != INCOMPLETE_REQUEST )
+		{
+		    //answered without the body, it is read through and dropped
+		    return code;
+		}
+		if ( http_expect_continue && http_segment_count == 0 )
+		{
+		    //tiny and the socket idle, so it goes out directly like the 503 does
+		    ssize_t sent = send( http_sockfd, continue_status, sizeof( continue_status ) - 1,
+		            MSG_DONTWAIT | MSG_NOSIGNAL );
+		    if ( sent > 0 )
+		    {
+		        metrics::count( COUNTER_BYTES_OUT, sent );
+		    }
+		}
+		return INCOMPLETE_REQUEST;
 	}
 
-	http_business::HTTP_CODE http_business::parse_content( char* text )
+	//the whole body is in: the answer decided at the end of the headers, or the sink's
+	http_business::HTTP_CODE http_business::end_body()
 	{
-		if ( http_read_idx >= ( http_content_length + http_checked_idx ) )
+		http_check_state = CHECK_STATE_REQUESTLINE;
+		if ( ! http_sink )
 		{
-		    text[ http_content_length ] = '\0';
-		    return GET_REQUEST;
+		    return http_request_code;
 		}
+		bool stored = http_sink->finish();
+		release_sink();
+		return stored ? CREATED_REQUEST : INTERNAL_ERROR;
+	}
+
+	void http_business::release_sink()
+	{
+		delete http_sink;
+		http_sink = 0;
+	}
+
+	bool http_business::splicing_body() const
+	{
+		return http_check_state == CHECK_STATE_CONTENT && ! http_chunked && http_content_length > 0
+		    && http_sink && http_sink->splice_fd() != -1 && http_loop->direct_input();
+	}
 
+	/*
+		the rest of a Content-Length body goes from the socket into the sink's
+		file through a pipe of the worker thread, never passing through user
+		space. it stops at EAGAIN, the next edge brings the connection back.
+		CLOSED_CONNECTION when the peer went away or the socket failed.
+	*/
+	http_business::HTTP_CODE http_business::splice_body()
+	{
+		static thread_local int pipe_fds[2] = { -1, -1 };
+		if ( pipe_fds[0] == -1 && pipe2( pipe_fds, O_CLOEXEC ) == -1 )
+		{
+		    return INTERNAL_ERROR;
+		}
+		int fd = http_sink->splice_fd();
+		while ( http_content_length > 0 )
+		{
+		    size_t want = http_content_length < SPLICE_CHUNK ? http_content_length : SPLICE_CHUNK;
+		    ssize_t in = splice( http_sockfd, NULL, pipe_fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+		    if ( in < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) )
+		    {
+		        return INCOMPLETE_REQUEST;
+		    }
+		    if ( in <= 0 )
+		    {
+		        return CLOSED_CONNECTION;
+		    }
+		    metrics::count( COUNTER_BYTES_IN, in );
+		    http_content_length -= in;
+		    while ( in > 0 )
+		    {
+		        ssize_t out = splice( pipe_fds[0], NULL, fd, NULL, in, SPLICE_F_MOVE );
+		        if ( out <= 0 )
+		        {
+		            //whatever is stuck in the pipe would end up in the next upload
+		            close( pipe_fds[0] );
+		            close( pipe_fds[1] );
+		            pipe_fds[0] = pipe_fds[1] = -1;
+		            return INTERNAL_ERROR;
+		        }
+		        in -= out;
+		    }
+		}
+		http_read_direct = true;
 		return INCOMPLETE_REQUEST;
 	}
 
@@ -242,7 +709,11 @@ namespace mj{
 		            || ( ( line_status = parse_line() ) == LINE_OK ) )
 		{
 		    text = get_line();
-		    http_start_line = http_checked_idx;
+		    if ( http_check_state != CHECK_STATE_CONTENT )
+		    {
+		        //a chunked body keeps the start of a size line it has only seen part of
+		        http_start_line = http_checked_idx;
+		    }
 		    //printf( "got one http line: %s\n", text );
 
 		    switch ( http_check_state )
@@ -267,14 +738,22 @@ namespace mj{
 		            {
 		                return do_request();
 		            }
+		            else if ( http_check_state == CHECK_STATE_CONTENT )
+		            {
+		                ret = route_body();
+		                if ( ret != INCOMPLETE_REQUEST )
+		                {
+		                    return ret;
+		                }
+		            }
 		            break;
 		        }
 		        case CHECK_STATE_CONTENT:
 		        {
-		            ret = parse_content( text );
-		            if ( ret == GET_REQUEST )
+		            ret = parse_content();
+		            if ( ret != INCOMPLETE_REQUEST )
 		            {
-		                return do_request();
+		                return ret;
 		            }
 		            line_status = LINE_OPEN;
 		            break;
@@ -289,232 +768,1056 @@ namespace mj{
 		return INCOMPLETE_REQUEST;
 	}
 
-	http_business::HTTP_CODE http_business::do_request()
+	static http_business::HTTP_CODE status_code( int status )
 	{
-		strcpy( http_real_file, doc_root );
-		int len = strlen( doc_root );
-		strncpy( http_real_file + len, http_url, FILENAME_LEN - len - 1 );
-		if ( stat( http_real_file, &http_file_stat ) < 0 )
+		switch ( status )
 		{
-		    return NO_RESOURCE;
+		    case 400:
+		        return http_business::BAD_REQUEST;
+		    case 403:
+		        return http_business::FORBIDDEN_REQUEST;
+		    case 404:
+		        return http_business::NO_RESOURCE;
+		    case 405:
+		        return http_business::METHOD_NOT_ALLOWED;
+		    case 413:
+		        return http_business::BODY_TOO_LARGE;
+		    case 414:
+		        return http_business::URI_TOO_LONG;
+		    case 503:
+		        return http_business::SERVICE_UNAVAILABLE;
+		    default:
+		        return http_business::INTERNAL_ERROR;
 		}
+	}
 
-		if ( ! ( http_file_stat.st_mode & S_IROTH ) )
+	http_business::HTTP_CODE http_business::do_request()
+	{
+		log_url();
+		bool other_methods;
+		const router::route* route = http_router->find( http_method, http_url, other_methods );
+		if ( ! route )
 		{
-		    return FORBIDDEN_REQUEST;
+		    return other_methods ? METHOD_NOT_ALLOWED : NO_RESOURCE;
 		}
-
-		if ( S_ISDIR( http_file_stat.st_mode ) )
+		switch ( route->kind )
 		{
-		    return BAD_REQUEST;
+		    case router::ROUTE_FILES:
+		        return serve_file();
+		    case router::ROUTE_METRICS:
+		        //rendering walks every thread's slot
+		        return http_cached_only ? DEFERRED_REQUEST : METRICS_REQUEST;
+		    default:
+		        //a handler's code may do anything
+		        return http_cached_only ? DEFERRED_REQUEST : call_handler( route->handler, http_url + route->len );
 		}
-
-		int fd = open( http_real_file, O_RDONLY );
-		http_file_address = ( char* )mmap( 0, http_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
-		close( fd );
-		return FILE_REQUEST;
 	}
 
-	void http_business::unmap()
+	http_business::HTTP_CODE http_business::call_handler( const route_handler* handler, const char* rest )
 	{
-		if( http_file_address )
+		route_request request = { http_method, http_url, rest, http_chunked ? -1 : http_content_length };
+		route_response response = { NULL, NULL, 500 };
+		handler->handle( request, response );
+		if ( response.source )
 		{
-		    munmap( http_file_address, http_file_stat.st_size );
-		    http_file_address = 0;
+		    delete response.sink;
+		    http_source = response.source;
+		    return STREAM_REQUEST;
 		}
+		return take_body( response.sink, response.status );
 	}
 
-	bool http_business::write()
+	//the sink gets the body, one that is empty is stored right away
+	http_business::HTTP_CODE http_business::take_body( body_sink* sink, int status )
 	{
-		int temp = 0;
-		int bytes_have_send = 0;
-		int bytes_to_send = http_write_idx;
-		if ( bytes_to_send == 0 )
+		if ( ! sink )
 		{
-		    modfd( http_epollfd, http_sockfd, EPOLLIN );
-		    init();
-		    return true;
+		    return status_code( status );
+		}
+		http_sink = sink;
+		if ( http_check_state == CHECK_STATE_CONTENT )
+		{
+		    return INCOMPLETE_REQUEST;
 		}
+		return end_body();
+	}
 
-		while( 1 )
+	http_business::HTTP_CODE http_business::serve_file()
+	{
+		char http_real_file[ FILENAME_LEN ];
+		snprintf( http_real_file, FILENAME_LEN, "%s%s", http_doc_root.load( std::memory_order_acquire ), http_url );
+		file_cache::FILE_STATUS status;
+		http_file = http_file_cache->acquire( http_real_file, status, http_cached_only );
+		switch ( status )
 		{
-		    temp = writev( http_sockfd, http_iv, http_iv_count );
-		    if ( temp <= -1 )
-		    {
-		        if( errno == EAGAIN )
+		    case file_cache::FILE_OK:
+		        if ( http_accept_encoding )
 		        {
-		            modfd( http_epollfd, http_sockfd, EPOLLOUT );
-		            return true;
+		            file_entry* variant = http_file_cache->acquire_encoded( http_file, http_accept_encoding, status,
+		                    http_cached_only );
+		            if ( status == file_cache::FILE_NOT_CACHED )
+		            {
+		                http_file_cache->release( http_file );
+		                http_file = 0;
+		                return DEFERRED_REQUEST;
+		            }
+		            if ( variant )
+		            {
+		                http_file_cache->release( http_file );
+		                http_file = variant;
+		            }
 		        }
-		        unmap();
-		        return false;
-		    }
+		        check_conditions( http_file );
+		        return FILE_REQUEST;
+		    case file_cache::FILE_MISSING:
+		        return NO_RESOURCE;
+		    case file_cache::FILE_FORBIDDEN:
+		        return FORBIDDEN_REQUEST;
+		    case file_cache::FILE_IS_DIR:
+		        return BAD_REQUEST;
+		    case file_cache::FILE_NOT_CACHED:
+		        return DEFERRED_REQUEST;
+		    default:
+		        return INTERNAL_ERROR;
+		}
+	}
 
-		    bytes_to_send -= temp;
-		    bytes_have_send += temp;
-		    if ( bytes_to_send <= bytes_have_send )
+	//an entity tag list matches when one of its tags, weak or not, is ours
+	static bool etag_matches( const char* list, const char* etag )
+	{
+		size_t etag_len = strlen( etag );
+		const char* p = list;
+		while ( *p )
+		{
+		    p += strspn( p, " \t," );
+		    if ( *p == '*' )
 		    {
-		        unmap();
-		        if( http_keep_alive )
-		        {
-		            init();
-		            modfd( http_epollfd, http_sockfd, EPOLLIN );
-		            return true;
-		        }
-		        else
-		        {
-		            modfd( http_epollfd, http_sockfd, EPOLLIN );
-		            return false;
-		        } 
+		        return true;
+		    }
+		    if ( strncmp( p, "W/", 2 ) == 0 )
+		    {
+		        p += 2;
+		    }
+		    if ( strncmp( p, etag, etag_len ) == 0 && ( p[ etag_len ] == '\0' || strchr( " \t,", p[ etag_len ] ) ) )
+		    {
+		        return true;
 		    }
+		    p += strcspn( p, "," );
 		}
+		return false;
 	}
 
-	bool http_business::add_response( const char* format, ... )
+	/*
+		If-None-Match wins over If-Modified-Since, a Range is only honoured
+		while If-Range still names the cached version of the file.
+	*/
+	void http_business::check_conditions( const file_entry* file )
 	{
-		if( http_write_idx >= WRITE_BUFFER_SIZE )
+		if ( http_if_none_match )
 		{
-		    return false;
+		    http_not_modified = etag_matches( http_if_none_match, file->etag );
 		}
-		va_list arg_list;
-		va_start( arg_list, format );
-		int len = vsnprintf( http_write_buf + http_write_idx, WRITE_BUFFER_SIZE - 1 - http_write_idx, format, arg_list );
-		if( len >= ( WRITE_BUFFER_SIZE - 1 - http_write_idx ) )
+		else if ( http_if_modified_since )
 		{
-		    return false;
+		    struct tm tm_since;
+		    memset( &tm_since, 0, sizeof( tm_since ) );
+		    const char* end = strptime( http_if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm_since );
+		    http_not_modified = end && file->st.st_mtime <= timegm( &tm_since );
 		}
-		http_write_idx += len;
-		va_end( arg_list );
-		return true;
+		if ( http_not_modified || ! http_range )
+		{
+		    return;
+		}
+		if ( http_if_range )
+		{
+		    bool current = ( http_if_range[0] == '"' ) ? strcmp( http_if_range, file->etag ) == 0
+		                                               : strcmp( http_if_range, file->modified ) == 0;
+		    if ( ! current )
+		    {
+		        return;
+		    }
+		}
+		http_range_count = parse_ranges( file, http_range );
 	}
 
-	bool http_business::add_status_line( int status, const char* title )
+	static const char* parse_offset( const char* p, off_t& value )
 	{
-		return add_response( "%s %d %s\r\n", "HTTP/1.1", status, title );
+		const char* begin = p;
+		value = 0;
+		while ( *p >= '0' && *p <= '9' && p - begin < 18 )
+		{
+		    value = value * 10 + ( *p++ - '0' );
+		}
+		return ( p == begin || ( *p >= '0' && *p <= '9' ) ) ? NULL : p;
 	}
 
-	bool http_business::add_headers( int content_len )
+	//number of satisfiable ranges, 0 to send the whole file, -1 for 416
+	int http_business::parse_ranges( const file_entry* file, const char* value )
 	{
-		add_content_length( content_len );
-		add_linger();
-		add_blank_line();
+		if ( strncasecmp( value, "bytes=", 6 ) != 0 )
+		{
+		    return 0;
+		}
+		off_t size = file->length;
+		int count = 0;
+		const char* p = value + 6;
+		while ( true )
+		{
+		    p += strspn( p, " \t," );
+		    if ( *p == '\0' )
+		    {
+		        break;
+		    }
+		    off_t first, last;
+		    if ( *p == '-' )
+		    {
+		        off_t suffix;
+		        if ( ! ( p = parse_offset( p + 1, suffix ) ) )
+		        {
+		            return 0;
+		        }
+		        first = suffix < size ? size - suffix : 0;
+		        last = suffix > 0 ? size - 1 : -1;
+		    }
+		    else
+		    {
+		        if ( ! ( p = parse_offset( p, first ) ) || *p++ != '-' )
+		        {
+		            return 0;
+		        }
+		        last = size - 1;
+		        if ( *p >= '0' && *p <= '9' )
+		        {
+		            if ( ! ( p = parse_offset( p, last ) ) || last < first )
+		            {
+		                return 0;
+		            }
+		            if ( last >= size )
+		            {
+		                last = size - 1;
+		            }
+		        }
+		    }
+		    p += strspn( p, " \t" );
+		    if ( *p != ',' && *p != '\0' )
+		    {
+		        return 0;
+		    }
+		    if ( first >= size || last < first )
+		    {
+		        //unsatisfiable on its own, the others may still be served
+		        continue;
+		    }
+		    if ( count == MAX_RANGES )
+		    {
+		        //more pieces than a response carries, the whole file is cheaper anyway
+		        return 0;
+		    }
+		    http_ranges[ count ].first = first;
+		    http_ranges[ count ].last = last;
+		    count++;
+		}
+		return count > 0 ? count : -1;
 	}
 
-	bool http_business::add_content_length( int content_len )
+	void http_business::release_files()
 	{
-		return add_response( "Content-Length: %d\r\n", content_len );
+		for ( int i = 0; i < http_file_count; ++i )
+		{
+		    http_file_cache->release( http_table->files[i] );
+		}
+		http_file_count = 0;
+		if( http_file )
+		{
+		    http_file_cache->release( http_file );
+		    http_file = 0;
+		}
 	}
 
-	bool http_business::add_linger()
+	bool http_business::take_table()
 	{
-		return add_response( "Connection: %s\r\n", ( http_keep_alive == true ) ? "keep-alive" : "close" );
+		if ( ! http_table )
+		{
+		    http_table = ( response_table* )http_table_pool->get();
+		}
+		return http_table != 0;
 	}
 
-	bool http_business::add_blank_line()
+	bool http_business::add_segment( const char* data, size_t len, int fd, off_t offset )
 	{
-		return add_response( "%s", "\r\n" );
+		if ( ! take_table() )
+		{
+		    return false;
+		}
+		if ( data && http_segment_count > 0 )
+		{
+		    out_segment& last = http_table->segments[ http_segment_count - 1 ];
+		    if ( last.data && last.data + last.len == data )
+		    {
+		        last.len += len;
+		        return true;
+		    }
+		}
+		if ( http_segment_count == MAX_SEGMENTS )
+		{
+		    return false;
+		}
+		out_segment& seg = http_table->segments[ http_segment_count++ ];
+		seg.data = data;
+		seg.len = len;
+		seg.fd = fd;
+		seg.offset = offset;
+		return true;
 	}
 
-	bool http_business::add_content( const char* content )
+	/*
+		send the queued segments in order. runs of memory segments go out in
+		one sendmsg, with MSG_MORE when a file body follows so the header
+		shares a segment with it. progress survives EAGAIN.
+	*/
+	bool http_business::send_segments()
 	{
-		return add_response( "%s", content );
-	}
+		struct iovec iv[ MAX_SEGMENTS ];
+		struct msghdr msg;
+		memset( &msg, 0, sizeof( msg ) );
 
-	bool http_business::process_write( HTTP_CODE ret )
-	{
-		switch ( ret )
+		while ( http_segment_idx < http_segment_count )
 		{
-		    case INTERNAL_ERROR:
+		    out_segment& seg = http_table->segments[ http_segment_idx ];
+		    if ( ! seg.data )
 		    {
-		        add_status_line( 500, error_500_title );
-		        add_headers( strlen( error_500_form ) );
-		        if ( ! add_content( error_500_form ) )
+		        ssize_t temp = sendfile( http_sockfd, seg.fd, &seg.offset, seg.len );
+		        if ( temp <= -1 )
 		        {
 		            return false;
 		        }
-		        break;
-		    }
-		    case BAD_REQUEST:
-		    {
-		        add_status_line( 400, error_400_title );
-		        add_headers( strlen( error_400_form ) );
-		        if ( ! add_content( error_400_form ) )
+		        if ( temp == 0 )
 		        {
+		            //file was truncated under us
+		            errno = EIO;
 		            return false;
 		        }
-		        break;
-		    }
-		    case NO_RESOURCE:
-		    {
-		        add_status_line( 404, error_404_title );
-		        add_headers( strlen( error_404_form ) );
-		        if ( ! add_content( error_404_form ) )
+		        metrics::count( COUNTER_BYTES_OUT, temp );
+		        seg.len -= temp;
+		        if ( seg.len == 0 )
 		        {
-		            return false;
+		            http_segment_idx++;
 		        }
-		        break;
+		        continue;
 		    }
-		    case FORBIDDEN_REQUEST:
+
+		    bool complete = false;
+		    msg.msg_iov = iv;
+		    msg.msg_iovlen = output_iovecs( iv, MAX_SEGMENTS, complete );
+		    ssize_t temp = sendmsg( http_sockfd, &msg, complete ? 0 : MSG_MORE );
+		    if ( temp <= -1 )
 		    {
-		        add_status_line( 403, error_403_title );
-		        add_headers( strlen( error_403_form ) );
-		        if ( ! add_content( error_403_form ) )
-		        {
-		            return false;
-		        }
-		        break;
+		        return false;
 		    }
-		    case FILE_REQUEST:
+		    metrics::count( COUNTER_BYTES_OUT, temp );
+		    output_sent( temp );
+		}
+		return true;
+	}
+
+	//the run of memory segments at the head of the output, complete when nothing follows it
+	int http_business::output_iovecs( struct iovec* iv, int max, bool& complete ) const
+	{
+		int count = 0;
+		int i = http_segment_idx;
+		for ( ; i < http_segment_count && count < max && http_table->segments[i].data; ++i )
+		{
+		    iv[ count ].iov_base = ( void* )http_table->segments[i].data;
+		    iv[ count ].iov_len = http_table->segments[i].len;
+		    count++;
+		}
+		complete = ( i == http_segment_count );
+		return count;
+	}
+
+	//the file segment at the head of the output, false when the head is memory
+	bool http_business::output_file( int& fd, off_t& offset, size_t& len ) const
+	{
+		if ( http_segment_idx >= http_segment_count || http_table->segments[ http_segment_idx ].data )
+		{
+		    return false;
+		}
+		const out_segment& cur = http_table->segments[ http_segment_idx ];
+		fd = cur.fd;
+		offset = cur.offset;
+		len = cur.len;
+		return true;
+	}
+
+	void http_business::output_sent( size_t bytes )
+	{
+		while ( bytes > 0 && http_segment_idx < http_segment_count )
+		{
+		    out_segment& cur = http_table->segments[ http_segment_idx ];
+		    if ( bytes >= cur.len )
 		    {
-		        add_status_line( 200, ok_200_title );
-		        if ( http_file_stat.st_size != 0 )
+		        bytes -= cur.len;
+		        http_segment_idx++;
+		    }
+		    else
+		    {
+		        if ( cur.data )
 		        {
-		            add_headers( http_file_stat.st_size );
-		            http_iv[ 0 ].iov_base = http_write_buf;
-		            http_iv[ 0 ].iov_len = http_write_idx;
-		            http_iv[ 1 ].iov_base = http_file_address;
-		            http_iv[ 1 ].iov_len = http_file_stat.st_size;
-		            http_iv_count = 2;
-		            return true;
+		            cur.data += bytes;
 		        }
 		        else
 		        {
-		            const char* ok_string = "<html><body></body></html>";
-		            add_headers( strlen( ok_string ) );
-		            if ( ! add_content( ok_string ) )
-		            {
-		                return false;
-		            }
+		            cur.offset += bytes;
 		        }
+		        cur.len -= bytes;
+		        bytes = 0;
 		    }
-		    default:
+		}
+	}
+
+	//false on a socket error, EAGAIN leaves the rest queued and writing() true
+	bool http_business::write()
+	{
+		if ( http_segment_idx < http_segment_count && ! send_segments() )
+		{
+		    return errno == EAGAIN;
+		}
+		return true;
+	}
+
+	/*
+		everything queued went out: drop the responses and tell whether the
+		connection stays open. an idle one gives its buffers back.
+	*/
+	bool http_business::finish_response()
+	{
+		push_log( metrics::now_ns() );
+		bool linger = http_linger || http_segment_count == 0;
+		init_response();
+		if( ! linger )
+		{
+		    return false;
+		}
+		if( http_read_chain.size() == 0 )
+		{
+		    release_buffers();
+		}
+		return true;
+	}
+
+	//keeps the url for the record of this request, it may be sampled once answered
+	void http_business::log_url()
+	{
+		if ( ! access_log::enabled() || http_log_count >= MAX_PIPELINE )
+		{
+		    return;
+		}
+		if ( ! http_log_records )
+		{
+		    http_log_records = new access_record[ MAX_PIPELINE ];
+		}
+		access_record& r = http_log_records[ http_log_count ];
+		strncpy( r.url, http_url, sizeof( r.url ) - 1 );
+		r.url[ sizeof( r.url ) - 1 ] = '\0';
+		http_log_named = true;
+	}
+
+	void http_business::log_response( HTTP_CODE ret, int first_segment, long long begin, long long parsed,
+		        long long served, long long queued )
+	{
+		if ( http_log_count >= MAX_PIPELINE || ! access_log::sampled() )
+		{
+		    return;
+		}
+		if ( ! http_log_records )
+		{
+		    http_log_records = new access_record[ MAX_PIPELINE ];
+		}
+		access_record& r = http_log_records[ http_log_count++ ];
+		if ( ! http_log_named )
+		{
+		    //refused before it was routed
+		    strcpy( r.url, "-" );
+		}
+		long long bytes = 0;
+		for ( int i = first_segment; i < http_segment_count; ++i )
+		{
+		    bytes += http_table->segments[i].len;
+		}
+		r.served_ns = served;
+		r.bytes = bytes;
+		r.address = http_address.sin_addr.s_addr;
+		r.port = http_address.sin_port;
+		r.status = response_status( ret );
+		r.method = http_method;
+		r.queue_us = begin > queued ? ( begin - queued ) / 1000 : 0;
+		r.parse_us = ( parsed - begin ) / 1000;
+		r.service_us = ( served - begin ) / 1000;
+		r.send_us = -1;
+	}
+
+	//sent is when the queued output went out, -1 when it never did
+	void http_business::push_log( long long sent )
+	{
+		for ( int i = 0; i < http_log_count; ++i )
+		{
+		    access_record& r = http_log_records[i];
+		    if ( sent >= 0 )
+		    {
+		        r.send_us = ( sent - r.served_ns ) / 1000;
+		    }
+		    access_log::record( r );
+		}
+		http_log_count = 0;
+	}
+
+	/*
+		the loop's answer to a request it won't queue: the fixed 503 goes
+		straight to the socket, a few hundred bytes an idle socket always
+		takes, and the caller closes the connection.
+	*/
+	void http_business::send_unavailable()
+	{
+		const prebuilt_response& response = http_prebuilt[ SERVICE_UNAVAILABLE ][ 0 ];
+		ssize_t sent = send( http_sockfd, response.data, response.len, MSG_DONTWAIT | MSG_NOSIGNAL );
+		if ( sent > 0 )
+		{
+		    metrics::count( COUNTER_BYTES_OUT, sent );
+		}
+		metrics::count_status( 503 );
+	}
+
+	bool http_business::add_response( const char* format, ... )
+	{
+		va_list arg_list, size_list;
+		va_start( arg_list, format );
+		va_copy( size_list, arg_list );
+		int len = vsnprintf( NULL, 0, format, size_list );
+		va_end( size_list );
+		char* dst = ( len < 0 ) ? NULL : http_write_chain.reserve( len + 1 );
+		if( dst )
+		{
+		    vsnprintf( dst, len + 1, format, arg_list );
+		}
+		va_end( arg_list );
+		if( ! dst )
+		{
+		    return false;
+		}
+		http_write_chain.commit( len );
+		return add_segment( dst, len, -1, 0 );
+	}
+
+	bool http_business::add_bytes( const char* data, int len )
+	{
+		char* dst = http_write_chain.append( data, len );
+		return dst && add_segment( dst, len, -1, 0 );
+	}
+
+	//the hot path formats numbers itself instead of going through the printf family
+	static char* put_str( char* p, const char* str, size_t len )
+	{
+		memcpy( p, str, len );
+		return p + len;
+	}
+
+	static char* put_str( char* p, const char* str )
+	{
+		return put_str( p, str, strlen( str ) );
+	}
+
+	static char* put_uint( char* p, unsigned long long value )
+	{
+		char digits[ 24 ];
+		int n = 0;
+		do
+		{
+		    digits[ n++ ] = '0' + value % 10;
+		    value /= 10;
+		} while ( value );
+		while ( n > 0 )
+		{
+		    *p++ = digits[ --n ];
+		}
+		return p;
+	}
+
+	//writes value in hex so that it ends at end, returns where it begins
+	static char* put_hex_before( char* end, unsigned long long value )
+	{
+		static const char hex_digits[] = "0123456789abcdef";
+		do
+		{
+		    *--end = hex_digits[ value & 15 ];
+		    value >>= 4;
+		} while ( value );
+		return end;
+	}
+
+	static char* put_content_range( char* p, off_t first, off_t last, off_t size )
+	{
+		p = put_str( p, "Content-Range: bytes " );
+		p = put_uint( p, first );
+		*p++ = '-';
+		p = put_uint( p, last );
+		*p++ = '/';
+		p = put_uint( p, size );
+		return put_str( p, "\r\n" );
+	}
+
+	static const char not_modified_status[] = "HTTP/1.1 304 Not Modified\r\n";
+	static const char range_boundary[] = "9f3c1a7e5d2b8046";
+	static const char range_closing[] = "\r\n--9f3c1a7e5d2b8046--\r\n";
+
+	bool http_business::add_file_response()
+	{
+		//the header fragments live in the cache entry, the response holds a reference to it
+		file_entry* file = http_file;
+		if ( ! take_table() )
+		{
+		    return false;
+		}
+		http_table->files[ http_file_count++ ] = file;
+		http_file = 0;
+
+		const char* linger = http_keep_alive ? connection_keep_alive : connection_close;
+		size_t linger_len = http_keep_alive ? sizeof( connection_keep_alive ) - 1 : sizeof( connection_close ) - 1;
+		if ( http_not_modified )
+		{
+		    return add_segment( not_modified_status, sizeof( not_modified_status ) - 1, -1, 0 )
+		        && add_segment( file->header + file->validators, file->header_len - file->validators, -1, 0 )
+		        && add_segment( linger, linger_len, -1, 0 );
+		}
+		if ( http_range_count != 0 )
+		{
+		    return add_range_response( file, linger, linger_len );
+		}
+		if ( file->length == 0 )
+		{
+		    const prebuilt_response& response = http_prebuilt[ FILE_REQUEST ][ http_keep_alive ? 1 : 0 ];
+		    return add_segment( response.data, response.len, -1, 0 );
+		}
+		return add_segment( file->header, file->header_len, -1, 0 )
+		    && add_segment( linger, linger_len, -1, 0 )
+		    && add_segment( file->address, file->length, file->fd, 0 );
+	}
+
+	//206 with one part or multipart/byteranges, 416 when nothing was satisfiable
+	bool http_business::add_range_response( file_entry* file, const char* linger, size_t linger_len )
+	{
+		char head[ 256 ];
+		char* p = head;
+		off_t size = file->length;
+		if ( http_range_count < 0 )
+		{
+		    p = put_str( p, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */" );
+		    p = put_uint( p, size );
+		    p = put_str( p, "\r\nContent-Length: 0\r\n" );
+		    return add_bytes( head, p - head ) && add_segment( linger, linger_len, -1, 0 );
+		}
+
+		p = put_str( p, "HTTP/1.1 206 Partial Content\r\n" );
+		if ( http_range_count == 1 )
+		{
+		    const byte_range& r = http_ranges[0];
+		    p = put_str( p, "Content-Type: " );
+		    p = put_str( p, file->type );
+		    p = put_str( p, "\r\n" );
+		    p = put_content_range( p, r.first, r.last, size );
+		    p = put_str( p, "Content-Length: " );
+		    p = put_uint( p, r.last - r.first + 1 );
+		    p = put_str( p, "\r\n" );
+		    return add_bytes( head, p - head )
+		        && add_segment( file->header + file->validators, file->header_len - file->validators, -1, 0 )
+		        && add_segment( linger, linger_len, -1, 0 )
+		        && add_segment( file->address ? file->address + r.first : NULL, r.last - r.first + 1, file->fd, r.first );
+		}
+
+		//part headers first, the total length goes into the response header
+		char parts[ MAX_RANGES ][ 192 ];
+		int part_len[ MAX_RANGES ];
+		off_t total = sizeof( range_closing ) - 1;
+		for ( int i = 0; i < http_range_count; ++i )
+		{
+		    const byte_range& r = http_ranges[i];
+		    char* q = parts[i];
+		    q = put_str( q, "\r\n--" );
+		    q = put_str( q, range_boundary, sizeof( range_boundary ) - 1 );
+		    q = put_str( q, "\r\nContent-Type: " );
+		    q = put_str( q, file->type );
+		    q = put_str( q, "\r\n" );
+		    q = put_content_range( q, r.first, r.last, size );
+		    q = put_str( q, "\r\n" );
+		    part_len[i] = q - parts[i];
+		    total += part_len[i] + r.last - r.first + 1;
+		}
+		p = put_str( p, "Content-Type: multipart/byteranges; boundary=" );
+		p = put_str( p, range_boundary, sizeof( range_boundary ) - 1 );
+		p = put_str( p, "\r\nContent-Length: " );
+		p = put_uint( p, total );
+		p = put_str( p, "\r\n" );
+		if ( ! add_bytes( head, p - head )
+		        || ! add_segment( file->header + file->validators, file->header_len - file->validators, -1, 0 )
+		        || ! add_segment( linger, linger_len, -1, 0 ) )
+		{
+		    return false;
+		}
+		for ( int i = 0; i < http_range_count; ++i )
+		{
+		    const byte_range& r = http_ranges[i];
+		    if ( ! add_bytes( parts[i], part_len[i] )
+		            || ! add_segment( file->address ? file->address + r.first : NULL,
+		                    r.last - r.first + 1, file->fd, r.first ) )
 		    {
 		        return false;
 		    }
 		}
+		return add_segment( range_closing, sizeof( range_closing ) - 1, -1, 0 );
+	}
+
+	//rendered by the worker that serves the request, the body is copied into the write chain
+	bool http_business::add_metrics_response()
+	{
+		char body[ METRICS_BUFFER ];
+		int len = metrics::render( body, sizeof( body ) );
+		if ( len < 0 )
+		{
+		    return false;
+		}
+		return add_response( "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+		            "Content-Length: %d\r\nCache-Control: no-store\r\n%s", len,
+		            http_keep_alive ? connection_keep_alive : connection_close )
+		    && add_bytes( body, len );
+	}
+
+	bool http_business::add_stream_response()
+	{
+		http_stream_keep_alive = http_keep_alive;
+		return add_response( "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nTransfer-Encoding: chunked\r\n%s",
+		            http_source->content_type(), http_keep_alive ? connection_keep_alive : connection_close )
+		    && stream_more();
+	}
 
-		http_iv[ 0 ].iov_base = http_write_buf;
-		http_iv[ 0 ].iov_len = http_write_idx;
-		http_iv_count = 1;
+	/*
+		another window of a streamed response, each produce() framed as one
+		chunk in a write block of its own: the size line goes in front of the
+		data, the CRLF behind it. the last chunk is added once the source runs
+		dry. false when the source failed, the client can only be told by
+		cutting the connection in the middle of the body.
+	*/
+	bool http_business::stream_more()
+	{
+		size_t frame_size = http_write_block_size - chain_buffer::block_offset();
+		size_t room = frame_size - STREAM_FRAME;
+		size_t produced = 0;
+		while ( produced < ( size_t )STREAM_WINDOW && http_segment_count + 2 < MAX_SEGMENTS )
+		{
+		    char* frame = http_write_chain.reserve( frame_size );
+		    if ( ! frame )
+		    {
+		        return false;
+		    }
+		    char* data = frame + STREAM_FRAME - 2;
+		    ssize_t len = http_source->produce( data, room );
+		    if ( len < 0 )
+		    {
+		        return false;
+		    }
+		    if ( len == 0 )
+		    {
+		        metrics::count( COUNTER_BYTES_STREAMED, produced );
+		        delete http_source;
+		        http_source = 0;
+		        return add_bytes( "0\r\n\r\n", 5 );
+		    }
+		    data[ -2 ] = '\r';
+		    data[ -1 ] = '\n';
+		    char* begin = put_hex_before( data - 2, len );
+		    data[ len ] = '\r';
+		    data[ len + 1 ] = '\n';
+		    http_write_chain.commit( data + len + 2 - frame );
+		    if ( ! add_segment( begin, data + len + 2 - begin, -1, 0 ) )
+		    {
+		        return false;
+		    }
+		    produced += len;
+		}
+		metrics::count( COUNTER_BYTES_STREAMED, produced );
 		return true;
 	}
 
+	int http_business::response_status( HTTP_CODE ret ) const
+	{
+		switch ( ret )
+		{
+		    case FILE_REQUEST:
+		        if ( http_not_modified )
+		        {
+		            return 304;
+		        }
+		        return http_range_count == 0 ? 200 : ( http_range_count < 0 ? 416 : 206 );
+		    case METRICS_REQUEST:
+		    case STREAM_REQUEST:
+		        return 200;
+		    case CREATED_REQUEST:
+		        return 201;
+		    case BODY_TOO_LARGE:
+		        return 413;
+		    case BAD_REQUEST:
+		        return 400;
+		    case FORBIDDEN_REQUEST:
+		        return 403;
+		    case NO_RESOURCE:
+		        return 404;
+		    case METHOD_NOT_ALLOWED:
+		        return 405;
+		    case URI_TOO_LONG:
+		        return 414;
+		    case TOO_LARGE_REQUEST:
+		        return 431;
+		    case SERVICE_UNAVAILABLE:
+		        return 503;
+		    default:
+		        return 500;
+		}
+	}
+
+	bool http_business::process_write( HTTP_CODE ret )
+	{
+		if ( ret == FILE_REQUEST )
+		{
+		    return add_file_response();
+		}
+		if ( ret == METRICS_REQUEST )
+		{
+		    return add_metrics_response();
+		}
+		if ( ret == STREAM_REQUEST )
+		{
+		    return add_stream_response();
+		}
+		if ( ret < 0 || ret > SERVICE_UNAVAILABLE || ! http_prebuilt[ ret ][ 0 ].data )
+		{
+		    return false;
+		}
+		const prebuilt_response& response = http_prebuilt[ ret ][ http_keep_alive ? 1 : 0 ];
+		return add_segment( response.data, response.len, -1, 0 );
+	}
+
+	/*
+		queues the answer to the request parsed up to here and counts it.
+		begin is when its parse started and queued when it was handed over,
+		both move on to when it was served, where the next request starts.
+	*/
+	bool http_business::respond( HTTP_CODE ret, long long& begin, long long& queued )
+	{
+		long long parsed = metrics::now_ns();
+		metrics::observe( HISTOGRAM_PARSE, parsed - begin );
+		if ( ret == BAD_REQUEST || ret == TOO_LARGE_REQUEST || http_check_state == CHECK_STATE_CONTENT )
+		{
+		    //we can't tell where the next request starts, or the rest of a body is still to come
+		    http_keep_alive = false;
+		}
+		release_sink();
+
+		int first_segment = http_segment_count;
+		if ( ! process_write( ret ) )
+		{
+		    return false;
+		}
+		long long served = metrics::now_ns();
+		metrics::observe( HISTOGRAM_SERVICE, served - begin );
+		metrics::count_status( response_status( ret ) );
+		if ( access_log::enabled() )
+		{
+		    log_response( ret, first_segment, begin, parsed, served, queued );
+		    queued = served;
+		}
+		begin = served;
+		http_request_begin = http_checked_idx;
+		http_linger = http_keep_alive || http_source;
+		return true;
+	}
+
+	void http_business::refresh_read_buf()
+	{
+		http_read_buf = http_read_chain.front();
+		http_read_idx = http_read_chain.front_size();
+	}
+
+	http_business::LINE_STATUS http_business::next_line( char*& text )
+	{
+		refresh_read_buf();
+		LINE_STATUS status = parse_line();
+		while ( status == LINE_OPEN && pull_read_buf() )
+		{
+		    status = parse_line();
+		}
+		if ( status == LINE_OK )
+		{
+		    text = get_line();
+		    http_start_line = http_checked_idx;
+		}
+		return status;
+	}
+
+	http_business::HTTP_CODE http_business::request_line( char* text )
+	{
+		http_begin_ns = metrics::now_ns();
+		http_queued_ns = http_begin_ns;
+		return parse_request_line( text );
+	}
+
+	http_business::HTTP_CODE http_business::answer( HTTP_CODE ret )
+	{
+		if ( ! respond( ret, http_begin_ns, http_queued_ns ) )
+		{
+		    return CLOSED_CONNECTION;
+		}
+		if ( http_keep_alive )
+		{
+		    init_request();
+		    compact_read_buf();
+		}
+		return ret;
+	}
+
+	http_business::HTTP_CODE http_business::route()
+	{
+		HTTP_CODE ret = http_check_state == CHECK_STATE_CONTENT ? route_body() : do_request();
+		if ( ret == INCOMPLETE_REQUEST && ! http_cached_only )
+		{
+		    //a worker that routed it goes on with the body it has, saving the next hop
+		    return take_content();
+		}
+		return ( ret == INCOMPLETE_REQUEST || ret == DEFERRED_REQUEST ) ? ret : answer( ret );
+	}
+
+	http_business::HTTP_CODE http_business::take_content()
+	{
+		if ( http_sink && http_cached_only )
+		{
+		    //a sink writes to disk; nothing new, nothing to hand over
+		    return ( size_t )http_checked_idx < http_read_chain.size() ? DEFERRED_REQUEST : INCOMPLETE_REQUEST;
+		}
+		refresh_read_buf();
+		HTTP_CODE ret = parse_content();
+		while ( ret == INCOMPLETE_REQUEST && pull_read_buf() )
+		{
+		    ret = parse_content();
+		}
+		return ret == INCOMPLETE_REQUEST ? ret : answer( ret );
+	}
+
+	http_business::HTTP_CODE http_business::produce()
+	{
+		if ( http_cached_only )
+		{
+		    //a source is the handler's code
+		    return DEFERRED_REQUEST;
+		}
+		if ( ! stream_more() )
+		{
+		    return CLOSED_CONNECTION;
+		}
+		http_linger = http_source || http_stream_keep_alive;
+		return STREAM_REQUEST;
+	}
+
+	http_business::HTTP_CODE http_business::step_cached( STEP step )
+	{
+		http_cached_only = true;
+		HTTP_CODE ret = ( this->*step )();
+		http_cached_only = false;
+		return ret;
+	}
+
 	void http_business::process()
 	{
-		HTTP_CODE read_ret = process_read();
-		if ( read_ret == INCOMPLETE_REQUEST )
+		if ( http_step )
 		{
-		    modfd( http_epollfd, http_sockfd, EPOLLIN );
+		    //a step of a request the coroutine backend parses, the loop takes it from here
+		    STEP step = http_step;
+		    http_step = 0;
+		    http_begin_ns = metrics::now_ns();
+		    http_step_result = ( this->*step )();
+		    http_loop->resume( *this );
 		    return;
 		}
 
-		bool write_ret = process_write( read_ret );
-		if ( ! write_ret )
+		//the loop thread may have read more since the last pass
+		refresh_read_buf();
+
+		if ( http_source )
 		{
-		    close_conn();
+		    //the rest of a streamed response goes out before the requests behind it are looked at
+		    if ( produce() == CLOSED_CONNECTION )
+		    {
+		        shutdown( http_sockfd, SHUT_RDWR );
+		        http_loop->resume( *this );
+		        return;
+		    }
+		    if ( http_source || ! http_stream_keep_alive )
+		    {
+		        http_loop->resume( *this );
+		        return;
+		    }
 		}
 
-		modfd( http_epollfd, http_sockfd, EPOLLOUT );
+		int responses = 0;
+		long long begin = metrics::now_ns();
+		long long queued = http_queued_ns;
+		while ( responses < MAX_PIPELINE && http_segment_count + RESPONSE_SEGMENTS <= MAX_SEGMENTS )
+		{
+		    HTTP_CODE read_ret = process_read();
+		    if ( read_ret == INCOMPLETE_REQUEST )
+		    {
+		        if ( pull_read_buf() )
+		        {
+		            continue;
+		        }
+		        if ( splicing_body() && http_read_chain.size() == 0 )
+		        {
+		            read_ret = splice_body();
+		            if ( read_ret == CLOSED_CONNECTION )
+		            {
+		                shutdown( http_sockfd, SHUT_RDWR );
+		                http_loop->resume( *this );
+		                return;
+		            }
+		            if ( read_ret == INCOMPLETE_REQUEST && http_content_length == 0 )
+		            {
+		                continue;
+		            }
+		        }
+		        if ( read_ret == INCOMPLETE_REQUEST )
+		        {
+		            if ( http_check_state == CHECK_STATE_CONTENT || http_read_idx < http_max_header_size )
+		            {
+		                break;
+		            }
+		            read_ret = TOO_LARGE_REQUEST;
+		        }
+		    }
+		    if ( ! respond( read_ret, begin, queued ) )
+		    {
+		        //the event loop closes it, the connection and its timer belong to that thread
+		        shutdown( http_sockfd, SHUT_RDWR );
+		        http_loop->resume( *this );
+		        return;
+		    }
+		    responses++;
+		    if ( ! http_keep_alive )
+		    {
+		        break;
+		    }
+		    init_request();
+		    if ( http_source )
+		    {
+		        break;
+		    }
+		}
+		compact_read_buf();
+		http_loop->resume( *this );
 	}
-}
-
+}
\ No newline at end of file
@@ -16,86 +16,281 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <ctype.h>
+#include <atomic>
+#include "file_cache.h"
+#include "timer_wheel.h"
+#include "chain_buffer.h"
+#include "body_sink.h"
+#include "body_source.h"
+#include "access_log.h"
 
 namespace mj{
+	class router;
+	class route_handler;
+
+	class event_loop;
+
 	class http_business
 	{
 	public:
-		static const int FILENAME_LEN = 200;
-		static const int READ_BUFFER_SIZE = 2048;
-		static const int WRITE_BUFFER_SIZE = 1024;
+		static const int FILENAME_LEN = 2048;
+		static const int MAX_PIPELINE = 16;
+		static const int MAX_SEGMENTS = 4 * MAX_PIPELINE;
+		static const int MAX_RANGES = 4;
+		static const int RESPONSE_SEGMENTS = 4 + 2 * MAX_RANGES;
+		static const int METRICS_BUFFER = 32768;
+		static const int SPLICE_CHUNK = 65536;
+		static const int STREAM_WINDOW = 65536;     //streamed output produced ahead of the socket
+		static const int STREAM_FRAME = 16;         //chunk size line and the CRLF behind the data
 		enum METHOD { GET, POST, HEAD, PUT, DELETE, TRACE, OPTIONS, CONNECT, PATCH };
 		enum CHECK_STATE { CHECK_STATE_REQUESTLINE, CHECK_STATE_HEADER, CHECK_STATE_CONTENT };
 		enum HTTP_CODE { INCOMPLETE_REQUEST, GET_REQUEST, BAD_REQUEST, NO_RESOURCE, 
-			              FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION };
+			              FORBIDDEN_REQUEST, FILE_REQUEST, INTERNAL_ERROR, CLOSED_CONNECTION,
+			              TOO_LARGE_REQUEST, CREATED_REQUEST, BODY_TOO_LARGE, METHOD_NOT_ALLOWED,
+			              URI_TOO_LONG, SERVICE_UNAVAILABLE,
+			              METRICS_REQUEST, STREAM_REQUEST, DEFERRED_REQUEST };
+		enum CHUNK_STATE { CHUNK_SIZE, CHUNK_DATA, CHUNK_DATA_END, CHUNK_TRAILER };
 		enum LINE_STATUS { LINE_OK, LINE_BAD, LINE_OPEN };
+		enum SEND_MODE { SEND_MMAP, SEND_SENDFILE };
 
 	public:
 		http_business(){}
 		~http_business(){}
 
 	public:
-		void init(int sockfd, const sockaddr_in& addr);
+		void init(int sockfd, const sockaddr_in& addr, event_loop* loop, block_pool* read_pool, block_pool* write_pool,
+		            block_pool* table_pool);
 		void close_conn(bool real_close = true);
 		void process();
 		bool read();
 		bool write();
+		bool finish_response();
+		void send_unavailable();
+
+		//for backends that issue the socket i/o themselves
+		void adopt_input(char* block, size_t len) { http_read_chain.adopt( block, len ); }
+		void take_input(chain_buffer& input) { http_read_chain.splice( input ); }
+		int output_iovecs(struct iovec* iv, int max, bool& complete) const;
+		bool output_file(int& fd, off_t& offset, size_t& len) const;
+		void output_sent(size_t bytes);
+		bool last_response() const { return ! http_linger; }
+		size_t input_size() const { return http_read_chain.size(); }
+
+		bool pending_input() const { return http_segment_count == 0 && ( size_t )http_checked_idx < http_read_chain.size(); }
+		bool reading_body() const { return http_check_state == CHECK_STATE_CONTENT; }
+		bool splicing_body() const;
+		bool writing() const { return http_segment_idx < http_segment_count; }
+		bool producing() const { return http_source != 0; }
+		int sockfd() const { return http_sockfd; }
+		//block size of the pool the loop hands to init() for the response tables
+		static size_t table_size() { return sizeof( response_table ); }
+
+		/*
+			for the coroutine backend, which parses a request straight through
+			itself and has it served in steps. a step runs on the loop with
+			step_cached(), where nothing may block, and DEFERRED_REQUEST asks
+			for it on a worker: offload() it and the next process() runs it in
+			place of a pass over the input. a step gives back INCOMPLETE_REQUEST
+			while the body is still to come, CLOSED_CONNECTION when the answer
+			could not be queued, otherwise the answer it queued.
+		*/
+		typedef HTTP_CODE ( http_business::*STEP )();
+		//the next line of the current request, LINE_OPEN until more input completes it
+		LINE_STATUS next_line(char*& text);
+		bool header_full() const { return http_read_idx >= http_max_header_size; }
+		HTTP_CODE request_line(char* text);
+		HTTP_CODE header(char* text) { return parse_headers( text ); }
+		//queues the answer to the request parsed up to here, without routing it
+		HTTP_CODE answer(HTTP_CODE ret);
+		//steps: routing at the end of the headers, the body read so far, the next window of a stream
+		HTTP_CODE route();
+		HTTP_CODE take_content();
+		HTTP_CODE produce();
+		HTTP_CODE step_cached(STEP step);
+		void offload(STEP step) { http_step = step; }
+		HTTP_CODE step_result() const { return http_step_result; }
+		//room in the response table for one more answer before the queued ones are sent
+		bool room_for_response() const
+		{
+		    return http_file_count < MAX_PIPELINE && http_segment_count + RESPONSE_SEGMENTS <= MAX_SEGMENTS;
+		}
 
 	private:
+		struct byte_range
+		{
+			off_t first;
+			off_t last;
+		};
+
+		//one piece of queued output: memory when data is set, otherwise sendfile from fd
+		struct out_segment
+		{
+			const char* data;
+			size_t len;
+			int fd;
+			off_t offset;
+		};
+
+		//what the queued responses are made of, a block of the loop's table pool
+		struct response_table
+		{
+			out_segment segments[ MAX_SEGMENTS ];
+			file_entry* files[ MAX_PIPELINE ];
+		};
+
 		void init();
+		void release_buffers();
+		void init_request();
+		void init_response();
+		void compact_read_buf();
+		bool pull_read_buf();
 		HTTP_CODE process_read();
 		bool process_write(HTTP_CODE ret);
+		bool respond(HTTP_CODE ret, long long& begin, long long& queued);
+		void refresh_read_buf();
 
 		HTTP_CODE parse_request_line(char* text);
 		HTTP_CODE parse_headers(char* text);
-		HTTP_CODE parse_content(char* text);
+		HTTP_CODE parse_content();
+		HTTP_CODE parse_chunked();
+		HTTP_CODE begin_body();
+		HTTP_CODE route_body();
+		HTTP_CODE end_body();
+		HTTP_CODE splice_body();
+		void release_sink();
 		HTTP_CODE do_request();
+		HTTP_CODE serve_file();
+		HTTP_CODE call_handler(const route_handler* handler, const char* rest);
+		HTTP_CODE take_body(body_sink* sink, int status);
+		void log_url();
+		void log_response(HTTP_CODE ret, int first_segment, long long begin, long long parsed, long long served,
+		            long long queued);
+		void push_log(long long sent);
+		void check_conditions(const file_entry* file);
+		int parse_ranges(const file_entry* file, const char* value);
 		char* get_line() { return http_read_buf + http_start_line; }
 		LINE_STATUS parse_line();
 
-		void unmap();
+		void release_files();
+		bool take_table();
+		bool add_segment(const char* data, size_t len, int fd, off_t offset);
+		bool add_file_response();
+		bool add_range_response(file_entry* file, const char* linger, size_t linger_len);
+		bool add_metrics_response();
+		bool add_stream_response();
+		bool stream_more();
+		int response_status(HTTP_CODE ret) const;
+		bool send_segments();
 		bool add_response(const char* format, ...);
-		bool add_content(const char* content);
-		bool add_status_line(int status, const char* title);
-		bool add_headers(int content_length);
-		bool add_content_length(int content_length);
-		bool add_linger();
-		bool add_blank_line();
+		bool add_bytes(const char* data, int len);
 
 	public:
-		static int http_epollfd;
-		static int http_user_count;
+		//builds the fixed responses, once before the first connection
+		static bool init_responses();
+
+		static SEND_MODE http_send_mode;
+		static file_cache* http_file_cache;
+		static router* http_router;     //built before the first loop opens, read-only after
+		static std::atomic< const char* > http_doc_root;   //swapped on reload, old roots are never freed
+
+		//set before the first loop opens
+		static int http_read_block_size;
+		static int http_write_block_size;
+		static int http_max_header_size;
+		static size_t max_input_buffered() { return http_max_header_size + http_read_block_size; }
+		static long long http_max_body;
+
+		//timeout bookkeeping, only touched by the owning event loop thread
+		enum TIMER_PHASE { TIMER_IDLE, TIMER_HEADER, TIMER_BODY, TIMER_WRITE };
+		wheel_node http_timer;
+		TIMER_PHASE http_timer_phase;
+		long http_deadline;
+
+		//readiness bookkeeping of the epoll backend: edges that came in while a
+		//worker owned the connection, how the worker's inline write ended, and
+		//whether it read the socket itself, leaving no edge for what follows
+		bool http_busy;
+		int http_events;
+		int http_flushed;
+		bool http_read_direct;
+
+		long long http_queued_ns;   //when the loop handed the connection to a worker, kept for the access log
 
 	private:
+		event_loop* http_loop;
 		int http_sockfd;
 		sockaddr_in http_address;
 
-		char http_read_buf[READ_BUFFER_SIZE];
+		//blocks come from the event loop's pools while a request is in flight,
+		//an idle keep-alive connection holds none. the parser works on the
+		//first block of the read chain, indices below are relative to it
+		chain_buffer http_read_chain;
+		chain_buffer http_write_chain;
+		char* http_read_buf;
 		int http_read_idx;
 		int http_checked_idx;
 		int http_start_line;
-		char http_write_buf[WRITE_BUFFER_SIZE];
-		int http_write_idx;
+		int http_request_begin;
 
 		CHECK_STATE http_check_state;
 		METHOD http_method;
 
-		char http_real_file[FILENAME_LEN];
 		char* http_url;
 		char* http_version;
 		char* http_host;
-		int http_content_length;
+		char* http_if_none_match;
+		char* http_if_modified_since;
+		char* http_range;
+		char* http_if_range;
+		int http_accept_encoding;   //bit per ENCODING the client takes
+		long long http_content_length;  //body bytes still to come, of the current chunk when chunked
+		bool http_chunked;
+		CHUNK_STATE http_chunk_state;
+		long long http_body_size;   //chunked bytes announced so far
+		bool http_expect_continue;
+		body_sink* http_sink;       //NULL while the body is skipped
 		bool http_keep_alive;
+		HTTP_CODE http_request_code;//answer decided at the end of the headers of a request with a body
+
+		file_entry* http_file;//cached fd, stat and mapping of the requested file
+		//what the conditional and range headers asked for, decided in do_request()
+		bool http_not_modified;
+		int http_range_count;       //0 for the whole file, -1 when no range is satisfiable
+		byte_range http_ranges[ MAX_RANGES ];
+
+		//responses queued for pipelined requests, sent in order by one batched writev.
+		//the table is taken with the first response and given back once they are sent
+		block_pool* http_table_pool;
+		response_table* http_table;
+		int http_segment_count;
+		int http_segment_idx;
+		int http_file_count;
+		bool http_linger;
+		bool http_cached_only;      //a step_cached() pass, nothing may block
+		STEP http_step;             //run by the next process(), set by the coroutine backend
+		HTTP_CODE http_step_result;
+		long long http_begin_ns;    //when the coroutine backend's parse of the request, or its step, began
+		body_source* http_source;   //a streamed response still being produced
+		bool http_stream_keep_alive;
+
+		//access log records of the queued responses, pushed once they are sent.
+		//the url is taken when the request is routed, its header may be gone by the answer
+		access_record* http_log_records;    //MAX_PIPELINE of them, allocated on the first logged request
+		int http_log_count;
+		bool http_log_named;
 
-		char* http_file_address;
-		struct stat http_file_stat;//描述文件属性
-		struct iovec http_iv[2];
-		//I/O vector，与readv和wirtev操作相关的结构体。
-		//readv和writev函数用于在一次函数调用中读、写多个非连续缓冲区。
-		//有时也将这两个函数称为散布读（scatter read）和聚集写（gather write）
-		int http_iv_count;
+		//complete immutable responses indexed by HTTP_CODE and keep-alive, sent by reference
+		struct prebuilt_response
+		{
+			char* data;
+			int len;
+		};
+		static prebuilt_response http_prebuilt[ SERVICE_UNAVAILABLE + 1 ][ 2 ];
 	};
 }
 #endif
@@ -0,0 +1,178 @@
+/*
+	http_scan.cpp
+	vectorized CR/LF scanner with runtime dispatch and header name classification
+*/
+
+#include <string.h>
+#include <strings.h>
+#include "http_scan.h"
+
+#if defined( __x86_64__ ) || defined( __i386__ )
+#include <immintrin.h>
+#define HTTP_SCAN_X86 1
+#endif
+
+namespace mj{
+	const char* find_line_end_scalar( const char* begin, const char* end )
+	{
+		for ( ; begin < end; ++begin )
+		{
+		    if ( *begin == '\r' || *begin == '\n' )
+		    {
+		        break;
+		    }
+		}
+		return begin;
+	}
+
+#ifdef HTTP_SCAN_X86
+	__attribute__(( target( "sse4.2" ) ))
+	const char* find_line_end_sse42( const char* begin, const char* end )
+	{
+		const __m128i crlf = _mm_setr_epi8( '\r', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 );
+		while ( end - begin >= 16 )
+		{
+		    __m128i chunk = _mm_loadu_si128( ( const __m128i* )begin );
+		    int idx = _mm_cmpestri( crlf, 2, chunk, 16,
+		            _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT );
+		    if ( idx != 16 )
+		    {
+		        return begin + idx;
+		    }
+		    begin += 16;
+		}
+		return find_line_end_scalar( begin, end );
+	}
+
+	__attribute__(( target( "avx2" ) ))
+	const char* find_line_end_avx2( const char* begin, const char* end )
+	{
+		const __m256i cr = _mm256_set1_epi8( '\r' );
+		const __m256i lf = _mm256_set1_epi8( '\n' );
+		while ( end - begin >= 32 )
+		{
+		    __m256i chunk = _mm256_loadu_si256( ( const __m256i* )begin );
+		    __m256i hit = _mm256_or_si256( _mm256_cmpeq_epi8( chunk, cr ), _mm256_cmpeq_epi8( chunk, lf ) );
+		    unsigned int mask = ( unsigned int )_mm256_movemask_epi8( hit );
+		    if ( mask )
+		    {
+		        return begin + __builtin_ctz( mask );
+		    }
+		    begin += 32;
+		}
+		return find_line_end_sse42( begin, end );
+	}
+
+	static line_end_func select_line_end()
+	{
+		__builtin_cpu_init();
+		if ( __builtin_cpu_supports( "avx2" ) )
+		{
+		    return find_line_end_avx2;
+		}
+		if ( __builtin_cpu_supports( "sse4.2" ) )
+		{
+		    return find_line_end_sse42;
+		}
+		return find_line_end_scalar;
+	}
+#else
+	const char* find_line_end_sse42( const char* begin, const char* end )
+	{
+		return find_line_end_scalar( begin, end );
+	}
+
+	const char* find_line_end_avx2( const char* begin, const char* end )
+	{
+		return find_line_end_scalar( begin, end );
+	}
+
+	static line_end_func select_line_end()
+	{
+		return find_line_end_scalar;
+	}
+#endif
+
+	line_end_func find_line_end = select_line_end();
+
+	const char* http_scan_level()
+	{
+		if ( find_line_end == find_line_end_avx2 )
+		{
+		    return "avx2";
+		}
+		if ( find_line_end == find_line_end_sse42 )
+		{
+		    return "sse4.2";
+		}
+		return "scalar";
+	}
+
+	HEADER_ID classify_header( const char* name, int len )
+	{
+		switch ( len )
+		{
+		    case 4:
+		        if ( ( name[0] | 0x20 ) == 'h' && strncasecmp( name, "Host", 4 ) == 0 )
+		        {
+		            return HEADER_HOST;
+		        }
+		        break;
+		    case 5:
+		        if ( ( name[0] | 0x20 ) == 'r' && strncasecmp( name, "Range", 5 ) == 0 )
+		        {
+		            return HEADER_RANGE;
+		        }
+		        break;
+		    case 6:
+		        if ( ( name[0] | 0x20 ) == 'e' && strncasecmp( name, "Expect", 6 ) == 0 )
+		        {
+		            return HEADER_EXPECT;
+		        }
+		        break;
+		    case 8:
+		        if ( ( name[0] | 0x20 ) == 'i' && strncasecmp( name, "If-Range", 8 ) == 0 )
+		        {
+		            return HEADER_IF_RANGE;
+		        }
+		        break;
+		    case 10:
+		        if ( ( name[0] | 0x20 ) == 'c' && strncasecmp( name, "Connection", 10 ) == 0 )
+		        {
+		            return HEADER_CONNECTION;
+		        }
+		        break;
+		    case 14:
+		        if ( ( name[0] | 0x20 ) == 'c' && strncasecmp( name, "Content-Length", 14 ) == 0 )
+		        {
+		            return HEADER_CONTENT_LENGTH;
+		        }
+		        break;
+		    case 13:
+		        if ( ( name[0] | 0x20 ) == 'i' && strncasecmp( name, "If-None-Match", 13 ) == 0 )
+		        {
+		            return HEADER_IF_NONE_MATCH;
+		        }
+		        break;
+		    case 15:
+		        if ( ( name[0] | 0x20 ) == 'a' && strncasecmp( name, "Accept-Encoding", 15 ) == 0 )
+		        {
+		            return HEADER_ACCEPT_ENCODING;
+		        }
+		        break;
+		    case 17:
+		        if ( ( name[0] | 0x20 ) == 'i' && strncasecmp( name, "If-Modified-Since", 17 ) == 0 )
+		        {
+		            return HEADER_IF_MODIFIED_SINCE;
+		        }
+		        if ( ( name[0] | 0x20 ) == 't' && strncasecmp( name, "Transfer-Encoding", 17 ) == 0 )
+		        {
+		            return HEADER_TRANSFER_ENCODING;
+		        }
+		        break;
+		    default:
+		        break;
+		}
+		return HEADER_UNKNOWN;
+	}
+}
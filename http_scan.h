@@ -0,0 +1,27 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+namespace mj{
+	/*
+		request scanning helpers for http_business. find_line_end() looks for
+		the next CR or LF 16/32 bytes at a time, the widest implementation the
+		cpu supports is picked once at startup.
+	*/
+	enum HEADER_ID { HEADER_UNKNOWN, HEADER_CONNECTION, HEADER_CONTENT_LENGTH, HEADER_HOST,
+	                 HEADER_RANGE, HEADER_IF_RANGE, HEADER_IF_NONE_MATCH, HEADER_ACCEPT_ENCODING,
+	                 HEADER_IF_MODIFIED_SINCE, HEADER_EXPECT, HEADER_TRANSFER_ENCODING };
+
+	typedef const char* ( *line_end_func )( const char* begin, const char* end );
+
+	//first '\r' or '\n' in [begin, end), end if there is none
+	extern line_end_func find_line_end;
+
+	const char* find_line_end_scalar( const char* begin, const char* end );
+	const char* find_line_end_sse42( const char* begin, const char* end );
+	const char* find_line_end_avx2( const char* begin, const char* end );
+	const char* http_scan_level();
+
+	//known header names, compared case-insensitively after a switch on the length
+	HEADER_ID classify_header( const char* name, int len );
+}
+#endif
@@ -9,126 +9,380 @@
 #include <stdlib.h>
 #include <cassert>
 #include <sys/epoll.h>
+#include <signal.h>
+#include <string>
+#include <vector>
 #include "public_func.h"
 #include "locker.h"
 #include "threadpool.h"
 #include "http_business.h"
-
-#define MAX_FD 65536
-#define MAX_EVENT_NUMBER 30000
-#define POOL_THREAD_NUM 20
+#include "event_loop.h"
+#include "file_cache.h"
+#include "topology.h"
+#include "config.h"
+#include "router.h"
+#include "access_log.h"
+#include "pattern_source.h"
 
 using namespace mj;
 
-int main( int argc, char* argv[] )
+static const char* config_path = NULL;
+static std::vector< std::string > cli_settings;     //key=value, applied over the file
+static server_config running;                       //what the process was started with
+static threadpool< http_business >** pools = NULL;
+static int node_number = 1;
+static router routes;
+
+//POST and PUT store the body under upload_root
+struct upload_route
 {
-    if( argc <= 1 )
+    void operator()( const route_request& request, route_response& response ) const
     {
-        printf( "usage: %s port_number\n", basename( argv[0] ) );
-        return 1;
+        response.sink = file_sink::create( request.url, request.length, response.status );
     }
-    int port = atoi( argv[1] );
+};
 
-    addsig( SIGPIPE, SIG_IGN );
-
-    threadpool< http_business >* pool = NULL;
-    try
+//GET pattern_path/<bytes>: a generated body of that length, streamed
+struct pattern_route
+{
+    void operator()( const route_request& request, route_response& response ) const
     {
-        pool = new threadpool< http_business >(POOL_THREAD_NUM,MAX_EVENT_NUMBER);
+        char* end;
+        long long length = strtoll( request.rest, &end, 10 );
+        if( end == request.rest || length < 0 || ( *end && *end != '?' ) )
+        {
+            response.status = 400;
+            return;
+        }
+        response.source = new pattern_source( length );
     }
-    catch( ... )
+};
+
+//custom handlers go in front of the catch-all upload and file routes
+static bool build_routes( const server_config& config )
+{
+    routes.add( ROUTE_GET, config.metrics_path, router::ROUTE_METRICS );
+    if( config.pattern_path[0] )
     {
-        return 1;
+        std::string path = std::string( config.pattern_path ) + "/*";
+        routes.handle( ROUTE_GET, path.c_str(), pattern_route() );
     }
+    routes.handle( ROUTE_POST | ROUTE_PUT, "/*", upload_route() );
+    routes.add( ROUTE_GET, "/*", router::ROUTE_FILES );
+    return routes.build();
+}
 
-    http_business* users = new http_business[ MAX_FD ];
-    assert( users );
-    int user_count = 0;
-
-    int listenfd = socket( PF_INET, SOCK_STREAM, 0 );
-    assert( listenfd >= 0 );
-    struct linger tmp = { 1, 0 };
-    setsockopt( listenfd, SOL_SOCKET, SO_LINGER, &tmp, sizeof( tmp ) );
-
-    int ret = 0;
-    struct sockaddr_in address;
-    bzero( &address, sizeof( address ) );
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = htonl(INADDR_ANY);
-    address.sin_port = htons( port );
+static void usage( const char* prog )
+{
+    printf( "usage: %s [-f config_file] [-o key=value]... [-l loop_number] [-b epoll|uring|coro]\n"
+            "       [-m mmap|sendfile] [-c cache_mb] [-z compress_threads] [-q locked|lockfree]\n"
+            "       [-a target_ms:interval_ms] [-t header:body:keep_alive:write] [-L backlog]\n"
+            "       [-D defer_accept_s] [-F fastopen_qlen] [-P] [port_number]\n"
+            "settings, for -o and the config file:\n", basename( prog ) );
+    config_print_keys();
+}
 
-    ret = bind( listenfd, ( struct sockaddr* )&address, sizeof( address ) );
-    assert( ret >= 0 );
+//defaults, then the config file, then the command line
+static bool build_config( server_config& config )
+{
+    config_defaults( config );
+    bool ok = ! config_path || config_load( config, config_path );
+    for( size_t i = 0; i < cli_settings.size(); ++i )
+    {
+        std::string key = cli_settings[i].substr( 0, cli_settings[i].find( '=' ) );
+        const char* value = cli_settings[i].c_str() + key.size() + ( key.size() < cli_settings[i].size() );
+        char message[ 256 ];
+        if( ! config_set( config, key.c_str(), value, message, sizeof( message ) ) )
+        {
+            printf( "%s\n", message );
+            ok = false;
+        }
+    }
+    return ok;
+}
 
-    ret = listen( listenfd, 5 );
-    assert( ret >= 0 );
+static bool add_setting( const char* key, const char* value )
+{
+    cli_settings.push_back( std::string( key ) + "=" + value );
+    return true;
+}
 
-    epoll_event events[ MAX_EVENT_NUMBER ];
-    int epollfd_main = epoll_create( 5 );
-    assert( epollfd_main != -1 );
-    addfd( epollfd_main, listenfd, false );
-    http_business::http_epollfd = epollfd_main;
+//the settings a running server picks up, at startup and on every SIGHUP
+static void apply_runtime( const server_config& config )
+{
+    conn_timeouts& t = event_loop::loop_timeouts;
+    t.header = config.header_timeout;
+    t.body = config.body_timeout;
+    t.keep_alive = config.keep_alive_timeout;
+    t.write = config.write_timeout;
+    if( strcmp( http_business::http_doc_root.load(), config.doc_root ) != 0 )
+    {
+        //requests in flight may still hold the old root, it is left allocated
+        http_business::http_doc_root.store( strdup( config.doc_root ) );
+    }
+    const char* upload_root = file_sink::upload_root.load();
+    if( config.upload_root[0] ? ! upload_root || strcmp( upload_root, config.upload_root ) != 0 : upload_root != NULL )
+    {
+        file_sink::upload_root.store( config.upload_root[0] ? strdup( config.upload_root ) : NULL );
+    }
+    http_business::http_file_cache->set_ttl( config.cache_ttl );
+    for( int n = 0; n < node_number; ++n )
+    {
+        pools[n]->set_admission( config.admission_target, config.admission_interval );
+    }
+    access_log::set_sample( config.access_log_sample );
+}
 
+static void* reloader( void* arg )
+{
+    sigset_t set;
+    sigemptyset( &set );
+    sigaddset( &set, SIGHUP );
     while( true )
     {
-        int number = epoll_wait( epollfd_main, events, MAX_EVENT_NUMBER, -1 );
-        if ( ( number < 0 ) && ( errno != EINTR ) )
+        int sig;
+        if( sigwait( &set, &sig ) != 0 )
         {
-            printf( "epoll failure\n" );
-            break;
+            continue;
         }
+        server_config config;
+        if( ! build_config( config ) )
+        {
+            printf( "reload failed, the running settings are kept\n" );
+            continue;
+        }
+        char names[ 512 ];
+        if( config_structural_changes( running, config, names, sizeof( names ) ) )
+        {
+            printf( "not reloadable, kept until a restart: %s\n", names );
+        }
+        apply_runtime( config );
+        //the file may have been moved away by an external rotation
+        access_log::reopen();
+        printf( "settings reloaded\n" );
+    }
+    return NULL;
+}
 
-        for ( int i = 0; i < number; i++ )
+int main( int argc, char* argv[] )
+{
+    int opt;
+    bool ok = true;
+    while( ( opt = getopt( argc, argv, "f:o:l:b:m:c:z:q:a:t:L:D:F:P" ) ) != -1 )
+    {
+        switch( opt )
         {
-            int sockfd = events[i].data.fd;
-            if( sockfd == listenfd )
-            {
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof( client_address );
-                int connfd = accept( listenfd, ( struct sockaddr* )&client_address, &client_addrlength );
-                if ( connfd < 0 )
-                {
-                    printf( "errno is: %d\n", errno );
-                    continue;
-                }
-                if( http_business::http_user_count >= MAX_FD )
-                {
-                    send_error( connfd, "Internal server busy" );
-                    continue;
-                }
-                
-                users[connfd].init( connfd, client_address );
-            }
-            else if( events[i].events & ( EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
+            case 'f':
+                config_path = optarg;
+                break;
+            case 'o':
+                cli_settings.push_back( optarg );
+                break;
+            case 'l':
+                add_setting( "loops", optarg );
+                break;
+            case 'b':
+                add_setting( "backend", optarg );
+                break;
+            case 'm':
+                add_setting( "send_mode", optarg );
+                break;
+            case 'c':
+                add_setting( "cache_mb", optarg );
+                break;
+            case 'z':
+                add_setting( "compress_threads", optarg );
+                break;
+            case 'q':
+                add_setting( "queue_mode", optarg );
+                break;
+            case 'a':
             {
-                users[sockfd].close_conn();
+                char target[ 32 ], interval[ 32 ];
+                ok = ok && sscanf( optarg, "%31[^:]:%31s", target, interval ) == 2 &&
+                        add_setting( "admission_target", target ) && add_setting( "admission_interval", interval );
+                break;
             }
-            else if( events[i].events & EPOLLIN )
+            case 't':
             {
-                if( users[sockfd].read() )
-                {
-                    pool->append( users + sockfd );
-                }
-                else
-                {
-                    users[sockfd].close_conn();
-                }
+                char header[ 32 ], body[ 32 ], keep_alive[ 32 ], write[ 32 ];
+                ok = ok && sscanf( optarg, "%31[^:]:%31[^:]:%31[^:]:%31s", header, body, keep_alive, write ) == 4 &&
+                        add_setting( "header_timeout", header ) && add_setting( "body_timeout", body ) &&
+                        add_setting( "keep_alive_timeout", keep_alive ) && add_setting( "write_timeout", write );
+                break;
             }
-            else if( events[i].events & EPOLLOUT )
-            {
-                if( !users[sockfd].write() )
-                {
-                    users[sockfd].close_conn();
-                }
-            }
-            else
-            {}
+            case 'L':
+                add_setting( "backlog", optarg );
+                break;
+            case 'D':
+                add_setting( "defer_accept", optarg );
+                break;
+            case 'F':
+                add_setting( "fastopen", optarg );
+                break;
+            case 'P':
+                add_setting( "pin_threads", "yes" );
+                break;
+            default:
+                ok = false;
+                break;
+        }
+    }
+    if( optind < argc )
+    {
+        add_setting( "port", argv[optind] );
+    }
+    if( ! ok || ! build_config( running ) || running.port == 0 )
+    {
+        usage( argv[0] );
+        return 1;
+    }
+    const server_config& config = running;
+
+    //every thread inherits the mask, only the reloader takes SIGHUP
+    sigset_t hup;
+    sigemptyset( &hup );
+    sigaddset( &hup, SIGHUP );
+    pthread_sigmask( SIG_BLOCK, &hup, NULL );
+
+    event_loop::BACKEND backend = ( event_loop::BACKEND )config.backend;
+#ifndef HTTP_CORO
+    if( backend == event_loop::BACKEND_CORO )
+    {
+        printf( "coroutine backend not built in (make CORO=1), falling back to epoll\n" );
+        backend = event_loop::BACKEND_EPOLL;
+    }
+#endif
+    http_business::http_send_mode = ( http_business::SEND_MODE )config.send_mode;
+    if( ! build_routes( config ) )
+    {
+        printf( "conflicting routes\n" );
+        return 1;
+    }
+    http_business::http_router = &routes;
+    http_business::http_read_block_size = config.read_block;
+    http_business::http_write_block_size = config.write_block;
+    http_business::http_max_header_size = config.max_header;
+    http_business::http_max_body = ( long long )config.max_body_mb << 20;
+    event_loop::loop_listen.backlog = config.backlog;
+    event_loop::loop_listen.defer_accept = config.defer_accept;
+    event_loop::loop_listen.fastopen = config.fastopen;
+    int loop_number = config.loops;
+    int port = config.port;
+    bool pin_threads = config.pin_threads;
+
+    addsig( SIGPIPE, SIG_IGN );
+    if( ! http_business::init_responses() )
+    {
+        return 1;
+    }
+
+    http_business::http_file_cache = new file_cache( ( size_t )config.cache_mb << 20,
+            config.cache_mb ? config.cache_entries : 0, config.cache_ttl,
+            http_business::http_send_mode == http_business::SEND_MMAP );
+    if( ! http_business::http_file_cache->start_compressors( config.compress_threads ) )
+    {
+        return 1;
+    }
+    if( config.access_log[0] && ! access_log::start( config.access_log, config.access_log_ring,
+            config.access_log_rotate_mb, config.access_log_keep ) )
+    {
+        return 1;
+    }
+
+    cpu_topology topology;
+    if( pin_threads && ! topology.detect() )
+    {
+        printf( "cpu topology unavailable, threads are not pinned\n" );
+        pin_threads = false;
+    }
+
+    //a worker pool per node, its loops hand connections only to it
+    node_number = pin_threads ? topology.node_number() : 1;
+    pools = new threadpool< http_business >*[ node_number ];
+    for( int n = 0; n < node_number; ++n )
+    {
+        int threads = config.worker_threads / node_number > 0 ? config.worker_threads / node_number : 1;
+        if( pin_threads )
+        {
+            topology.pin_self( topology.node_cpus( n ) );
+        }
+        try
+        {
+            pools[n] = new threadpool< http_business >( threads, config.queue_size,
+                    ( threadpool< http_business >::QUEUE_MODE )config.queue_mode, HISTOGRAM_QUEUE_WAIT );
+        }
+        catch( ... )
+        {
+            return 1;
         }
     }
+    apply_runtime( config );
 
-    close( epollfd_main );
-    close( listenfd );
-    delete [] users;
-    delete pool;
+    event_loop** loops = new event_loop*[ loop_number ];
+    for( int i = 0; i < loop_number; ++i )
+    {
+        threadpool< http_business >* pool = pools[ pin_threads ? topology.loop_node( i ) : 0 ];
+        if( pin_threads )
+        {
+            topology.pin_self( std::vector< int >( 1, topology.loop_cpu( i ) ) );
+        }
+        loops[i] = event_loop::create( backend, port, pool, config.max_fd, config.max_events );
+        bool opened = loops[i]->open();
+        if( ! opened && backend == event_loop::BACKEND_URING )
+        {
+            //kernel without io_uring or with it disabled
+            printf( "io_uring unavailable, errno is: %d, falling back to epoll\n", errno );
+            backend = event_loop::BACKEND_EPOLL;
+            delete loops[i];
+            loops[i] = event_loop::create( backend, port, pool, config.max_fd, config.max_events );
+            opened = loops[i]->open();
+        }
+        if( ! opened )
+        {
+            printf( "listen on port %d failed, errno is: %d\n", port, errno );
+            return 1;
+        }
+        if( i > 0 && ! loops[i]->start() )
+        {
+            printf( "create the %dth event loop failed\n", i );
+            return 1;
+        }
+    }
+    if( pin_threads )
+    {
+        topology.pin_self( std::vector< int >( 1, topology.loop_cpu( 0 ) ) );
+        if( loop_number > 1 && ! loops[0]->attach_steering( topology.loop_map( loop_number ) ) )
+        {
+            printf( "reuseport cpu steering unavailable, errno is: %d\n", errno );
+        }
+    }
+    pthread_t reload_thread;
+    if( pthread_create( &reload_thread, NULL, reloader, NULL ) == 0 )
+    {
+        if( pin_threads )
+        {
+            //it inherited loop 0's cpu, a reload must not run on top of that loop
+            cpu_topology::pin( reload_thread, topology.all_cpus() );
+        }
+        pthread_detach( reload_thread );
+    }
+    loops[0]->run();
+
+    for( int i = 1; i < loop_number; ++i )
+    {
+        loops[i]->join();
+    }
+    for( int i = 0; i < loop_number; ++i )
+    {
+        delete loops[i];
+    }
+    delete [] loops;
+    for( int n = 0; n < node_number; ++n )
+    {
+        delete pools[n];
+    }
+    delete [] pools;
+    delete http_business::http_file_cache;
     return 0;
 }
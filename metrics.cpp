@@ -0,0 +1,162 @@
+/*
+	metrics.cpp
+	per-thread counters and histograms, summed into Prometheus text on read
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "metrics.h"
+
+namespace mj{
+	const int metrics::STATUS_CODES[ metrics::STATUS_NUMBER ] = { 200, 201, 206, 304, 400, 403,
+	                                                              404, 405, 413, 414, 416, 431, 500, 501, 503 };
+	thread_local metrics::slot* metrics::metrics_local = NULL;
+	std::atomic< metrics::slot* > metrics::metrics_slots( NULL );
+
+	metrics::slot* metrics::attach()
+	{
+		//own cache lines, so no two threads write next to each other
+		void* memory = NULL;
+		if ( posix_memalign( &memory, 64, sizeof( slot ) ) != 0 )
+		{
+		    abort();
+		}
+		memset( memory, 0, sizeof( slot ) );
+		slot* s = new( memory ) slot;
+		s->next = metrics_slots.load();
+		while ( ! metrics_slots.compare_exchange_weak( s->next, s ) )
+		{
+		}
+		metrics_local = s;
+		return s;
+	}
+
+	void metrics::count_status( int status )
+	{
+		int i = 0;
+		while ( i < STATUS_NUMBER && STATUS_CODES[i] != status )
+		{
+		    i++;
+		}
+		bump( local()->statuses[i], 1UL );
+	}
+
+	void metrics::observe( METRIC_HISTOGRAM which, long long ns )
+	{
+		if ( which == HISTOGRAM_NONE )
+		{
+		    return;
+		}
+		unsigned long long us = ns > 0 ? ( ns + 999 ) / 1000 : 0;
+		int bucket = us <= 1 ? 0 : 64 - __builtin_clzll( us - 1 );
+		if ( bucket >= BUCKET_NUMBER )
+		{
+		    bucket = BUCKET_NUMBER - 1;
+		}
+		histogram& h = local()->histograms[ which ];
+		bump( h.buckets[ bucket ], 1UL );
+		bump( h.sum_ns, ( unsigned long long )( ns > 0 ? ns : 0 ) );
+	}
+
+	int metrics::render( char* buf, size_t len )
+	{
+		static const struct
+		{
+			const char* name;
+			const char* help;
+		} counters[ COUNTER_NUMBER ] = {
+			{ "http_connections_accepted_total", "Connections accepted." },
+			{ "http_connections_refused_total", "Connections closed right after accept, the fd table was full." },
+			{ "http_connections_closed_total", "Connections closed." },
+			{ "http_received_bytes_total", "Bytes read from clients." },
+			{ "http_sent_bytes_total", "Bytes written to clients." },
+			{ "http_shed_requests_total", "Requests answered with 503 instead of being queued." },
+			{ "http_accept_pauses_total", "Times a loop stopped accepting because the workers were overloaded." },
+			{ "http_access_log_dropped_total", "Access log records dropped because a ring was full." },
+			{ "http_streamed_bytes_total", "Response body bytes produced by body sources." },
+		};
+		static const struct
+		{
+			const char* name;
+			const char* help;
+		} histograms[ HISTOGRAM_NUMBER ] = {
+			{ "http_parse_seconds", "Time spent parsing a request." },
+			{ "http_queue_wait_seconds", "Time a connection waited in the worker queue." },
+			{ "http_service_seconds", "Time from the start of parsing to the response being queued." },
+		};
+
+		unsigned long counter_sum[ COUNTER_NUMBER ] = { 0 };
+		unsigned long status_sum[ STATUS_NUMBER + 1 ] = { 0 };
+		unsigned long bucket_sum[ HISTOGRAM_NUMBER ][ BUCKET_NUMBER ];
+		unsigned long long ns_sum[ HISTOGRAM_NUMBER ] = { 0 };
+		memset( bucket_sum, 0, sizeof( bucket_sum ) );
+		for ( slot* s = metrics_slots.load(); s; s = s->next )
+		{
+		    for ( int i = 0; i < COUNTER_NUMBER; ++i )
+		    {
+		        counter_sum[i] += s->counters[i].load( std::memory_order_relaxed );
+		    }
+		    for ( int i = 0; i <= STATUS_NUMBER; ++i )
+		    {
+		        status_sum[i] += s->statuses[i].load( std::memory_order_relaxed );
+		    }
+		    for ( int h = 0; h < HISTOGRAM_NUMBER; ++h )
+		    {
+		        for ( int i = 0; i < BUCKET_NUMBER; ++i )
+		        {
+		            bucket_sum[h][i] += s->histograms[h].buckets[i].load( std::memory_order_relaxed );
+		        }
+		        ns_sum[h] += s->histograms[h].sum_ns.load( std::memory_order_relaxed );
+		    }
+		}
+
+		size_t pos = 0;
+#define METRICS_PRINT( ... ) \
+		do \
+		{ \
+		    int n = snprintf( buf + pos, len - pos, __VA_ARGS__ ); \
+		    if ( n < 0 || ( size_t )n >= len - pos ) \
+		    { \
+		        return -1; \
+		    } \
+		    pos += n; \
+		} while ( 0 )
+
+		for ( int i = 0; i < COUNTER_NUMBER; ++i )
+		{
+		    METRICS_PRINT( "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", counters[i].name, counters[i].help,
+		            counters[i].name, counters[i].name, counter_sum[i] );
+		}
+		//a close may be summed before the accept it follows, never report less than none
+		unsigned long active = counter_sum[ COUNTER_ACCEPTS ] > counter_sum[ COUNTER_CLOSES ]
+		        ? counter_sum[ COUNTER_ACCEPTS ] - counter_sum[ COUNTER_CLOSES ] : 0;
+		METRICS_PRINT( "# HELP http_connections_active Connections open now.\n"
+		        "# TYPE http_connections_active gauge\nhttp_connections_active %lu\n", active );
+
+		METRICS_PRINT( "# HELP http_responses_total Responses by status code.\n# TYPE http_responses_total counter\n" );
+		for ( int i = 0; i < STATUS_NUMBER; ++i )
+		{
+		    METRICS_PRINT( "http_responses_total{code=\"%d\"} %lu\n", STATUS_CODES[i], status_sum[i] );
+		}
+		METRICS_PRINT( "http_responses_total{code=\"other\"} %lu\n", status_sum[ STATUS_NUMBER ] );
+
+		for ( int h = 0; h < HISTOGRAM_NUMBER; ++h )
+		{
+		    const char* name = histograms[h].name;
+		    METRICS_PRINT( "# HELP %s %s\n# TYPE %s histogram\n", name, histograms[h].help, name );
+		    unsigned long cumulative = 0;
+		    for ( int i = 0; i < BUCKET_NUMBER - 1; ++i )
+		    {
+		        cumulative += bucket_sum[h][i];
+		        METRICS_PRINT( "%s_bucket{le=\"%g\"} %lu\n", name, ( double )( 1UL << i ) / 1e6, cumulative );
+		    }
+		    cumulative += bucket_sum[h][ BUCKET_NUMBER - 1 ];
+		    METRICS_PRINT( "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.9f\n%s_count %lu\n",
+		            name, cumulative, name, ns_sum[h] / 1e9, name, cumulative );
+		}
+#undef METRICS_PRINT
+		return pos;
+	}
+}
@@ -0,0 +1,80 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <time.h>
+#include <atomic>
+
+namespace mj{
+	enum METRIC_COUNTER { COUNTER_ACCEPTS, COUNTER_REFUSED, COUNTER_CLOSES, COUNTER_BYTES_IN,
+	                      COUNTER_BYTES_OUT, COUNTER_SHED, COUNTER_ACCEPT_PAUSES, COUNTER_LOG_DROPPED,
+	                      COUNTER_BYTES_STREAMED, COUNTER_NUMBER };
+	enum METRIC_HISTOGRAM { HISTOGRAM_PARSE, HISTOGRAM_QUEUE_WAIT, HISTOGRAM_SERVICE, HISTOGRAM_NUMBER,
+	                        HISTOGRAM_NONE = HISTOGRAM_NUMBER };
+
+	/*
+		counters and latency histograms kept per thread. every thread writes
+		only its own slot, with plain loads and stores, so the request path
+		shares no cache line with anyone; render() adds the slots up when
+		/metrics is read. slots outlive their threads, totals never go back.
+	*/
+	class metrics
+	{
+	public:
+		//status codes with a series of their own, the rest are counted as "other"
+		static const int STATUS_CODES[];
+		static const int STATUS_NUMBER = 15;
+		//upper bounds 1us, 2us, 4us ... 2^(BUCKET_NUMBER-2)us, then +Inf
+		static const int BUCKET_NUMBER = 23;
+
+		static void count( METRIC_COUNTER counter, unsigned long n = 1 )
+		{
+			bump( local()->counters[ counter ], n );
+		}
+		static void count_status( int status );
+		static void observe( METRIC_HISTOGRAM histogram, long long ns );
+
+		static long long now_ns()
+		{
+			struct timespec ts;
+			clock_gettime( CLOCK_MONOTONIC, &ts );
+			return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+		}
+
+		//Prometheus text format, the length written or -1 when len is too small
+		static int render( char* buf, size_t len );
+
+	private:
+		struct histogram
+		{
+			std::atomic< unsigned long > buckets[ BUCKET_NUMBER ];
+			std::atomic< unsigned long long > sum_ns;
+		};
+
+		//a whole number of cache lines, the tail of one thread's slot never shares a line with another's
+		struct alignas( 64 ) slot
+		{
+			std::atomic< unsigned long > counters[ COUNTER_NUMBER ];
+			std::atomic< unsigned long > statuses[ STATUS_NUMBER + 1 ];
+			histogram histograms[ HISTOGRAM_NUMBER ];
+			slot* next;
+		};
+
+		//single writer: no locked instruction, the reader only needs an untorn value
+		template< typename V >
+		static void bump( std::atomic< V >& value, V n )
+		{
+			value.store( value.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+		}
+
+		static slot* local()
+		{
+			return metrics_local ? metrics_local : attach();
+		}
+		static slot* attach();
+
+		static thread_local slot* metrics_local;
+		static std::atomic< slot* > metrics_slots;
+	};
+}
+#endif
@@ -0,0 +1,191 @@
+#ifndef MPMC_QUEUE_H
+#define MPMC_QUEUE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <atomic>
+
+namespace mj{
+	/*
+		bounded lock-free multi-producer multi-consumer ring (D. Vyukov).
+		every cell carries a sequence number telling producers and consumers
+		whose turn it is, so a push or pop is one CAS on the shared position.
+	*/
+	template< typename T >
+	class mpmc_queue
+	{
+	public:
+		explicit mpmc_queue( size_t capacity );
+		~mpmc_queue();
+		bool push( const T& data );
+		bool pop( T& data );
+		size_t size() const;
+
+	private:
+		struct cell
+		{
+			std::atomic< size_t > sequence;
+			T data;
+		};
+
+		cell* queue_buffer;
+		size_t queue_mask;
+		alignas( 64 ) std::atomic< size_t > queue_enqueue_pos;
+		alignas( 64 ) std::atomic< size_t > queue_dequeue_pos;
+	};
+
+	template< typename T >
+	mpmc_queue< T >::mpmc_queue( size_t capacity ) : queue_buffer( NULL ), queue_mask( 0 )
+	{
+		size_t size = 2;
+		while ( size < capacity )
+		{
+		    size <<= 1;
+		}
+		queue_buffer = new cell[ size ];
+		queue_mask = size - 1;
+		for ( size_t i = 0; i < size; ++i )
+		{
+		    queue_buffer[i].sequence.store( i, std::memory_order_relaxed );
+		}
+		queue_enqueue_pos.store( 0, std::memory_order_relaxed );
+		queue_dequeue_pos.store( 0, std::memory_order_relaxed );
+	}
+
+	template< typename T >
+	mpmc_queue< T >::~mpmc_queue()
+	{
+		delete [] queue_buffer;
+	}
+
+	template< typename T >
+	bool mpmc_queue< T >::push( const T& data )
+	{
+		cell* c;
+		size_t pos = queue_enqueue_pos.load( std::memory_order_relaxed );
+		while ( true )
+		{
+		    c = &queue_buffer[ pos & queue_mask ];
+		    size_t seq = c->sequence.load( std::memory_order_acquire );
+		    intptr_t dif = ( intptr_t )seq - ( intptr_t )pos;
+		    if ( dif == 0 )
+		    {
+		        if ( queue_enqueue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+		        {
+		            break;
+		        }
+		    }
+		    else if ( dif < 0 )
+		    {
+		        return false;
+		    }
+		    else
+		    {
+		        pos = queue_enqueue_pos.load( std::memory_order_relaxed );
+		    }
+		}
+		c->data = data;
+		c->sequence.store( pos + 1, std::memory_order_release );
+		return true;
+	}
+
+	template< typename T >
+	bool mpmc_queue< T >::pop( T& data )
+	{
+		cell* c;
+		size_t pos = queue_dequeue_pos.load( std::memory_order_relaxed );
+		while ( true )
+		{
+		    c = &queue_buffer[ pos & queue_mask ];
+		    size_t seq = c->sequence.load( std::memory_order_acquire );
+		    intptr_t dif = ( intptr_t )seq - ( intptr_t )( pos + 1 );
+		    if ( dif == 0 )
+		    {
+		        if ( queue_dequeue_pos.compare_exchange_weak( pos, pos + 1, std::memory_order_relaxed ) )
+		        {
+		            break;
+		        }
+		    }
+		    else if ( dif < 0 )
+		    {
+		        return false;
+		    }
+		    else
+		    {
+		        pos = queue_dequeue_pos.load( std::memory_order_relaxed );
+		    }
+		}
+		data = c->data;
+		c->sequence.store( pos + queue_mask + 1, std::memory_order_release );
+		return true;
+	}
+
+	template< typename T >
+	size_t mpmc_queue< T >::size() const
+	{
+		size_t tail = queue_enqueue_pos.load( std::memory_order_relaxed );
+		size_t head = queue_dequeue_pos.load( std::memory_order_relaxed );
+		return tail > head ? tail - head : 0;
+	}
+
+	/*
+		futex based event count: idle consumers sleep on it after spinning,
+		producers only pay for a FUTEX_WAKE when somebody is really asleep.
+	*/
+	class event_count
+	{
+	public:
+		event_count()
+		{
+		    ev_seq.store( 0 );
+		    ev_waiters.store( 0 );
+		}
+		int prepare_wait()
+		{
+		    ev_waiters.fetch_add( 1 );
+		    return ev_seq.load();
+		}
+		void cancel_wait()
+		{
+		    ev_waiters.fetch_sub( 1 );
+		}
+		void wait( int key )
+		{
+		    syscall( SYS_futex, ( int* )&ev_seq, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0 );
+		    ev_waiters.fetch_sub( 1 );
+		}
+		void notify_one()
+		{
+		    //order the producer's push before the waiter check (store-load)
+		    std::atomic_thread_fence( std::memory_order_seq_cst );
+		    if ( ev_waiters.load() > 0 )
+		    {
+		        ev_seq.fetch_add( 1 );
+		        syscall( SYS_futex, ( int* )&ev_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0 );
+		    }
+		}
+		void notify_all()
+		{
+		    ev_seq.fetch_add( 1 );
+		    syscall( SYS_futex, ( int* )&ev_seq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0 );
+		}
+
+	private:
+		std::atomic< int > ev_seq;
+		std::atomic< int > ev_waiters;
+	};
+
+	inline void cpu_relax()
+	{
+#if defined( __x86_64__ ) || defined( __i386__ )
+		__builtin_ia32_pause();
+#elif defined( __aarch64__ )
+		asm volatile( "yield" ::: "memory" );
+#endif
+	}
+}
+#endif
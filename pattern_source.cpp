@@ -0,0 +1,40 @@
+/*
+	pattern_source.cpp
+	generated response bodies of a requested length
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "pattern_source.h"
+
+namespace mj{
+	//"0000004096 " then letters, then '\n'
+	void pattern_source::format_line( long long offset, char* line )
+	{
+		int len = snprintf( line, LINE_LEN, "%010lld ", offset );
+		for ( int i = len; i < LINE_LEN - 1; ++i )
+		{
+		    line[i] = 'a' + ( offset / LINE_LEN + i ) % 26;
+		}
+		line[ LINE_LEN - 1 ] = '\n';
+	}
+
+	ssize_t pattern_source::produce( char* buf, size_t len )
+	{
+		size_t total = ( long long )len < source_left ? len : ( size_t )source_left;
+		size_t done = 0;
+		while ( done < total )
+		{
+		    char line[ LINE_LEN ];
+		    long long start = source_offset - source_offset % LINE_LEN;
+		    format_line( start, line );
+		    size_t skip = source_offset - start;
+		    size_t n = LINE_LEN - skip < total - done ? LINE_LEN - skip : total - done;
+		    memcpy( buf + done, line + skip, n );
+		    done += n;
+		    source_offset += n;
+		}
+		source_left -= total;
+		return total;
+	}
+}
@@ -0,0 +1,30 @@
+#ifndef PATTERN_SOURCE_H
+#define PATTERN_SOURCE_H
+
+#include "body_source.h"
+
+namespace mj{
+	/*
+		a generated body of a given length for load tests and for checking
+		streamed responses: LINE_LEN-byte lines, each starting with its own
+		offset in the body, so a client can tell a lost or reordered piece
+		from the bytes alone. produce() only formats memory, but it is
+		pulled a window at a time like any other source.
+	*/
+	class pattern_source : public body_source
+	{
+	public:
+		static const int LINE_LEN = 64;
+
+		explicit pattern_source( long long length ) : source_left( length ), source_offset( 0 ) {}
+		ssize_t produce( char* buf, size_t len );
+
+		//the line at offset, which is a multiple of LINE_LEN
+		static void format_line( long long offset, char* line );
+
+	private:
+		long long source_left;
+		long long source_offset;
+	};
+}
+#endif
@@ -34,6 +34,16 @@ void addfd(int epollfd, int fd, bool one_shot)
 	setnonblocking(fd);
 }
 
+//persistent edge-triggered interest in both directions, never modified again
+//fd is already non-blocking, accept4() made it so
+void addfd_rw(int epollfd, int fd)
+{
+	epoll_event event;
+	event.data.fd = fd;
+	event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
+}
+
 void removefd(int epollfd, int fd)
 {
 	epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, 0);
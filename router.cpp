@@ -0,0 +1,135 @@
+/*
+	router.cpp
+	method and path table built at startup
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "router.h"
+
+namespace mj{
+	router::router()
+	{
+	}
+
+	router::~router()
+	{
+		for ( int list = 0; list < 2; ++list )
+		{
+		    std::vector< route >& routes = list ? router_prefix : router_exact;
+		    for ( size_t i = 0; i < routes.size(); ++i )
+		    {
+		        free( routes[i].path );
+		        delete routes[i].handler;
+		    }
+		}
+	}
+
+	void router::add( int methods, const char* path, ROUTE_KIND kind )
+	{
+		add_route( methods, path, kind, NULL );
+	}
+
+	void router::add_route( int methods, const char* path, ROUTE_KIND kind, route_handler* handler )
+	{
+		route r;
+		r.len = strlen( path );
+		r.prefix = r.len > 0 && path[ r.len - 1 ] == '*';
+		if ( r.prefix )
+		{
+		    r.len--;
+		}
+		r.path = strndup( path, r.len );
+		r.methods = methods;
+		r.kind = kind;
+		r.handler = handler;
+		( r.prefix ? router_prefix : router_exact ).push_back( r );
+	}
+
+	static bool by_path( const router::route& a, const router::route& b )
+	{
+		return strcmp( a.path, b.path ) < 0;
+	}
+
+	static bool longest_first( const router::route& a, const router::route& b )
+	{
+		return a.len > b.len;
+	}
+
+	bool router::build()
+	{
+		std::stable_sort( router_exact.begin(), router_exact.end(), by_path );
+		std::stable_sort( router_prefix.begin(), router_prefix.end(), longest_first );
+		for ( int list = 0; list < 2; ++list )
+		{
+		    const std::vector< route >& routes = list ? router_prefix : router_exact;
+		    for ( size_t i = 0; i < routes.size(); ++i )
+		    {
+		        for ( size_t j = i + 1; j < routes.size() && routes[j].len == routes[i].len; ++j )
+		        {
+		            if ( strcmp( routes[i].path, routes[j].path ) == 0 && ( routes[i].methods & routes[j].methods ) )
+		            {
+		                return false;
+		            }
+		        }
+		    }
+		}
+		return true;
+	}
+
+	//memcmp order of path against the first len bytes of url, shorter first on a tie
+	static int compare( const router::route& r, const char* url, size_t len )
+	{
+		int order = memcmp( r.path, url, r.len < len ? r.len : len );
+		if ( order != 0 )
+		{
+		    return order;
+		}
+		return r.len < len ? -1 : ( r.len > len ? 1 : 0 );
+	}
+
+	const router::route* router::find( int method, const char* url, bool& other_methods ) const
+	{
+		int bit = 1 << method;
+		size_t len = strcspn( url, "?" );
+		other_methods = false;
+
+		size_t low = 0;
+		size_t high = router_exact.size();
+		while ( low < high )
+		{
+		    size_t mid = ( low + high ) / 2;
+		    if ( compare( router_exact[ mid ], url, len ) < 0 )
+		    {
+		        low = mid + 1;
+		    }
+		    else
+		    {
+		        high = mid;
+		    }
+		}
+		for ( size_t i = low; i < router_exact.size() && compare( router_exact[i], url, len ) == 0; ++i )
+		{
+		    if ( router_exact[i].methods & bit )
+		    {
+		        return &router_exact[i];
+		    }
+		    other_methods = true;
+		}
+
+		for ( size_t i = 0; i < router_prefix.size(); ++i )
+		{
+		    const route& r = router_prefix[i];
+		    if ( r.len <= len && memcmp( r.path, url, r.len ) == 0 )
+		    {
+		        if ( r.methods & bit )
+		        {
+		            return &r;
+		        }
+		        other_methods = true;
+		    }
+		}
+		return NULL;
+	}
+}
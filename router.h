@@ -0,0 +1,121 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h>
+#include <vector>
+#include "body_sink.h"
+#include "body_source.h"
+
+namespace mj{
+	//bit per http_business::METHOD
+	enum ROUTE_METHOD { ROUTE_GET = 1 << 0, ROUTE_POST = 1 << 1, ROUTE_HEAD = 1 << 2, ROUTE_PUT = 1 << 3,
+	                    ROUTE_DELETE = 1 << 4, ROUTE_ANY = 0x1ff };
+
+	struct route_request
+	{
+		int method;                 //http_business::METHOD
+		const char* url;
+		const char* rest;           //url past the matched path
+		long long length;           //body length, -1 when chunked
+	};
+
+	/*
+		a handler answers with a source for the response body, or takes the
+		request body with a sink (answered 201 once it is complete), or
+		leaves both NULL and sets an error status.
+	*/
+	struct route_response
+	{
+		body_source* source;
+		body_sink* sink;
+		int status;
+	};
+
+	/*
+		a registered function object. its call is specialized for its type:
+		invoke<F> is instantiated per handler with F's operator() inlined
+		into it, so a request costs one call through a plain function
+		pointer, no vtable load in front of it and no second call behind it.
+		the route table is built at runtime, one indirect call is as far as
+		it can be specialized.
+	*/
+	class route_handler
+	{
+	public:
+		template< typename F >
+		explicit route_handler( const F& function ) :
+			    handler_object( new F( function ) ), handler_call( invoke< F > ), handler_destroy( destroy< F > ) {}
+		~route_handler() { handler_destroy( handler_object ); }
+
+		void handle( const route_request& request, route_response& response ) const
+		{
+			handler_call( handler_object, request, response );
+		}
+
+	private:
+		template< typename F >
+		static void invoke( void* object, const route_request& request, route_response& response )
+		{
+			( *static_cast< F* >( object ) )( request, response );
+		}
+		template< typename F >
+		static void destroy( void* object ) { delete static_cast< F* >( object ); }
+
+		route_handler( const route_handler& );
+		route_handler& operator=( const route_handler& );
+
+	private:
+		void* handler_object;
+		void ( *handler_call )( void* object, const route_request& request, route_response& response );
+		void ( *handler_destroy )( void* object );
+	};
+
+	/*
+		method and path table, filled at startup and frozen by build(). a path
+		ending in '*' takes every url it is a prefix of, the longest one
+		winning, any other path only itself; the query string is not part of
+		the match. exact paths are binary searched and prefixes scanned
+		longest first in flat arrays, a lookup neither allocates nor locks.
+		files and metrics are served by http_business itself behind a
+		switch on the kind, everything else is a ROUTE_HANDLER.
+	*/
+	class router
+	{
+	public:
+		enum ROUTE_KIND { ROUTE_FILES, ROUTE_METRICS, ROUTE_HANDLER };
+
+		struct route
+		{
+			char* path;
+			size_t len;                 //without the '*'
+			bool prefix;
+			int methods;                //ROUTE_METHOD bits
+			ROUTE_KIND kind;
+			route_handler* handler;
+		};
+
+		router();
+		~router();
+
+		void add( int methods, const char* path, ROUTE_KIND kind );
+		//function is any function object callable as f( const route_request&, route_response& )
+		template< typename F >
+		void handle( int methods, const char* path, const F& function )
+		{
+			add_route( methods, path, ROUTE_HANDLER, new route_handler( function ) );
+		}
+		//false when two routes claim the same method and path
+		bool build();
+
+		//NULL when no route takes the url with this method, other_methods tells 405 from 404 then
+		const route* find( int method, const char* url, bool& other_methods ) const;
+
+	private:
+		void add_route( int methods, const char* path, ROUTE_KIND kind, route_handler* handler );
+
+	private:
+		std::vector< route > router_exact;      //by path
+		std::vector< route > router_prefix;     //longest first
+	};
+}
+#endif
@@ -0,0 +1,137 @@
+/*
+	router_test.cpp
+	checks router lookups and build() on small tables
+	usage: router_test
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "router.h"
+
+using namespace mj;
+
+//in http_business::METHOD order
+static const int GET = 0;
+static const int POST = 1;
+static const int DELETE = 4;
+
+static int failures = 0;
+
+static void expect( const char* name, bool ok )
+{
+    printf( "%-66s %s\n", name, ok ? "ok" : "FAIL" );
+    failures += ! ok;
+}
+
+//the path of the route url is sent to, "-" for none, with other_methods behind a '+' then
+static const char* lookup( const router& table, int method, const char* url )
+{
+    static char found[ 64 ];
+    bool other_methods;
+    const router::route* r = table.find( method, url, other_methods );
+    if ( ! r )
+    {
+        return other_methods ? "-+" : "-";
+    }
+    snprintf( found, sizeof( found ), "%s%s", r->path, r->prefix ? "*" : "" );
+    return found;
+}
+
+//answers with its tag plus the length of the url past the prefix as the status
+struct tag_route
+{
+    int tag;
+    void operator()( const route_request& request, route_response& response ) const
+    {
+        response.status = tag + ( int )strlen( request.rest );
+    }
+};
+
+static void check_lookup()
+{
+    router table;
+    table.add( ROUTE_GET, "/metrics", router::ROUTE_METRICS );
+    table.add( ROUTE_GET, "/*", router::ROUTE_FILES );
+    table.add( ROUTE_GET, "/api/*", router::ROUTE_HANDLER );
+    table.add( ROUTE_GET, "/api/v2/*", router::ROUTE_HANDLER );
+    table.add( ROUTE_GET | ROUTE_POST, "/api/v2/status", router::ROUTE_HANDLER );
+    table.add( ROUTE_GET, "/a", router::ROUTE_HANDLER );
+    table.add( ROUTE_GET, "/ab", router::ROUTE_HANDLER );
+    table.add( ROUTE_DELETE, "/only-delete", router::ROUTE_HANDLER );
+    expect( "build() accepts a table without conflicts", table.build() );
+
+    expect( "exact path", strcmp( lookup( table, GET, "/metrics" ), "/metrics" ) == 0 );
+    expect( "exact path ignores the query string", strcmp( lookup( table, GET, "/metrics?x=1" ), "/metrics" ) == 0 );
+    expect( "exact path is not a prefix", strcmp( lookup( table, GET, "/metricsx" ), "/*" ) == 0 );
+    expect( "exact paths sharing a prefix", strcmp( lookup( table, GET, "/a" ), "/a" ) == 0
+            && strcmp( lookup( table, GET, "/ab" ), "/ab" ) == 0 && strcmp( lookup( table, GET, "/abc" ), "/*" ) == 0 );
+    expect( "exact path wins over a longer prefix", strcmp( lookup( table, GET, "/api/v2/status" ), "/api/v2/status" ) == 0 );
+    expect( "longest prefix wins", strcmp( lookup( table, GET, "/api/v2/users" ), "/api/v2/*" ) == 0
+            && strcmp( lookup( table, GET, "/api/v1/users" ), "/api/*" ) == 0
+            && strcmp( lookup( table, GET, "/index.html" ), "/*" ) == 0 );
+    expect( "prefix is matched against the path before '?'", strcmp( lookup( table, GET, "/api?v2/x" ), "/*" ) == 0 );
+    expect( "method picks among routes of the same path", strcmp( lookup( table, POST, "/api/v2/status" ), "/api/v2/status" ) == 0 );
+    expect( "other method on an exact path gives 405", strcmp( lookup( table, POST, "/metrics" ), "-+" ) == 0 );
+    expect( "other method on a prefix gives 405", strcmp( lookup( table, POST, "/api/v1" ), "-+" ) == 0 );
+    expect( "exact path with only another method falls back to a prefix",
+            strcmp( lookup( table, GET, "/only-delete" ), "/*" ) == 0
+            && strcmp( lookup( table, DELETE, "/only-delete" ), "/only-delete" ) == 0 );
+
+    router empty;
+    expect( "empty table", empty.build() && strcmp( lookup( empty, GET, "/" ), "-" ) == 0 );
+}
+
+static void check_conflicts()
+{
+    router exact;
+    exact.add( ROUTE_GET | ROUTE_HEAD, "/x", router::ROUTE_HANDLER );
+    exact.add( ROUTE_GET, "/x", router::ROUTE_FILES );
+    expect( "build() refuses an exact path claimed twice", ! exact.build() );
+
+    router prefix;
+    prefix.add( ROUTE_GET, "/y", router::ROUTE_FILES );
+    prefix.add( ROUTE_GET, "/x/*", router::ROUTE_FILES );
+    prefix.add( ROUTE_GET, "/z/*", router::ROUTE_FILES );
+    prefix.add( ROUTE_ANY, "/x/*", router::ROUTE_HANDLER );
+    expect( "build() refuses a prefix claimed twice", ! prefix.build() );
+
+    router split;
+    split.add( ROUTE_GET, "/x/*", router::ROUTE_FILES );
+    split.add( ROUTE_POST | ROUTE_PUT, "/x/*", router::ROUTE_HANDLER );
+    split.add( ROUTE_GET, "/x", router::ROUTE_METRICS );
+    expect( "same path with other methods, or exact and prefix, is no conflict", split.build() );
+    bool other_methods;
+    const router::route* post = split.find( POST, "/x/1", other_methods );
+    expect( "  and each method finds its own", post && post->kind == router::ROUTE_HANDLER
+            && split.find( GET, "/x/1", other_methods )->kind == router::ROUTE_FILES
+            && split.find( GET, "/x", other_methods )->kind == router::ROUTE_METRICS );
+}
+
+static void check_handlers()
+{
+    router table;
+    tag_route short_tag = { 100 };
+    tag_route long_tag = { 200 };
+    table.handle( ROUTE_GET, "/t/*", short_tag );
+    table.handle( ROUTE_GET, "/t/long/*", long_tag );
+    expect( "function objects register", table.build() );
+
+    bool other_methods;
+    const router::route* r = table.find( GET, "/t/long/abc", other_methods );
+    route_request request = { GET, "/t/long/abc", "/t/long/abc" + ( r ? r->len : 0 ), 0 };
+    route_response response = { NULL, NULL, 0 };
+    if ( r && r->kind == router::ROUTE_HANDLER )
+    {
+        r->handler->handle( request, response );
+    }
+    expect( "handler gets the url past its prefix", response.status == 203 );
+}
+
+int main()
+{
+    check_lookup();
+    check_conflicts();
+    check_handlers();
+    printf( failures ? "%d failed\n" : "all passed\n", failures );
+    return failures ? 1 : 0;
+}
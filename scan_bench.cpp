@@ -0,0 +1,148 @@
+/*
+	scan_bench.cpp
+	micro-benchmark for the request scanner in http_scan.cpp
+	usage: scan_bench [iterations]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "http_scan.h"
+
+using namespace mj;
+
+static const char* request =
+    "GET /static/js/app.bundle.min.js?v=20240101 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Referer: https://www.example.com/index.html\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; tracking=off\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n";
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//the loop parse_line() used before http_scan: one byte per iteration
+static const char* find_line_end_bytewise( const char* begin, const char* end )
+{
+    for ( ; begin < end; ++begin )
+    {
+        char temp = *begin;
+        if ( temp == '\r' )
+        {
+            return begin;
+        }
+        else if ( temp == '\n' )
+        {
+            return begin;
+        }
+    }
+    return end;
+}
+
+static int classify_chain( const char* text )
+{
+    if ( strncasecmp( text, "Connection:", 11 ) == 0 )
+    {
+        return HEADER_CONNECTION;
+    }
+    else if ( strncasecmp( text, "Content-Length:", 15 ) == 0 )
+    {
+        return HEADER_CONTENT_LENGTH;
+    }
+    else if ( strncasecmp( text, "Host:", 5 ) == 0 )
+    {
+        return HEADER_HOST;
+    }
+    return HEADER_UNKNOWN;
+}
+
+static double bench_lines( line_end_func func, const char* buf, int len, long iterations, long* sink )
+{
+    double start = now_ns();
+    for ( long i = 0; i < iterations; ++i )
+    {
+        const char* p = buf;
+        const char* end = buf + len;
+        while ( p < end )
+        {
+            p = func( p, end );
+            *sink += p - buf;
+            p += 2;
+        }
+    }
+    return ( now_ns() - start ) / iterations;
+}
+
+static double bench_headers( bool chained, const char* buf, int len, long iterations, long* sink )
+{
+    const char* lines[ 32 ];
+    int lens[ 32 ];
+    int count = 0;
+    const char* p = strstr( buf, "\r\n" ) + 2;
+    while ( p < buf + len && *p != '\r' && count < 32 )
+    {
+        const char* colon = strchr( p, ':' );
+        lines[ count ] = p;
+        lens[ count ] = colon - p;
+        count++;
+        p = strstr( p, "\r\n" ) + 2;
+    }
+
+    double start = now_ns();
+    for ( long i = 0; i < iterations; ++i )
+    {
+        for ( int j = 0; j < count; ++j )
+        {
+            *sink += chained ? classify_chain( lines[j] ) : classify_header( lines[j], lens[j] );
+        }
+    }
+    return ( now_ns() - start ) / iterations;
+}
+
+int main( int argc, char* argv[] )
+{
+    long iterations = ( argc > 1 ) ? atol( argv[1] ) : 2000000;
+    int len = strlen( request );
+    long sink = 0;
+
+    printf( "request: %d bytes, %ld iterations, dispatch picks %s\n", len, iterations, http_scan_level() );
+
+    double base = bench_lines( find_line_end_bytewise, request, len, iterations, &sink );
+    printf( "%-22s %8.1f ns/request\n", "lines bytewise", base );
+
+    __builtin_cpu_init();
+    struct { const char* name; line_end_func func; bool supported; } impls[] = {
+        { "lines scalar", find_line_end_scalar, true },
+        { "lines sse4.2", find_line_end_sse42, __builtin_cpu_supports( "sse4.2" ) != 0 },
+        { "lines avx2", find_line_end_avx2, __builtin_cpu_supports( "avx2" ) != 0 },
+        { "lines dispatched", find_line_end, true },
+    };
+    for ( size_t i = 0; i < sizeof( impls ) / sizeof( impls[0] ); ++i )
+    {
+        if ( ! impls[i].supported )
+        {
+            printf( "%-22s not supported by this cpu\n", impls[i].name );
+            continue;
+        }
+        double t = bench_lines( impls[i].func, request, len, iterations, &sink );
+        printf( "%-22s %8.1f ns/request  %5.2fx\n", impls[i].name, t, base / t );
+    }
+
+    double chain = bench_headers( true, request, len, iterations, &sink );
+    double table = bench_headers( false, request, len, iterations, &sink );
+    printf( "%-22s %8.1f ns/request\n", "headers strncasecmp", chain );
+    printf( "%-22s %8.1f ns/request  %5.2fx\n", "headers classify", table, chain / table );
+
+    return sink == 42 ? 1 : 0;
+}
@@ -0,0 +1,463 @@
+/*
+	server_test.cpp
+	checks routes, streamed responses and recovery from overload against a running
+	http_server started with pattern_path set, upload_root the same as doc_root and
+	few enough workers and a short enough admission target to be overloaded
+	usage: server_test ipaddress port [pattern_path] [metrics_path]
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <string.h>
+#include <strings.h>
+#include <string>
+#include <vector>
+#include "pattern_source.h"
+
+using namespace mj;
+
+static const char* address = NULL;
+static int port = 0;
+static std::string pattern_path = "/pattern";
+static std::string metrics_path = "/metrics";
+
+//blocking connection with a buffered reader, every read gives up after 10s
+class connection
+{
+public:
+    explicit connection( int rcvbuf = 0 ) : conn_fd( socket( PF_INET, SOCK_STREAM, 0 ) ), conn_begin( 0 ), conn_end( 0 )
+    {
+        struct timeval timeout = { 10, 0 };
+        setsockopt( conn_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof( timeout ) );
+        if ( rcvbuf )
+        {
+            //before connect, so the window is small from the start
+            setsockopt( conn_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof( rcvbuf ) );
+        }
+        struct sockaddr_in server;
+        memset( &server, 0, sizeof( server ) );
+        server.sin_family = AF_INET;
+        inet_pton( AF_INET, address, &server.sin_addr );
+        server.sin_port = htons( port );
+        conn_ok = conn_fd >= 0 && connect( conn_fd, ( struct sockaddr* )&server, sizeof( server ) ) == 0;
+    }
+    ~connection() { close( conn_fd ); }
+
+    bool ok() const { return conn_ok; }
+    bool buffered() const { return conn_begin < conn_end; }
+    int fd() const { return conn_fd; }
+
+    //throws away what is buffered and reads once more, false at the end of the stream
+    bool skip()
+    {
+        return fill();
+    }
+
+    bool send_request( const std::string& url, bool keep_alive, const char* method = "GET", const std::string& body = "" )
+    {
+        char length[ 64 ];
+        snprintf( length, sizeof( length ), "Content-Length: %zu\r\n", body.size() );
+        std::string request = std::string( method ) + " " + url + " HTTP/1.1\r\nHost: test\r\n"
+                + ( body.empty() ? "" : length )
+                + ( keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n" ) + body;
+        return send( conn_fd, request.data(), request.size(), MSG_NOSIGNAL ) == ( ssize_t )request.size();
+    }
+
+    bool read_line( std::string& line )
+    {
+        line.clear();
+        char c;
+        while ( read_bytes( &c, 1 ) )
+        {
+            if ( c == '\n' )
+            {
+                if ( ! line.empty() && line[ line.size() - 1 ] == '\r' )
+                {
+                    line.erase( line.size() - 1 );
+                }
+                return true;
+            }
+            line += c;
+        }
+        return false;
+    }
+
+    bool read_bytes( char* out, size_t len )
+    {
+        while ( len > 0 )
+        {
+            if ( ! buffered() && ! fill() )
+            {
+                return false;
+            }
+            size_t n = conn_end - conn_begin < len ? conn_end - conn_begin : len;
+            memcpy( out, conn_buf + conn_begin, n );
+            conn_begin += n;
+            out += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    std::string read_to_end()
+    {
+        std::string body( conn_buf + conn_begin, conn_end - conn_begin );
+        conn_begin = conn_end;
+        while ( fill() )
+        {
+            body.append( conn_buf, conn_end );
+            conn_begin = conn_end;
+        }
+        return body;
+    }
+
+private:
+    bool fill()
+    {
+        ssize_t n = recv( conn_fd, conn_buf, sizeof( conn_buf ), 0 );
+        conn_begin = 0;
+        conn_end = n > 0 ? n : 0;
+        return n > 0;
+    }
+
+private:
+    int conn_fd;
+    bool conn_ok;
+    char conn_buf[ 65536 ];
+    size_t conn_begin;
+    size_t conn_end;
+};
+
+//status line and headers; the status, 0 when there is no response
+static int read_header( connection& conn, bool& chunked, long long& content_length )
+{
+    std::string line;
+    if ( ! conn.read_line( line ) || line.compare( 0, 9, "HTTP/1.1 " ) != 0 )
+    {
+        return 0;
+    }
+    int status = atoi( line.c_str() + 9 );
+    chunked = false;
+    content_length = -1;
+    while ( conn.read_line( line ) && ! line.empty() )
+    {
+        if ( strcasecmp( line.c_str(), "Transfer-Encoding: chunked" ) == 0 )
+        {
+            chunked = true;
+        }
+        else if ( strncasecmp( line.c_str(), "Content-Length:", 15 ) == 0 )
+        {
+            content_length = atoll( line.c_str() + 15 );
+        }
+    }
+    return status;
+}
+
+/*
+    decodes a chunked body and compares it with the pattern as it goes;
+    the body length, or -1 when the framing or the bytes are wrong.
+*/
+static long long read_pattern( connection& conn, long long expected )
+{
+    long long offset = 0;
+    char line[ pattern_source::LINE_LEN ];
+    char data[ 65536 ];
+    std::string size_line;
+    while ( conn.read_line( size_line ) )
+    {
+        char* end;
+        long long size = strtoll( size_line.c_str(), &end, 16 );
+        if ( end == size_line.c_str() || *end || size < 0 || size > ( long long )sizeof( data ) )
+        {
+            printf( "    bad chunk size line \"%s\"\n", size_line.c_str() );
+            return -1;
+        }
+        char crlf[2];
+        if ( size == 0 )
+        {
+            //the last chunk, no trailers
+            return conn.read_bytes( crlf, 2 ) && crlf[0] == '\r' && crlf[1] == '\n' ? offset : -1;
+        }
+        if ( ! conn.read_bytes( data, size ) || ! conn.read_bytes( crlf, 2 ) || crlf[0] != '\r' || crlf[1] != '\n' )
+        {
+            printf( "    chunk of %lld bytes cut short or not followed by CRLF\n", size );
+            return -1;
+        }
+        for ( long long i = 0; i < size; ++i, ++offset )
+        {
+            if ( offset % pattern_source::LINE_LEN == 0 )
+            {
+                pattern_source::format_line( offset, line );
+            }
+            if ( offset >= expected || data[i] != line[ offset % pattern_source::LINE_LEN ] )
+            {
+                printf( "    wrong byte at offset %lld\n", offset );
+                return -1;
+            }
+        }
+    }
+    printf( "    connection ended before the last chunk\n" );
+    return -1;
+}
+
+static std::string pattern_url( long long length )
+{
+    char url[ 64 ];
+    snprintf( url, sizeof( url ), "/%lld", length );
+    return pattern_path + url;
+}
+
+//a 200 with a chunked body of length, read up to the end of the last chunk
+static bool stream_once( connection& conn, long long length )
+{
+    bool chunked;
+    long long content_length;
+    if ( read_header( conn, chunked, content_length ) != 200 || ! chunked || content_length != -1 )
+    {
+        printf( "    not a 200 with a chunked body\n" );
+        return false;
+    }
+    long long got = read_pattern( conn, length );
+    if ( got != length )
+    {
+        if ( got >= 0 )
+        {
+            printf( "    %lld bytes instead of %lld\n", got, length );
+        }
+        return false;
+    }
+    return true;
+}
+
+//a counter from metrics_path on a connection of its own, -1 when it can't be read
+static long long counter( const char* name )
+{
+    connection conn;
+    if ( ! conn.ok() || ! conn.send_request( metrics_path, false ) )
+    {
+        return -1;
+    }
+    std::string text = conn.read_to_end();
+    std::string line = std::string( "\n" ) + name + " ";
+    size_t at = text.find( line );
+    return at == std::string::npos ? -1 : atoll( text.c_str() + at + line.size() );
+}
+
+static long long streamed_bytes()
+{
+    return counter( "http_streamed_bytes_total" );
+}
+
+static bool check_framing()
+{
+    connection conn;
+    long long lengths[] = { 100000, 1, 0, 5000 };
+    for ( size_t i = 0; i < sizeof( lengths ) / sizeof( lengths[0] ); ++i )
+    {
+        bool keep_alive = i + 1 < sizeof( lengths ) / sizeof( lengths[0] );
+        if ( ! conn.send_request( pattern_url( lengths[i] ), keep_alive ) || ! stream_once( conn, lengths[i] ) )
+        {
+            printf( "    at the %lld byte stream\n", lengths[i] );
+            return false;
+        }
+        if ( conn.buffered() )
+        {
+            printf( "    bytes after the last chunk\n" );
+            return false;
+        }
+    }
+    return conn.read_to_end().empty();
+}
+
+//a request written right behind the stream is answered once the stream is done
+static bool check_pipelined()
+{
+    connection conn;
+    return conn.send_request( pattern_url( 300000 ), true ) && conn.send_request( pattern_url( 70 ), false )
+        && stream_once( conn, 300000 ) && stream_once( conn, 70 );
+}
+
+static bool check_bad_length()
+{
+    connection conn;
+    bool chunked;
+    long long content_length;
+    return conn.send_request( pattern_path + "/12ab", false ) && read_header( conn, chunked, content_length ) == 400;
+}
+
+//the status of a request on a connection of its own, with the response body in body
+static int status_of( const char* method, const std::string& url, const std::string& sent, std::string& body )
+{
+    connection conn;
+    bool chunked;
+    long long content_length;
+    int status = conn.send_request( url, false, method, sent ) ? read_header( conn, chunked, content_length ) : 0;
+    body = conn.read_to_end();
+    return status;
+}
+
+/*
+    every route comes from build_routes: the upload handler takes the
+    body with a sink, the file route serves it back, a method no route
+    has for the path is a 405, a name the sink can't store whole is a
+    414 and the pattern handler's source streams.
+*/
+static bool check_routes()
+{
+    std::string body;
+    const std::string url = "/server_test.txt";
+    const std::string sent = "stored through the upload handler\n";
+    if ( status_of( "PUT", url, sent, body ) != 201 )
+    {
+        printf( "    PUT was not stored, is upload_root the doc_root?\n" );
+        return false;
+    }
+    if ( status_of( "GET", url, "", body ) != 200 || body != sent )
+    {
+        printf( "    GET did not give back what PUT stored\n" );
+        return false;
+    }
+    if ( status_of( "DELETE", url, "", body ) != 405 || status_of( "DELETE", pattern_url( 10 ), "", body ) != 405 )
+    {
+        printf( "    DELETE was not a 405\n" );
+        return false;
+    }
+    if ( status_of( "PUT", "/" + std::string( 4096, 'n' ), sent, body ) != 414 )
+    {
+        printf( "    a name too long to store was not a 414\n" );
+        return false;
+    }
+    connection conn;
+    return conn.send_request( pattern_url( 10 ), false, "GET" ) && stream_once( conn, 10 );
+}
+
+/*
+    a client that stops reading: once the socket buffers are full the
+    producer must stop too, far short of the body asked for, and carry
+    on from where it was when the client reads again.
+*/
+static bool check_slow_reader()
+{
+    const long long length = 256LL << 20;
+    const long long most_ahead = 32LL << 20;
+    connection conn( 65536 );
+    long long before = streamed_bytes();
+    if ( before < 0 || ! conn.send_request( pattern_url( length ), true ) )
+    {
+        printf( "    no %s, or the request failed\n", metrics_path.c_str() );
+        return false;
+    }
+    sleep( 1 );
+    long long stalled = streamed_bytes();
+    usleep( 500000 );
+    long long later = streamed_bytes();
+    printf( "    produced %lld bytes of %lld while the client did not read\n", stalled - before, length );
+    if ( stalled - before > most_ahead || later != stalled )
+    {
+        printf( "    the producer did not wait for the client (%lld then %lld)\n", stalled - before, later - before );
+        return false;
+    }
+    return stream_once( conn, length ) && conn.send_request( pattern_url( 10 ), false )
+        && stream_once( conn, 10 );
+}
+
+/*
+    more streams than the workers keep up with, read as fast as they
+    come, overload the pool until requests are shed. once the clients
+    are gone and the queue has drained the loop must accept again, the
+    next connection is served rather than left in the listen queue.
+*/
+static bool check_overload_recovers()
+{
+    const int clients = 64;
+    const long long length = 64LL << 20;
+    long long shed = counter( "http_shed_requests_total" );
+    std::vector< connection* > conns;
+    std::vector< pollfd > fds;
+    for ( int i = 0; i < clients; ++i )
+    {
+        connection* conn = new connection;
+        if ( conn->ok() && conn->send_request( pattern_url( length ), false ) )
+        {
+            pollfd p = { conn->fd(), POLLIN, 0 };
+            conns.push_back( conn );
+            fds.push_back( p );
+        }
+        else
+        {
+            delete conn;
+        }
+    }
+    for ( int round = 0; round < 200 && poll( &fds[0], fds.size(), 10 ) >= 0; ++round )
+    {
+        for ( size_t i = 0; i < fds.size(); ++i )
+        {
+            if ( fds[i].revents && ! conns[i]->skip() )
+            {
+                fds[i].fd = -1;
+            }
+        }
+    }
+    for ( size_t i = 0; i < conns.size(); ++i )
+    {
+        delete conns[i];
+    }
+    usleep( 200000 );
+
+    long long after = counter( "http_shed_requests_total" );
+    if ( after < 0 )
+    {
+        printf( "    no connection accepted after the queue drained\n" );
+        return false;
+    }
+    if ( shed < 0 || after == shed )
+    {
+        printf( "    nothing was shed, the pool never got overloaded\n" );
+        return false;
+    }
+    connection conn;
+    return conn.send_request( pattern_url( 10 ), false ) && stream_once( conn, 10 );
+}
+
+static bool run( const char* name, bool ( *test )() )
+{
+    bool ok = test();
+    printf( "%-48s %s\n", name, ok ? "ok" : "FAIL" );
+    return ok;
+}
+
+int main( int argc, char* argv[] )
+{
+    if ( argc < 3 )
+    {
+        printf( "usage: %s ipaddress port [pattern_path] [metrics_path]\n", basename( argv[0] ) );
+        return 1;
+    }
+    address = argv[1];
+    port = atoi( argv[2] );
+    if ( argc > 3 )
+    {
+        pattern_path = argv[3];
+    }
+    if ( argc > 4 )
+    {
+        metrics_path = argv[4];
+    }
+
+    int failures = 0;
+    failures += ! run( "chunked framing, keep-alive after the last chunk", check_framing );
+    failures += ! run( "request pipelined behind a stream", check_pipelined );
+    failures += ! run( "bad length answered 400", check_bad_length );
+    failures += ! run( "upload handler, file route, 405, 414", check_routes );
+    failures += ! run( "slow reader holds the producer back", check_slow_reader );
+    failures += ! run( "accepting again once an overload drains", check_overload_recovers );
+
+    printf( failures ? "%d failed\n" : "all passed\n", failures );
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <stddef.h>
+#include <atomic>
+
+namespace mj{
+	/*
+		bounded lock-free single-producer single-consumer ring. each side owns
+		one position and keeps a cached copy of the other's, so it only reads
+		the shared line again when the ring looks full (or empty). the
+		consumer works on the element in place through front() and frees it
+		with pop(). the positions are on lines of their own only when the
+		ring is: an object holding one is allocated through cache_aligned.
+	*/
+	template< typename T >
+	class spsc_queue
+	{
+	public:
+		explicit spsc_queue( size_t capacity );
+		~spsc_queue();
+
+		//producer side
+		bool push( const T& data );
+
+		//consumer side, front() is NULL while the ring is empty
+		T* front();
+		void pop();
+
+	private:
+		T* queue_buffer;
+		size_t queue_mask;
+		alignas( 64 ) std::atomic< size_t > queue_tail;
+		size_t queue_cached_head;       //the producer's view of queue_head
+		alignas( 64 ) std::atomic< size_t > queue_head;
+		size_t queue_cached_tail;       //the consumer's view of queue_tail
+	};
+
+	template< typename T >
+	spsc_queue< T >::spsc_queue( size_t capacity ) : queue_buffer( NULL ), queue_mask( 0 ),
+	        queue_cached_head( 0 ), queue_cached_tail( 0 )
+	{
+		size_t size = 2;
+		while ( size < capacity )
+		{
+		    size <<= 1;
+		}
+		queue_buffer = new T[ size ];
+		queue_mask = size - 1;
+		queue_tail.store( 0, std::memory_order_relaxed );
+		queue_head.store( 0, std::memory_order_relaxed );
+	}
+
+	template< typename T >
+	spsc_queue< T >::~spsc_queue()
+	{
+		delete [] queue_buffer;
+	}
+
+	template< typename T >
+	bool spsc_queue< T >::push( const T& data )
+	{
+		size_t tail = queue_tail.load( std::memory_order_relaxed );
+		if ( tail - queue_cached_head > queue_mask )
+		{
+		    queue_cached_head = queue_head.load( std::memory_order_acquire );
+		    if ( tail - queue_cached_head > queue_mask )
+		    {
+		        return false;
+		    }
+		}
+		queue_buffer[ tail & queue_mask ] = data;
+		queue_tail.store( tail + 1, std::memory_order_release );
+		return true;
+	}
+
+	template< typename T >
+	T* spsc_queue< T >::front()
+	{
+		size_t head = queue_head.load( std::memory_order_relaxed );
+		if ( head == queue_cached_tail )
+		{
+		    queue_cached_tail = queue_tail.load( std::memory_order_acquire );
+		    if ( head == queue_cached_tail )
+		    {
+		        return NULL;
+		    }
+		}
+		return &queue_buffer[ head & queue_mask ];
+	}
+
+	template< typename T >
+	void spsc_queue< T >::pop()
+	{
+		queue_head.store( queue_head.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+	}
+}
+#endif
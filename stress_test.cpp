@@ -1,158 +1,946 @@
 /*
 	stress_test.cpp
-	usage: filename ipaddress port TCP-connection-number
+	load generator for http_server, reports throughput and latency percentiles
+	usage: stress_test [options] ipaddress port
+	    -t threads          worker threads (1)
+	    -c connections      connections per thread (10)
+	    -d seconds          measured duration (10)
+	    -w seconds          warm-up before measuring (0)
+	    -u url[:weight],... request mix, e.g. /index.html:9,/big.bin:1 (/index.html)
+	    -k 0|1              keep-alive, a new connection per request when 0 (1)
+	    -p depth            pipelined requests in flight per connection (1)
+	    -r rate             open loop at rate requests/s over all threads,
+	                        latency counts from the scheduled send time (closed loop)
+	    -T seconds          request timeout (10)
+	    -o text|json        report format (text)
 */
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <assert.h>
 #include <unistd.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
 
-static const char* request = "GET http://localhost/index.html HTTP/1.1\r\nConnection: keep-alive\r\n\r\nxxxxxxxxxxxx";
+static const int MAX_DEPTH = 64;
+static const int READ_CHUNK = 65536;
+static const int MAX_RESPONSE_HEADER = 16384;
 
-int setnonblocking( int fd )
+static long long now_ns()
 {
-    int old_option = fcntl( fd, F_GETFL );
-    int new_option = old_option | O_NONBLOCK;
-    fcntl( fd, F_SETFL, new_option );
-    return old_option;
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
-void addfd( int epoll_fd, int fd )
+/*
+    log-linear histogram in the style of HdrHistogram: every power of two is
+    split into SUB_BUCKETS/2 linear buckets, so a recorded value is off by
+    less than 1/64 of itself at any magnitude, in a fixed 30KB table.
+*/
+class histogram
 {
-    epoll_event event;
-    event.data.fd = fd;
-    event.events = EPOLLOUT | EPOLLET | EPOLLERR;
-    epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fd, &event );
-    setnonblocking( fd );
+public:
+    static const int SUB_BUCKETS = 128;
+    static const int BUCKETS = SUB_BUCKETS + 57 * ( SUB_BUCKETS / 2 );
+
+    histogram() { reset(); }
+
+    void reset()
+    {
+        memset( hist_counts, 0, sizeof( hist_counts ) );
+        hist_total = 0;
+        hist_sum = 0;
+        hist_min = 0;
+        hist_max = 0;
+    }
+
+    void record( long long value )
+    {
+        if ( value < 0 )
+        {
+            value = 0;
+        }
+        hist_counts[ index( value ) ]++;
+        if ( hist_total == 0 || value < hist_min )
+        {
+            hist_min = value;
+        }
+        if ( value > hist_max )
+        {
+            hist_max = value;
+        }
+        hist_total++;
+        hist_sum += value;
+    }
+
+    void merge( const histogram& other )
+    {
+        for ( int i = 0; i < BUCKETS; ++i )
+        {
+            hist_counts[i] += other.hist_counts[i];
+        }
+        if ( other.hist_total && ( hist_total == 0 || other.hist_min < hist_min ) )
+        {
+            hist_min = other.hist_min;
+        }
+        if ( other.hist_max > hist_max )
+        {
+            hist_max = other.hist_max;
+        }
+        hist_total += other.hist_total;
+        hist_sum += other.hist_sum;
+    }
+
+    //highest value of the bucket holding the given quantile
+    long long percentile( double p ) const
+    {
+        if ( hist_total == 0 )
+        {
+            return 0;
+        }
+        long long rank = ( long long )( p / 100.0 * hist_total + 0.5 );
+        if ( rank < 1 )
+        {
+            rank = 1;
+        }
+        long long seen = 0;
+        for ( int i = 0; i < BUCKETS; ++i )
+        {
+            seen += hist_counts[i];
+            if ( seen >= rank )
+            {
+                long long high = upper( i );
+                return high < hist_max ? high : hist_max;
+            }
+        }
+        return hist_max;
+    }
+
+    long long count() const { return hist_total; }
+    long long min() const { return hist_min; }
+    long long max() const { return hist_max; }
+    double mean() const { return hist_total ? ( double )hist_sum / hist_total : 0; }
+
+private:
+    static int index( long long value )
+    {
+        if ( value < SUB_BUCKETS )
+        {
+            return ( int )value;
+        }
+        int shift = 63 - __builtin_clzll( value ) - 6;
+        return SUB_BUCKETS + ( shift - 1 ) * ( SUB_BUCKETS / 2 ) + ( int )( value >> shift ) - SUB_BUCKETS / 2;
+    }
+
+    static long long upper( int idx )
+    {
+        if ( idx < SUB_BUCKETS )
+        {
+            return idx;
+        }
+        int shift = ( idx - SUB_BUCKETS ) / ( SUB_BUCKETS / 2 ) + 1;
+        long long mantissa = ( idx - SUB_BUCKETS ) % ( SUB_BUCKETS / 2 ) + SUB_BUCKETS / 2;
+        return ( ( mantissa + 1 ) << shift ) - 1;
+    }
+
+private:
+    long long hist_counts[ BUCKETS ];
+    long long hist_total;
+    long long hist_sum;
+    long long hist_min;
+    long long hist_max;
+};
+
+struct url_entry
+{
+    std::string request;
+    int weight;
+};
+
+struct options
+{
+    const char* ip;
+    int port;
+    int threads;
+    int connections;
+    double duration;
+    double warmup;
+    bool keep_alive;
+    int depth;
+    double rate;
+    double timeout;
+    bool json;
+    std::vector< url_entry > urls;
+    int total_weight;
+};
+
+struct counters
+{
+    long long requests;
+    long long bytes;
+    long long status[ 6 ];      //1xx .. 5xx, [0] for anything else
+    long long connects;         //handshakes completed
+    long long connect_errors;
+    long long read_errors;
+    long long write_errors;
+    long long timeouts;
+    long long parse_errors;
+};
+
+struct client_conn
+{
+    int fd;
+    bool connected;
+    bool want_out;                      //EPOLLOUT is in the registered interest
+    long long started[ MAX_DEPTH ];     //send (or scheduled) time of every request in flight
+    int head;
+    int outstanding;
+    std::string out;
+    size_t out_off;
+
+    std::string in;
+    bool in_body;
+    long long body_left;
+    int status;
+    bool server_close;
+};
+
+struct worker
+{
+    pthread_t thread;
+    int index;
+    const options* opts;
+    int epollfd;
+    int timerfd;                        //open loop: fires at next_due
+    unsigned long long rng;
+    std::vector< client_conn > conns;
+    std::deque< long long > backlog;    //open loop: scheduled sends no connection could take yet
+    long long next_due;
+    long long interval;
+    histogram hist;
+    counters count;
+};
+
+static options opts;
+static std::atomic< bool > measuring( false );
+static std::atomic< bool > stopping( false );
+
+static unsigned long long next_random( unsigned long long& state )
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
 }
 
-bool write_nbytes( int sockfd, const char* buffer, int len )
+static const std::string& pick_request( worker& w )
 {
-    int bytes_write = 0;
-    fprintf(stderr, "write out %d bytes to socket %d\n", len, sockfd );
-    while( 1 ) 
-    {   
-        bytes_write = send( sockfd, buffer, len, 0 );
-        if ( bytes_write == -1 )
-        {   
-            return false;
-        }   
-        else if ( bytes_write == 0 ) 
-        {   
-            return false;
-        }   
+    if ( opts.urls.size() == 1 )
+    {
+        return opts.urls[0].request;
+    }
+    int r = next_random( w.rng ) % opts.total_weight;
+    for ( size_t i = 0; i < opts.urls.size(); ++i )
+    {
+        r -= opts.urls[i].weight;
+        if ( r < 0 )
+        {
+            return opts.urls[i].request;
+        }
+    }
+    return opts.urls.back().request;
+}
 
-        len -= bytes_write;
-        buffer = buffer + bytes_write;
-        if ( len <= 0 ) 
-        {   
-            return true;
-        }   
-    }   
+static void update_events( worker& w, client_conn& c )
+{
+    bool want_out = ! c.connected || c.out_off < c.out.size();
+    if ( want_out == c.want_out )
+    {
+        return;
+    }
+    epoll_event event;
+    event.data.ptr = &c;
+    event.events = EPOLLIN | EPOLLRDHUP | ( want_out ? EPOLLOUT : 0 );
+    epoll_ctl( w.epollfd, EPOLL_CTL_MOD, c.fd, &event );
+    c.want_out = want_out;
 }
 
-bool read_once( int sockfd, char* buffer, int len )
+static void arm_timer( worker& w )
 {
-    int bytes_read = 0;
-    memset( buffer, '\0', len );
-    bytes_read = recv( sockfd, buffer, len, 0 );
-    if ( bytes_read == -1 )
+    struct itimerspec spec;
+    memset( &spec, 0, sizeof( spec ) );
+    spec.it_value.tv_sec = w.next_due / 1000000000LL;
+    spec.it_value.tv_nsec = w.next_due % 1000000000LL;
+    timerfd_settime( w.timerfd, TFD_TIMER_ABSTIME, &spec, NULL );
+}
+
+static bool open_conn( worker& w, client_conn& c )
+{
+    c.fd = socket( PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0 );
+    c.connected = false;
+    c.want_out = true;
+    c.head = 0;
+    c.outstanding = 0;
+    c.out.clear();
+    c.out_off = 0;
+    c.in.clear();
+    c.in_body = false;
+    c.body_left = 0;
+    c.status = 0;
+    c.server_close = false;
+    if ( c.fd < 0 )
     {
         return false;
     }
-    else if ( bytes_read == 0 )
+    int on = 1;
+    setsockopt( c.fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof( on ) );
+
+    struct sockaddr_in address;
+    memset( &address, 0, sizeof( address ) );
+    address.sin_family = AF_INET;
+    inet_pton( AF_INET, opts.ip, &address.sin_addr );
+    address.sin_port = htons( opts.port );
+    if ( connect( c.fd, ( struct sockaddr* )&address, sizeof( address ) ) < 0 && errno != EINPROGRESS )
     {
+        close( c.fd );
+        c.fd = -1;
         return false;
     }
-	fprintf(stderr, "read in %d bytes from socket %d\n", bytes_read, sockfd );
 
+    epoll_event event;
+    event.data.ptr = &c;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+    epoll_ctl( w.epollfd, EPOLL_CTL_ADD, c.fd, &event );
     return true;
 }
 
-void start_conn( int epoll_fd, int num, const char* ip, int port )
+static void close_conn( worker& w, client_conn& c )
 {
-    int ret = 0;
-    struct sockaddr_in address;
-    bzero( &address, sizeof( address ) );
-    address.sin_family = AF_INET;
-    inet_pton( AF_INET, ip, &address.sin_addr );
-    address.sin_port = htons( port );
+    if ( c.fd >= 0 )
+    {
+        epoll_ctl( w.epollfd, EPOLL_CTL_DEL, c.fd, 0 );
+        close( c.fd );
+        c.fd = -1;
+    }
+}
 
-    for ( int i = 0; i < num; ++i )
+//queue one request, stamped with the time it should have gone out
+static void queue_request( worker& w, client_conn& c, long long started )
+{
+    const std::string& request = pick_request( w );
+    if ( c.out_off == c.out.size() )
     {
-        //sleep( 1 );
-        int sockfd = socket( PF_INET, SOCK_STREAM, 0 );
-        fprintf(stderr, "create 1 sock\n" );
-        if( sockfd < 0 )
+        c.out.clear();
+        c.out_off = 0;
+    }
+    c.out.append( request );
+    c.started[ ( c.head + c.outstanding ) % MAX_DEPTH ] = started;
+    c.outstanding++;
+}
+
+static bool flush_conn( worker& w, client_conn& c )
+{
+    while ( c.out_off < c.out.size() )
+    {
+        ssize_t sent = send( c.fd, c.out.data() + c.out_off, c.out.size() - c.out_off, MSG_NOSIGNAL );
+        if ( sent < 0 )
         {
-            continue;
+            if ( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                break;
+            }
+            return false;
         }
+        c.out_off += sent;
+    }
+    update_events( w, c );
+    return true;
+}
 
-        if (  connect( sockfd, ( struct sockaddr* )&address, sizeof( address ) ) == 0  )
+static int conn_capacity( const client_conn& c )
+{
+    if ( c.fd < 0 || c.server_close )
+    {
+        return 0;
+    }
+    return ( opts.keep_alive ? opts.depth : 1 ) - c.outstanding;
+}
+
+//closed loop: keep every connection at its pipelining depth
+static void refill( worker& w, client_conn& c )
+{
+    if ( stopping.load( std::memory_order_relaxed ) )
+    {
+        return;
+    }
+    if ( opts.rate > 0 )
+    {
+        while ( ! w.backlog.empty() && conn_capacity( c ) > 0 )
         {
-            fprintf(stderr, "build connection %d\n", i );
-            addfd( epoll_fd, sockfd );
+            queue_request( w, c, w.backlog.front() );
+            w.backlog.pop_front();
         }
+        return;
+    }
+    int room = conn_capacity( c );
+    for ( int i = 0; i < room; ++i )
+    {
+        queue_request( w, c, now_ns() );
     }
 }
 
-void close_conn( int epoll_fd, int sockfd )
+static void reconnect( worker& w, client_conn& c )
 {
-    epoll_ctl( epoll_fd, EPOLL_CTL_DEL, sockfd, 0 );
-    close( sockfd );
+    close_conn( w, c );
+    if ( stopping.load( std::memory_order_relaxed ) )
+    {
+        return;
+    }
+    if ( ! open_conn( w, c ) )
+    {
+        if ( measuring.load( std::memory_order_relaxed ) )
+        {
+            w.count.connect_errors++;
+        }
+        return;
+    }
+    refill( w, c );
 }
 
-int main( int argc, char* argv[] )
+//requests still in flight on a dropped connection count as errors
+static void drop_conn( worker& w, client_conn& c, long long& counter )
+{
+    if ( measuring.load( std::memory_order_relaxed ) )
+    {
+        counter += c.outstanding > 0 ? c.outstanding : 1;
+    }
+    reconnect( w, c );
+}
+
+static void complete_response( worker& w, client_conn& c )
 {
-    assert( argc == 4 );
-    int epoll_fd = epoll_create( 10000 );
-    start_conn( epoll_fd, atoi( argv[ 3 ] ), argv[1], atoi( argv[2] ) );
-    epoll_event events[ 10000 ];
-    char buffer[ 2048 ];
-    while ( 1 )
-    {
-        int fds = epoll_wait( epoll_fd, events, 10000, 2000 );
-        for ( int i = 0; i < fds; i++ )
-        {   
-            int sockfd = events[i].data.fd;
-            if ( events[i].events & EPOLLIN )
-            {   
-                if ( ! read_once( sockfd, buffer, 2048 ) )
+    long long latency = now_ns() - c.started[ c.head ];
+    c.head = ( c.head + 1 ) % MAX_DEPTH;
+    c.outstanding--;
+    if ( measuring.load( std::memory_order_relaxed ) )
+    {
+        w.hist.record( latency );
+        w.count.requests++;
+        int klass = c.status / 100;
+        w.count.status[ ( klass >= 1 && klass <= 5 ) ? klass : 0 ]++;
+    }
+}
+
+static bool header_value( const char* header, const char* end, const char* name, std::string& value )
+{
+    size_t len = strlen( name );
+    for ( const char* line = header; line < end; )
+    {
+        const char* eol = ( const char* )memchr( line, '\n', end - line );
+        if ( ! eol )
+        {
+            eol = end;
+        }
+        if ( ( size_t )( eol - line ) > len && strncasecmp( line, name, len ) == 0 && line[ len ] == ':' )
+        {
+            const char* v = line + len + 1;
+            while ( v < eol && ( *v == ' ' || *v == '\t' ) )
+            {
+                ++v;
+            }
+            const char* v_end = eol;
+            while ( v_end > v && ( v_end[ -1 ] == '\r' || v_end[ -1 ] == ' ' ) )
+            {
+                --v_end;
+            }
+            value.assign( v, v_end - v );
+            return true;
+        }
+        line = eol + 1;
+    }
+    return false;
+}
+
+/*
+    walk the bytes received so far: response headers are parsed once they
+    are complete, bodies are counted and dropped. returns false on garbage.
+*/
+static bool parse_responses( worker& w, client_conn& c )
+{
+    size_t pos = 0;
+    while ( pos < c.in.size() )
+    {
+        if ( c.in_body )
+        {
+            long long take = c.in.size() - pos;
+            if ( take > c.body_left )
+            {
+                take = c.body_left;
+            }
+            pos += take;
+            c.body_left -= take;
+            if ( c.body_left > 0 )
+            {
+                break;
+            }
+        }
+        else
+        {
+            size_t end = c.in.find( "\r\n\r\n", pos );
+            if ( end == std::string::npos )
+            {
+                if ( c.in.size() - pos > ( size_t )MAX_RESPONSE_HEADER )
                 {
-                	fprintf(stderr, "close connection-read\n");
-                    close_conn( epoll_fd, sockfd );
+                    return false;
                 }
-                struct epoll_event event;
-                event.events = EPOLLOUT | EPOLLET | EPOLLERR;
-                event.data.fd = sockfd;
-                epoll_ctl( epoll_fd, EPOLL_CTL_MOD, sockfd, &event );
+                break;
+            }
+            const char* header = c.in.data() + pos;
+            if ( c.outstanding == 0 || strncmp( header, "HTTP/1.", 7 ) != 0 )
+            {
+                return false;
+            }
+            c.status = atoi( header + 9 );
+            c.body_left = 0;
+            std::string value;
+            if ( header_value( header, c.in.data() + end, "Content-Length", value ) )
+            {
+                c.body_left = atoll( value.c_str() );
+            }
+            if ( header_value( header, c.in.data() + end, "Connection", value ) && strcasecmp( value.c_str(), "close" ) == 0 )
+            {
+                c.server_close = true;
+            }
+            pos = end + 4;
+            if ( c.body_left > 0 )
+            {
+                c.in_body = true;
+                continue;
+            }
+        }
+        c.in_body = false;
+        complete_response( w, c );
+    }
+    c.in.erase( 0, pos );
+    return true;
+}
+
+static void handle_read( worker& w, client_conn& c )
+{
+    char buffer[ READ_CHUNK ];
+    bool peer_closed = false;
+    while ( true )
+    {
+        ssize_t bytes_read = recv( c.fd, buffer, sizeof( buffer ), 0 );
+        if ( bytes_read < 0 )
+        {
+            if ( errno == EAGAIN || errno == EWOULDBLOCK )
+            {
+                break;
             }
-            else if( events[i].events & EPOLLOUT ) 
+            drop_conn( w, c, w.count.read_errors );
+            return;
+        }
+        if ( bytes_read == 0 )
+        {
+            peer_closed = true;
+            break;
+        }
+        if ( measuring.load( std::memory_order_relaxed ) )
+        {
+            w.count.bytes += bytes_read;
+        }
+        c.in.append( buffer, bytes_read );
+    }
+
+    if ( ! parse_responses( w, c ) )
+    {
+        drop_conn( w, c, w.count.parse_errors );
+        return;
+    }
+    if ( peer_closed )
+    {
+        if ( c.outstanding > 0 )
+        {
+            drop_conn( w, c, w.count.read_errors );
+        }
+        else
+        {
+            reconnect( w, c );
+        }
+        return;
+    }
+    if ( c.server_close || ! opts.keep_alive )
+    {
+        if ( c.outstanding == 0 )
+        {
+            reconnect( w, c );
+        }
+        return;
+    }
+    refill( w, c );
+    if ( ! flush_conn( w, c ) )
+    {
+        drop_conn( w, c, w.count.write_errors );
+    }
+}
+
+static void handle_write( worker& w, client_conn& c )
+{
+    if ( ! c.connected )
+    {
+        int error = 0;
+        socklen_t len = sizeof( error );
+        getsockopt( c.fd, SOL_SOCKET, SO_ERROR, &error, &len );
+        if ( error != 0 )
+        {
+            close_conn( w, c );
+            if ( measuring.load( std::memory_order_relaxed ) )
             {
-                if ( ! write_nbytes( sockfd, request, strlen( request ) ) )
+                w.count.connect_errors++;
+            }
+            reconnect( w, c );
+            return;
+        }
+        c.connected = true;
+        if ( measuring.load( std::memory_order_relaxed ) )
+        {
+            w.count.connects++;
+        }
+    }
+    if ( ! flush_conn( w, c ) )
+    {
+        drop_conn( w, c, w.count.write_errors );
+    }
+}
+
+//open loop: hand every request that is due to a connection with room, or keep it waiting
+static void schedule( worker& w, long long now )
+{
+    while ( w.next_due <= now )
+    {
+        w.backlog.push_back( w.next_due );
+        w.next_due += w.interval;
+    }
+    for ( size_t i = 0; i < w.conns.size() && ! w.backlog.empty(); ++i )
+    {
+        client_conn& c = w.conns[i];
+        if ( conn_capacity( c ) <= 0 )
+        {
+            continue;
+        }
+        refill( w, c );
+        if ( c.connected && ! flush_conn( w, c ) )
+        {
+            drop_conn( w, c, w.count.write_errors );
+        }
+    }
+}
+
+static void check_timeouts( worker& w, long long now )
+{
+    long long limit = ( long long )( opts.timeout * 1e9 );
+    for ( size_t i = 0; i < w.conns.size(); ++i )
+    {
+        client_conn& c = w.conns[i];
+        if ( c.fd >= 0 && c.outstanding > 0 && now - c.started[ c.head ] > limit )
+        {
+            drop_conn( w, c, w.count.timeouts );
+        }
+    }
+}
+
+static void* run_worker( void* arg )
+{
+    worker& w = *( worker* )arg;
+    w.epollfd = epoll_create( opts.connections + 1 );
+    w.conns.resize( opts.connections );
+    for ( int i = 0; i < opts.connections; ++i )
+    {
+        w.conns[i].fd = -1;
+        reconnect( w, w.conns[i] );
+    }
+    if ( opts.rate > 0 )
+    {
+        w.interval = ( long long )( 1e9 * opts.threads / opts.rate );
+        //spread the threads' schedules over one interval
+        w.next_due = now_ns() + w.interval * w.index / opts.threads;
+        //epoll_wait only counts milliseconds, the timer keeps sends on schedule
+        w.timerfd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK );
+        epoll_event event;
+        event.data.ptr = NULL;
+        event.events = EPOLLIN;
+        epoll_ctl( w.epollfd, EPOLL_CTL_ADD, w.timerfd, &event );
+        arm_timer( w );
+    }
+
+    std::vector< epoll_event > events( opts.connections + 1 );
+    long long last_check = now_ns();
+    while ( ! stopping.load( std::memory_order_relaxed ) )
+    {
+        int number = epoll_wait( w.epollfd, events.data(), events.size(), 100 );
+        for ( int i = 0; i < number; ++i )
+        {
+            if ( ! events[i].data.ptr )
+            {
+                unsigned long long expirations;
+                ssize_t ignored = read( w.timerfd, &expirations, sizeof( expirations ) );
+                ( void )ignored;
+                continue;
+            }
+            client_conn& c = *( client_conn* )events[i].data.ptr;
+            if ( c.fd < 0 )
+            {
+                continue;
+            }
+            if ( events[i].events & ( EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR ) )
+            {
+                if ( ! c.connected && ( events[i].events & ( EPOLLHUP | EPOLLERR ) ) )
                 {
-                	fprintf(stderr, "close connection-write\n");
-                    close_conn( epoll_fd, sockfd );
+                    handle_write( w, c );
+                    continue;
                 }
-                struct epoll_event event;
-                event.events = EPOLLIN | EPOLLET | EPOLLERR;
-                event.data.fd = sockfd;
-                epoll_ctl( epoll_fd, EPOLL_CTL_MOD, sockfd, &event );
+                handle_read( w, c );
             }
-            else if( events[i].events & EPOLLERR )
+            else if ( events[i].events & EPOLLOUT )
             {
-            	fprintf(stderr, "close connection-err\n");
-                close_conn( epoll_fd, sockfd );
+                handle_write( w, c );
             }
         }
+
+        long long now = now_ns();
+        if ( opts.rate > 0 && w.next_due <= now )
+        {
+            schedule( w, now );
+            arm_timer( w );
+        }
+        if ( now - last_check > 100000000LL )
+        {
+            check_timeouts( w, now );
+            last_check = now;
+        }
+    }
+
+    for ( size_t i = 0; i < w.conns.size(); ++i )
+    {
+        close_conn( w, w.conns[i] );
+    }
+    if ( opts.rate > 0 )
+    {
+        close( w.timerfd );
+    }
+    close( w.epollfd );
+    return NULL;
+}
+
+static bool parse_urls( const char* list )
+{
+    opts.urls.clear();
+    opts.total_weight = 0;
+    std::string all( list );
+    size_t start = 0;
+    while ( start <= all.size() )
+    {
+        size_t comma = all.find( ',', start );
+        std::string item = all.substr( start, comma == std::string::npos ? std::string::npos : comma - start );
+        start = ( comma == std::string::npos ) ? all.size() + 1 : comma + 1;
+        if ( item.empty() )
+        {
+            continue;
+        }
+        url_entry entry;
+        entry.weight = 1;
+        size_t colon = item.rfind( ':' );
+        if ( colon != std::string::npos && colon > 0 && item.find_first_not_of( "0123456789", colon + 1 ) == std::string::npos )
+        {
+            entry.weight = atoi( item.c_str() + colon + 1 );
+            item.erase( colon );
+        }
+        if ( item[0] != '/' || entry.weight <= 0 )
+        {
+            return false;
+        }
+        entry.request = "GET " + item + " HTTP/1.1\r\nHost: " + opts.ip + "\r\nConnection: "
+                        + ( opts.keep_alive ? "keep-alive" : "close" ) + "\r\n\r\n";
+        opts.urls.push_back( entry );
+        opts.total_weight += entry.weight;
     }
+    return ! opts.urls.empty();
+}
+
+static void usage( const char* name )
+{
+    fprintf( stderr, "usage: %s [-t threads] [-c connections] [-d seconds] [-w seconds] "
+             "[-u url[:weight],...] [-k 0|1] [-p depth] [-r rate] [-T seconds] [-o text|json] "
+             "ipaddress port\n", name );
 }
 
+static void report( const histogram& hist, const counters& total, double elapsed )
+{
+    long long errors = total.connect_errors + total.read_errors + total.write_errors
+                       + total.timeouts + total.parse_errors;
+    double rps = total.requests / elapsed;
+    double mbps = total.bytes / elapsed / ( 1024 * 1024 );
+    const double us = 1000.0;
+
+    if ( opts.json )
+    {
+        printf( "{\n" );
+        printf( "  \"threads\": %d,\n", opts.threads );
+        printf( "  \"connections\": %d,\n", opts.threads * opts.connections );
+        printf( "  \"keep_alive\": %s,\n", opts.keep_alive ? "true" : "false" );
+        printf( "  \"pipeline_depth\": %d,\n", opts.depth );
+        printf( "  \"mode\": \"%s\",\n", opts.rate > 0 ? "open" : "closed" );
+        printf( "  \"target_rate\": %.1f,\n", opts.rate );
+        printf( "  \"duration_s\": %.3f,\n", elapsed );
+        printf( "  \"requests\": %lld,\n", total.requests );
+        printf( "  \"throughput_rps\": %.1f,\n", rps );
+        printf( "  \"connects\": %lld,\n", total.connects );
+        printf( "  \"connect_rate\": %.1f,\n", total.connects / elapsed );
+        printf( "  \"transfer_mib_s\": %.2f,\n", mbps );
+        printf( "  \"status\": { \"1xx\": %lld, \"2xx\": %lld, \"3xx\": %lld, \"4xx\": %lld, \"5xx\": %lld, \"other\": %lld },\n",
+                total.status[1], total.status[2], total.status[3], total.status[4], total.status[5], total.status[0] );
+        printf( "  \"errors\": { \"connect\": %lld, \"read\": %lld, \"write\": %lld, \"timeout\": %lld, \"parse\": %lld },\n",
+                total.connect_errors, total.read_errors, total.write_errors, total.timeouts, total.parse_errors );
+        printf( "  \"latency_us\": { \"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f }\n",
+                hist.min() / us, hist.mean() / us, hist.percentile( 50 ) / us, hist.percentile( 90 ) / us,
+                hist.percentile( 99 ) / us, hist.percentile( 99.9 ) / us, hist.max() / us );
+        printf( "}\n" );
+        return;
+    }
+
+    printf( "%d threads, %d connections, keep-alive %s, depth %d, %s loop",
+            opts.threads, opts.threads * opts.connections, opts.keep_alive ? "on" : "off",
+            opts.depth, opts.rate > 0 ? "open" : "closed" );
+    if ( opts.rate > 0 )
+    {
+        printf( " at %.0f req/s", opts.rate );
+    }
+    printf( ", %.2fs\n", elapsed );
+    printf( "requests    %lld (2xx %lld, 3xx %lld, 4xx %lld, 5xx %lld, other %lld)\n",
+            total.requests, total.status[2], total.status[3], total.status[4], total.status[5],
+            total.status[0] + total.status[1] );
+    printf( "errors      %lld (connect %lld, read %lld, write %lld, timeout %lld, parse %lld)\n",
+            errors, total.connect_errors, total.read_errors, total.write_errors, total.timeouts, total.parse_errors );
+    printf( "throughput  %.1f req/s, %.2f MiB/s\n", rps, mbps );
+    printf( "connects    %lld, %.1f/s\n", total.connects, total.connects / elapsed );
+    printf( "latency us  min %.1f  mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+            hist.min() / us, hist.mean() / us, hist.percentile( 50 ) / us, hist.percentile( 90 ) / us,
+            hist.percentile( 99 ) / us, hist.percentile( 99.9 ) / us, hist.max() / us );
+}
+
+int main( int argc, char* argv[] )
+{
+    opts.threads = 1;
+    opts.connections = 10;
+    opts.duration = 10;
+    opts.warmup = 0;
+    opts.keep_alive = true;
+    opts.depth = 1;
+    opts.rate = 0;
+    opts.timeout = 10;
+    opts.json = false;
+    const char* url_list = "/index.html";
+
+    int opt;
+    while ( ( opt = getopt( argc, argv, "t:c:d:w:u:k:p:r:T:o:" ) ) != -1 )
+    {
+        switch ( opt )
+        {
+            case 't': opts.threads = atoi( optarg ); break;
+            case 'c': opts.connections = atoi( optarg ); break;
+            case 'd': opts.duration = atof( optarg ); break;
+            case 'w': opts.warmup = atof( optarg ); break;
+            case 'u': url_list = optarg; break;
+            case 'k': opts.keep_alive = atoi( optarg ) != 0; break;
+            case 'p': opts.depth = atoi( optarg ); break;
+            case 'r': opts.rate = atof( optarg ); break;
+            case 'T': opts.timeout = atof( optarg ); break;
+            case 'o': opts.json = strcmp( optarg, "json" ) == 0; break;
+            default: usage( argv[0] ); return 1;
+        }
+    }
+    if ( argc - optind != 2 || opts.threads < 1 || opts.connections < 1 || opts.duration <= 0
+         || opts.depth < 1 || opts.depth > MAX_DEPTH )
+    {
+        usage( argv[0] );
+        return 1;
+    }
+    opts.ip = argv[ optind ];
+    opts.port = atoi( argv[ optind + 1 ] );
+    if ( ! opts.keep_alive )
+    {
+        opts.depth = 1;
+    }
+    if ( ! parse_urls( url_list ) )
+    {
+        fprintf( stderr, "bad url list: %s\n", url_list );
+        return 1;
+    }
+
+    std::vector< worker > workers( opts.threads );
+    for ( int i = 0; i < opts.threads; ++i )
+    {
+        worker& w = workers[i];
+        w.index = i;
+        w.opts = &opts;
+        w.rng = 0x9e3779b97f4a7c15ULL * ( i + 1 );
+        memset( &w.count, 0, sizeof( w.count ) );
+        if ( pthread_create( &w.thread, NULL, run_worker, &w ) != 0 )
+        {
+            fprintf( stderr, "can't start thread %d\n", i );
+            return 1;
+        }
+    }
+
+    if ( opts.warmup > 0 )
+    {
+        usleep( ( useconds_t )( opts.warmup * 1e6 ) );
+    }
+    long long begin = now_ns();
+    measuring.store( true );
+    usleep( ( useconds_t )( opts.duration * 1e6 ) );
+    measuring.store( false );
+    double elapsed = ( now_ns() - begin ) / 1e9;
+    stopping.store( true );
+
+    histogram total_hist;
+    counters total;
+    memset( &total, 0, sizeof( total ) );
+    for ( int i = 0; i < opts.threads; ++i )
+    {
+        worker& w = workers[i];
+        pthread_join( w.thread, NULL );
+        total_hist.merge( w.hist );
+        total.requests += w.count.requests;
+        total.bytes += w.count.bytes;
+        for ( int k = 0; k < 6; ++k )
+        {
+            total.status[k] += w.count.status[k];
+        }
+        total.connects += w.count.connects;
+        total.connect_errors += w.count.connect_errors;
+        total.read_errors += w.count.read_errors;
+        total.write_errors += w.count.write_errors;
+        total.timeouts += w.count.timeouts;
+        total.parse_errors += w.count.parse_errors;
+    }
+
+    report( total_hist, total, elapsed );
+    return 0;
+}
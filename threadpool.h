@@ -2,37 +2,90 @@
 #define THREADPOOL_H
 
 #include <list>
+#include <cmath>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
 #include "locker.h"
+#include "mpmc_queue.h"
+#include "cache_aligned.h"
+#include "metrics.h"
 namespace mj{
 	template< typename T >
-	class threadpool
+	class threadpool : public cache_aligned
 	{
 	public:
-		threadpool( int thread_num, int max_reqs);
+		//QUEUE_LOCKED is the original std::list + mutex + semaphore queue
+		enum QUEUE_MODE { QUEUE_LOCKED, QUEUE_LOCKFREE };
+		static const int SPIN_TIMES = 200;
+
+		//wait_metric gets the time each request spent queued
+		threadpool( int thread_num, int max_reqs, QUEUE_MODE mode = QUEUE_LOCKFREE,
+		            METRIC_HISTOGRAM wait_metric = HISTOGRAM_NONE );
 		~threadpool();
 		bool append( T* request );
+		int queue_size() const { return max_requests; }
+		int thread_count() const { return thread_number; }
+
+		/*
+			admission control after CoDel: once the queue wait of dequeued
+			requests has stayed above target for a whole interval the pool is
+			overloaded, and admit() turns away one request per interval /
+			sqrt( n ) until the wait drops under target again or the queue
+			runs empty. 0 disables it.
+		*/
+		void set_admission( int target_ms, int interval_ms );
+		//false when this request should be shed instead of appended
+		bool admit();
+		//an empty queue ends the episode, so a caller that stopped feeding the pool still sees it recover
+		bool overloaded();
 
 	private:
+		struct queued
+		{
+			T* request;
+			long long enqueued;     //metrics::now_ns() at append
+		};
+
 		static void* worker( void* arg );
 		void thread_run();
+		T* take_locked();
+		T* take_lockfree();
+		T* taken( const queued& item, bool drained );
+		bool queue_empty();
+		void codel_update( long long sojourn, long long now );
+		void codel_exit();
+		long long control_law( unsigned count ) const { return ( long long )( codel_interval.load( std::memory_order_relaxed ) / std::sqrt( ( double )count ) ); }
 
 	private:
 		int thread_number;
 		int max_requests;
 		pthread_t* all_threads;
-		std::list< T* > business_queue;
+		std::list< queued > business_queue;
 		locker business_queue_locker;
 		sem queue_sem;
+		QUEUE_MODE queue_mode;
+		mpmc_queue< queued > lockfree_queue;
+		event_count queue_event;
+		METRIC_HISTOGRAM queue_wait_metric;
+		//CoDel state, ns on metrics::now_ns(); written by workers only when it changes,
+		//target and interval by set_admission on a reload
+		std::atomic< long long > codel_target;
+		std::atomic< long long > codel_interval;
+		std::atomic< long long > codel_first_above;
+		std::atomic< long long > codel_drop_next;
+		std::atomic< unsigned > codel_count;
+		std::atomic< bool > codel_dropping;
 		bool stop_all_threads;
 	};
 
 	template< typename T >
-	threadpool< T >::threadpool( int thread_num, int max_req ) : 
+	threadpool< T >::threadpool( int thread_num, int max_req, QUEUE_MODE mode, METRIC_HISTOGRAM wait_metric ) : 
 		    thread_number( thread_num ), max_requests( max_req ), 
-		    stop_all_threads( false ), all_threads( NULL )
+		    all_threads( NULL ), queue_mode( mode ),
+		    lockfree_queue( max_req > 0 ? max_req : 1 ), queue_wait_metric( wait_metric ),
+		    codel_target( 0 ), codel_interval( 0 ), codel_first_above( 0 ), codel_drop_next( 0 ),
+		    codel_count( 0 ), codel_dropping( false ), stop_all_threads( false )
 	{
 		if( ( thread_number <= 0 ) || ( max_requests <= 0 ) )
 		{
@@ -71,13 +124,27 @@ namespace mj{
 	template< typename T >
 	bool threadpool< T >::append( T* request )
 	{
+		queued item;
+		item.request = request;
+		bool timed = queue_wait_metric != HISTOGRAM_NONE || codel_target.load( std::memory_order_relaxed );
+		item.enqueued = timed ? metrics::now_ns() : 0;
+		if ( queue_mode == QUEUE_LOCKFREE )
+		{
+		    if ( lockfree_queue.size() >= ( size_t )max_requests || ! lockfree_queue.push( item ) )
+		    {
+		        return false;
+		    }
+		    queue_event.notify_one();
+		    return true;
+		}
+
 		business_queue_locker.lock();
 		if ( business_queue.size() > max_requests )
 		{
 		    business_queue_locker.unlock();
 		    return false;
 		}
-		business_queue.push_back( request );
+		business_queue.push_back( item );
 		business_queue_locker.unlock();
 		queue_sem.post();
 		return true;
@@ -92,20 +159,171 @@ namespace mj{
 	}
 
 	template< typename T >
-	void threadpool< T >::thread_run()
+	T* threadpool< T >::take_locked()
 	{
-		while ( ! stop_all_threads )
+		queue_sem.wait();
+		business_queue_locker.lock();
+		if ( business_queue.empty() )
 		{
-		    queue_sem.wait();
-		    business_queue_locker.lock();
-		    if ( business_queue.empty() )
+		    business_queue_locker.unlock();
+		    return NULL;
+		}
+		queued item = business_queue.front();
+		business_queue.pop_front();
+		bool drained = business_queue.empty();
+		business_queue_locker.unlock();
+		return taken( item, drained );
+	}
+
+	template< typename T >
+	T* threadpool< T >::take_lockfree()
+	{
+		queued item;
+		for ( int i = 0; i < SPIN_TIMES; ++i )
+		{
+		    if ( lockfree_queue.pop( item ) )
 		    {
-		        business_queue_locker.unlock();
-		        continue;
+		        return taken( item, lockfree_queue.size() == 0 );
 		    }
-		    T* request = business_queue.front();
-		    business_queue.pop_front();
-		    business_queue_locker.unlock();
+		    cpu_relax();
+		}
+
+		int key = queue_event.prepare_wait();
+		if ( lockfree_queue.pop( item ) )
+		{
+		    queue_event.cancel_wait();
+		    return taken( item, lockfree_queue.size() == 0 );
+		}
+		queue_event.wait( key );
+		return NULL;
+	}
+
+	template< typename T >
+	T* threadpool< T >::taken( const queued& item, bool drained )
+	{
+		bool codel = codel_target.load( std::memory_order_relaxed ) != 0;
+		if ( queue_wait_metric != HISTOGRAM_NONE || codel )
+		{
+		    long long now = metrics::now_ns();
+		    metrics::observe( queue_wait_metric, now - item.enqueued );
+		    if ( drained )
+		    {
+		        codel_exit();
+		    }
+		    else if ( codel )
+		    {
+		        codel_update( now - item.enqueued, now );
+		    }
+		}
+		return item.request;
+	}
+
+	template< typename T >
+	bool threadpool< T >::queue_empty()
+	{
+		if ( queue_mode == QUEUE_LOCKFREE )
+		{
+		    return lockfree_queue.size() == 0;
+		}
+		business_queue_locker.lock();
+		bool empty = business_queue.empty();
+		business_queue_locker.unlock();
+		return empty;
+	}
+
+	template< typename T >
+	void threadpool< T >::set_admission( int target_ms, int interval_ms )
+	{
+		codel_target.store( ( target_ms > 0 && interval_ms > 0 ) ? target_ms * 1000000LL : 0, std::memory_order_relaxed );
+		codel_interval.store( interval_ms * 1000000LL, std::memory_order_relaxed );
+		codel_exit();
+	}
+
+	template< typename T >
+	bool threadpool< T >::overloaded()
+	{
+		if ( ! codel_target.load( std::memory_order_relaxed ) || ! codel_dropping.load( std::memory_order_relaxed ) )
+		{
+		    return false;
+		}
+		if ( queue_empty() )
+		{
+		    codel_exit();
+		    return false;
+		}
+		return true;
+	}
+
+	//the standard CoDel exit, also taken on an empty queue: the next episode needs a full interval above target again
+	template< typename T >
+	void threadpool< T >::codel_exit()
+	{
+		if ( codel_first_above.load( std::memory_order_relaxed ) )
+		{
+		    codel_first_above.store( 0, std::memory_order_relaxed );
+		}
+		if ( codel_dropping.load( std::memory_order_relaxed ) )
+		{
+		    codel_dropping.store( false );
+		}
+	}
+
+	template< typename T >
+	void threadpool< T >::codel_update( long long sojourn, long long now )
+	{
+		if ( sojourn < codel_target.load( std::memory_order_relaxed ) )
+		{
+		    codel_exit();
+		    return;
+		}
+
+		long long first_above = codel_first_above.load( std::memory_order_relaxed );
+		if ( first_above == 0 )
+		{
+		    codel_first_above.compare_exchange_strong( first_above, now + codel_interval.load( std::memory_order_relaxed ) );
+		    return;
+		}
+		bool dropping = false;
+		if ( now < first_above || ! codel_dropping.compare_exchange_strong( dropping, true ) )
+		{
+		    return;
+		}
+		//back soon after the last episode: start near the rate that ended it
+		unsigned count = codel_count.load( std::memory_order_relaxed );
+		count = ( count > 2 && now - codel_drop_next.load() < 16 * codel_interval.load( std::memory_order_relaxed ) ) ? count - 2 : 0;
+		codel_count.store( count );
+		codel_drop_next.store( now );
+	}
+
+	template< typename T >
+	bool threadpool< T >::admit()
+	{
+		if ( ! codel_target.load( std::memory_order_relaxed ) || ! codel_dropping.load( std::memory_order_relaxed ) )
+		{
+		    return true;
+		}
+		long long now = metrics::now_ns();
+		long long drop_next = codel_drop_next.load( std::memory_order_relaxed );
+		if ( now < drop_next )
+		{
+		    return true;
+		}
+		//one producer wins each drop slot
+		unsigned count = codel_count.load( std::memory_order_relaxed ) + 1;
+		if ( ! codel_drop_next.compare_exchange_strong( drop_next, now + control_law( count ) ) )
+		{
+		    return true;
+		}
+		codel_count.store( count, std::memory_order_relaxed );
+		return false;
+	}
+
+	template< typename T >
+	void threadpool< T >::thread_run()
+	{
+		while ( ! stop_all_threads )
+		{
+		    T* request = ( queue_mode == QUEUE_LOCKFREE ) ? take_lockfree() : take_locked();
 		    if ( ! request )
 		    {
 		        continue;
@@ -0,0 +1,139 @@
+/*
+	timer_wheel.cpp
+	hashed timing wheel with lazy rescheduling
+*/
+
+#include <time.h>
+#include "timer_wheel.h"
+
+namespace mj{
+	timer_wheel::timer_wheel( int slot_number, int tick_ms ) :
+		    wheel_slots( 0 ), wheel_slot_number( slot_number ), wheel_tick_ms( tick_ms ),
+		    wheel_current_tick( 0 ), wheel_count( 0 )
+	{
+		//every slot is the sentinel of a circular list
+		wheel_slots = new wheel_node[ wheel_slot_number ];
+		for ( int i = 0; i < wheel_slot_number; ++i )
+		{
+		    wheel_slots[i].prev = wheel_slots + i;
+		    wheel_slots[i].next = wheel_slots + i;
+		}
+		wheel_current_tick = now_ms() / wheel_tick_ms;
+	}
+
+	timer_wheel::~timer_wheel()
+	{
+		delete [] wheel_slots;
+	}
+
+	long timer_wheel::now_ms()
+	{
+		struct timespec ts;
+		clock_gettime( CLOCK_MONOTONIC_COARSE, &ts );
+		return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+	}
+
+	void timer_wheel::link( wheel_node* node )
+	{
+		long tick = node->expire / wheel_tick_ms;
+		if ( tick <= wheel_current_tick )
+		{
+		    tick = wheel_current_tick + 1;
+		}
+		wheel_node* head = wheel_slots + tick % wheel_slot_number;
+		node->prev = head->prev;
+		node->next = head;
+		head->prev->next = node;
+		head->prev = node;
+	}
+
+	void timer_wheel::add( wheel_node* node, long expire, long now )
+	{
+		if ( linked( node ) )
+		{
+		    remove( node );
+		}
+		if ( wheel_count == 0 )
+		{
+		    //nothing ran the wheel while it was empty
+		    wheel_current_tick = now / wheel_tick_ms;
+		}
+		node->expire = expire;
+		link( node );
+		wheel_count++;
+	}
+
+	void timer_wheel::remove( wheel_node* node )
+	{
+		if ( ! linked( node ) )
+		{
+		    return;
+		}
+		node->prev->next = node->next;
+		node->next->prev = node->prev;
+		node->prev = 0;
+		node->next = 0;
+		wheel_count--;
+	}
+
+	void timer_wheel::advance( long now, expire_func func, void* arg )
+	{
+		long target = now / wheel_tick_ms;
+		long start = wheel_current_tick;
+		long steps = target - start;
+		if ( steps <= 0 )
+		{
+		    return;
+		}
+		if ( steps > wheel_slot_number )
+		{
+		    steps = wheel_slot_number;
+		}
+		//moved first: a node relinked below lands at target + 1 at the earliest,
+		//never in a slot this pass has already drained
+		wheel_current_tick = target;
+
+		for ( long i = 1; i <= steps; ++i )
+		{
+		    wheel_node* head = wheel_slots + ( start + i ) % wheel_slot_number;
+		    if ( head->next == head )
+		    {
+		        continue;
+		    }
+
+		    //detach the slot so rescheduled nodes can't be visited twice
+		    wheel_node pending;
+		    pending.next = head->next;
+		    pending.prev = head->prev;
+		    pending.next->prev = &pending;
+		    pending.prev->next = &pending;
+		    head->next = head;
+		    head->prev = head;
+
+		    while ( pending.next != &pending )
+		    {
+		        wheel_node* node = pending.next;
+		        pending.next = node->next;
+		        node->next->prev = &pending;
+		        node->prev = 0;
+		        node->next = 0;
+		        wheel_count--;
+
+		        if ( node->expire > now )
+		        {
+		            //a later round of this slot, or later in the tick just reached
+		            wheel_count++;
+		            link( node );
+		            continue;
+		        }
+		        long expire = func( node, now, arg );
+		        if ( expire > 0 && ! linked( node ) )
+		        {
+		            node->expire = expire;
+		            wheel_count++;
+		            link( node );
+		        }
+		    }
+		}
+	}
+}
@@ -0,0 +1,48 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+namespace mj{
+	struct wheel_node
+	{
+		wheel_node* prev;
+		wheel_node* next;
+		long expire;                //absolute ms on the loop's monotonic clock
+		void* owner;
+	};
+
+	/*
+		hashed timing wheel driven by the epoll_wait timeout of one event loop.
+		owners may push their deadline later without touching the wheel: when a
+		slot comes up the callback is asked again and returns the new expiry,
+		so an activity costs one store and no list operation or syscall.
+	*/
+	class timer_wheel
+	{
+	public:
+		//returns the next expiry for a node that is still alive, 0 to drop it
+		typedef long ( *expire_func )( wheel_node* node, long now, void* arg );
+
+		timer_wheel( int slot_number, int tick_ms );
+		~timer_wheel();
+
+		void add( wheel_node* node, long expire, long now );
+		void remove( wheel_node* node );
+		bool linked( const wheel_node* node ) const { return node->next != 0; }
+		bool empty() const { return wheel_count == 0; }
+		int tick() const { return wheel_tick_ms; }
+		void advance( long now, expire_func func, void* arg );
+
+		static long now_ms();
+
+	private:
+		void link( wheel_node* node );
+
+	private:
+		wheel_node* wheel_slots;
+		int wheel_slot_number;
+		int wheel_tick_ms;
+		long wheel_current_tick;
+		int wheel_count;
+	};
+}
+#endif
@@ -0,0 +1,112 @@
+/*
+	timer_wheel_test.cpp
+	checks that timer_wheel fires deadlines on time, driven by a simulated clock
+	usage: timer_wheel_test
+*/
+
+#include <stdio.h>
+#include "timer_wheel.h"
+
+using namespace mj;
+
+static const int SLOTS = 1024;
+static const int TICK_MS = 100;
+static const int STEP_MS = 10;
+
+struct probe
+{
+    wheel_node node;
+    long fired;             //simulated time it fired at, 0 while pending
+    long extend_to;         //returned once by the callback, the lazy reschedule of an owner
+};
+
+static long on_expire( wheel_node* node, long now, void* arg )
+{
+    probe* p = ( probe* )node->owner;
+    if ( p->extend_to > now )
+    {
+        long expire = p->extend_to;
+        p->extend_to = 0;
+        return expire;
+    }
+    p->fired = now;
+    return 0;
+}
+
+static void init_probe( probe& p, long extend_to )
+{
+    p.node.prev = 0;
+    p.node.next = 0;
+    p.node.owner = &p;
+    p.fired = 0;
+    p.extend_to = extend_to;
+}
+
+//steps the clock like the event loop does until p fires or limit passes
+static long run_until_fired( timer_wheel& wheel, probe& p, long now, long limit )
+{
+    while ( ! p.fired && now < limit )
+    {
+        now += STEP_MS;
+        wheel.advance( now, on_expire, NULL );
+    }
+    return now;
+}
+
+static bool check( const char* name, const probe& p, long deadline )
+{
+    bool ok = p.fired >= deadline && p.fired <= deadline + TICK_MS;
+    if ( p.fired )
+    {
+        printf( "%-40s fired %ld ms after the deadline  %s\n", name, p.fired - deadline, ok ? "ok" : "FAIL" );
+    }
+    else
+    {
+        printf( "%-40s never fired  FAIL\n", name );
+    }
+    return ok;
+}
+
+int main()
+{
+    int failures = 0;
+    //in the middle of a tick, so a deadline can fall inside the tick being advanced to
+    long base = ( timer_wheel::now_ms() / TICK_MS ) * TICK_MS + 30;
+
+    {
+        //the wheel is advanced into the tick that holds the deadline before it is due
+        timer_wheel wheel( SLOTS, TICK_MS );
+        probe p;
+        init_probe( p, 0 );
+        long deadline = base + 150;
+        wheel.add( &p.node, deadline, base );
+        run_until_fired( wheel, p, base, deadline + SLOTS * TICK_MS * 2 );
+        failures += ! check( "deadline inside the current tick", p, deadline );
+    }
+    {
+        //an owner pushed its deadline later and the callback hands it back
+        timer_wheel wheel( SLOTS, TICK_MS );
+        probe p;
+        long deadline = base + 10080;
+        init_probe( p, deadline );
+        wheel.add( &p.node, base + 1000, base );
+        run_until_fired( wheel, p, base, deadline + SLOTS * TICK_MS * 2 );
+        failures += ! check( "lazily rescheduled deadline", p, deadline );
+    }
+    {
+        //the loop slept for more than a whole round of the wheel
+        timer_wheel wheel( SLOTS, TICK_MS );
+        probe p;
+        init_probe( p, 0 );
+        long deadline = base + 50;
+        wheel.add( &p.node, deadline, base );
+        long now = base + SLOTS * TICK_MS * 3;
+        wheel.advance( now, on_expire, NULL );
+        bool ok = p.fired == now;
+        printf( "%-40s %s\n", "deadline passed during a long sleep", ok ? "ok" : "FAIL" );
+        failures += ! ok;
+    }
+
+    printf( failures ? "%d failed\n" : "all passed\n", failures );
+    return failures ? 1 : 0;
+}
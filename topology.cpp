@@ -0,0 +1,190 @@
+/*
+	topology.cpp
+	sysfs cpu / node discovery and thread pinning
+*/
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "topology.h"
+
+namespace mj{
+	//"0-3,8,10-11" as written in cpulist and online files
+	bool cpu_topology::parse_cpulist( const char* path, std::vector< int >& cpus )
+	{
+		FILE* file = fopen( path, "r" );
+		if ( ! file )
+		{
+		    return false;
+		}
+		char line[ 4096 ];
+		bool ok = fgets( line, sizeof( line ), file ) != NULL;
+		fclose( file );
+		if ( ! ok )
+		{
+		    return false;
+		}
+
+		char* p = line;
+		while ( *p && *p != '\n' )
+		{
+		    char* end;
+		    long first = strtol( p, &end, 10 );
+		    if ( end == p )
+		    {
+		        return false;
+		    }
+		    long last = first;
+		    p = end;
+		    if ( *p == '-' )
+		    {
+		        last = strtol( p + 1, &end, 10 );
+		        p = end;
+		    }
+		    for ( long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu )
+		    {
+		        cpus.push_back( ( int )cpu );
+		    }
+		    if ( *p == ',' )
+		    {
+		        p++;
+		    }
+		}
+		return true;
+	}
+
+	bool cpu_topology::detect()
+	{
+		cpu_set_t allowed;
+		CPU_ZERO( &allowed );
+		if ( sched_getaffinity( 0, sizeof( allowed ), &allowed ) < 0 )
+		{
+		    return false;
+		}
+
+		topo_nodes.clear();
+		std::vector< int > nodes;
+		if ( parse_cpulist( "/sys/devices/system/node/online", nodes ) )
+		{
+		    for ( size_t i = 0; i < nodes.size(); ++i )
+		    {
+		        char path[ 128 ];
+		        snprintf( path, sizeof( path ), "/sys/devices/system/node/node%d/cpulist", nodes[i] );
+		        std::vector< int > cpus;
+		        std::vector< int > usable;
+		        parse_cpulist( path, cpus );
+		        for ( size_t k = 0; k < cpus.size(); ++k )
+		        {
+		            if ( CPU_ISSET( cpus[k], &allowed ) )
+		            {
+		                usable.push_back( cpus[k] );
+		            }
+		        }
+		        //memory-only nodes and nodes outside our cpuset have nothing to run on
+		        if ( ! usable.empty() )
+		        {
+		            topo_nodes.push_back( usable );
+		        }
+		    }
+		}
+		if ( topo_nodes.empty() )
+		{
+		    std::vector< int > cpus;
+		    for ( int cpu = 0; cpu < CPU_SETSIZE; ++cpu )
+		    {
+		        if ( CPU_ISSET( cpu, &allowed ) )
+		        {
+		            cpus.push_back( cpu );
+		        }
+		    }
+		    if ( cpus.empty() )
+		    {
+		        return false;
+		    }
+		    topo_nodes.push_back( cpus );
+		}
+
+		topo_cpu_number = 0;
+		for ( size_t n = 0; n < topo_nodes.size(); ++n )
+		{
+		    int last = topo_nodes[n].back() + 1;
+		    topo_cpu_number = last > topo_cpu_number ? last : topo_cpu_number;
+		}
+		topo_node_of.assign( topo_cpu_number, -1 );
+		for ( size_t n = 0; n < topo_nodes.size(); ++n )
+		{
+		    for ( size_t k = 0; k < topo_nodes[n].size(); ++k )
+		    {
+		        topo_node_of[ topo_nodes[n][k] ] = n;
+		    }
+		}
+		return true;
+	}
+
+	int cpu_topology::loop_cpu( int i ) const
+	{
+		const std::vector< int >& cpus = topo_nodes[ loop_node( i ) ];
+		return cpus[ ( i / node_number() ) % cpus.size() ];
+	}
+
+	std::vector< int > cpu_topology::loop_map( int loop_number ) const
+	{
+		std::vector< int > map( topo_cpu_number, -1 );
+		for ( int i = 0; i < loop_number; ++i )
+		{
+		    if ( map[ loop_cpu( i ) ] == -1 )
+		    {
+		        map[ loop_cpu( i ) ] = i;
+		    }
+		}
+		//a cpu without a loop of its own goes to the loops of its node in turn
+		std::vector< int > turn( node_number(), 0 );
+		for ( int cpu = 0; cpu < topo_cpu_number; ++cpu )
+		{
+		    int node = topo_node_of[ cpu ];
+		    if ( map[ cpu ] != -1 )
+		    {
+		        continue;
+		    }
+		    if ( node < 0 || node >= loop_number )
+		    {
+		        map[ cpu ] = cpu % loop_number;
+		        continue;
+		    }
+		    //loops of node n are n, n + node_number(), ...
+		    int count = ( loop_number - node + node_number() - 1 ) / node_number();
+		    map[ cpu ] = node + ( turn[ node ]++ % count ) * node_number();
+		}
+		return map;
+	}
+
+	std::vector< int > cpu_topology::all_cpus() const
+	{
+		std::vector< int > cpus;
+		for ( int cpu = 0; cpu < topo_cpu_number; ++cpu )
+		{
+		    if ( topo_node_of[ cpu ] >= 0 )
+		    {
+		        cpus.push_back( cpu );
+		    }
+		}
+		return cpus;
+	}
+
+	bool cpu_topology::pin_self( const std::vector< int >& cpus )
+	{
+		return pin( pthread_self(), cpus );
+	}
+
+	bool cpu_topology::pin( pthread_t thread, const std::vector< int >& cpus )
+	{
+		cpu_set_t set;
+		CPU_ZERO( &set );
+		for ( size_t i = 0; i < cpus.size(); ++i )
+		{
+		    CPU_SET( cpus[i], &set );
+		}
+		return pthread_setaffinity_np( thread, sizeof( set ), &set ) == 0;
+	}
+}
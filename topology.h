@@ -0,0 +1,45 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <pthread.h>
+#include <vector>
+
+namespace mj{
+	/*
+		cpus and NUMA nodes from sysfs, read once at startup and cut down to
+		the cpus this process may run on. a machine without
+		/sys/devices/system/node is one node holding all of them.
+		placement works by inheritance: the main thread pins itself where a
+		pool or loop belongs before creating it, so its threads start with
+		that mask and the memory they touch first comes from that node.
+	*/
+	class cpu_topology
+	{
+	public:
+		bool detect();
+
+		int node_number() const { return ( int )topo_nodes.size(); }
+		const std::vector< int >& node_cpus( int node ) const { return topo_nodes[ node ]; }
+		int cpu_number() const { return topo_cpu_number; }
+		//every cpu of every node, for threads that belong to none
+		std::vector< int > all_cpus() const;
+
+		//loop i of loop_number: nodes take turns, cpus within a node too
+		int loop_node( int i ) const { return i % node_number(); }
+		int loop_cpu( int i ) const;
+		//reuseport group index for each cpu, connections stay with a loop on the node that got them
+		std::vector< int > loop_map( int loop_number ) const;
+
+		static bool pin_self( const std::vector< int >& cpus );
+		static bool pin( pthread_t thread, const std::vector< int >& cpus );
+
+	private:
+		static bool parse_cpulist( const char* path, std::vector< int >& cpus );
+
+	private:
+		std::vector< std::vector< int > > topo_nodes;
+		std::vector< int > topo_node_of;        //indexed by cpu, -1 when the cpu is not ours
+		int topo_cpu_number;                    //highest cpu id plus one
+	};
+}
+#endif
@@ -0,0 +1,774 @@
+/*
+	uring_loop.cpp
+	io_uring completion backend
+*/
+
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include "uring_loop.h"
+#include "metrics.h"
+#include "public_func.h"
+
+namespace mj{
+	static int io_uring_setup( unsigned entries, io_uring_params* p )
+	{
+		return ( int )syscall( __NR_io_uring_setup, entries, p );
+	}
+
+	static int io_uring_enter( int fd, unsigned to_submit, unsigned min_complete, unsigned flags,
+		        const void* arg, size_t argsz )
+	{
+		return ( int )syscall( __NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz );
+	}
+
+	static int io_uring_register( int fd, unsigned opcode, const void* arg, unsigned nr_args )
+	{
+		return ( int )syscall( __NR_io_uring_register, fd, opcode, arg, nr_args );
+	}
+
+	//conn_state is aligned to 16, room for the OP below its pointer
+	static const unsigned long long OP_MASK = 15;
+
+	uring_loop::uring_loop( int port, threadpool< http_business >* pool, int max_fd, int max_events ) :
+		    event_loop( port, pool, max_fd, max_events ), ring_fd( -1 ), ring_disabled( false ),
+		    ring_features( 0 ), sq_ptr( NULL ), sq_size( 0 ), cq_ptr( NULL ), cq_size( 0 ), sqes( NULL ),
+		    sq_head( NULL ), sq_tail( NULL ), sq_mask( 0 ), sq_entries( 0 ), sq_local_tail( 0 ),
+		    sq_submitted( 0 ), cq_head( NULL ), cq_tail( NULL ), cq_mask( 0 ), cqes( NULL ),
+		    loop_states( NULL ), wake_value( 0 ), accept_armed( false ), accept_holding( false )
+	{
+		memset( buf_blocks, 0, sizeof( buf_blocks ) );
+	}
+
+	uring_loop::~uring_loop()
+	{
+		//closing the ring cancels whatever is still in flight
+		if( ring_fd != -1 )
+		{
+		    close( ring_fd );
+		}
+		if( loop_states )
+		{
+		    for ( int i = 0; i < loop_max_fd; ++i )
+		    {
+		        if( loop_states[i] )
+		        {
+		            if( loop_states[i]->io_block )
+		            {
+		                loop_write_pool->put( loop_states[i]->io_block );
+		            }
+		            delete loop_states[i];
+		        }
+		    }
+		    free( loop_states );
+		}
+		for ( unsigned i = 0; i < BUFFER_ENTRIES; ++i )
+		{
+		    if( buf_blocks[i] )
+		    {
+		        loop_read_pool->put( buf_blocks[i] );
+		    }
+		}
+		if( sqes )
+		{
+		    munmap( sqes, sq_entries * sizeof( io_uring_sqe ) );
+		}
+		if( cq_ptr && cq_ptr != sq_ptr )
+		{
+		    munmap( cq_ptr, cq_size );
+		}
+		if( sq_ptr )
+		{
+		    munmap( sq_ptr, sq_size );
+		}
+	}
+
+	bool uring_loop::open_backend()
+	{
+		//the ring stays disabled until run() enables it, so the loop thread is its single issuer
+		io_uring_params p;
+		memset( &p, 0, sizeof( p ) );
+		p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_R_DISABLED
+		        | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+		p.cq_entries = RING_ENTRIES * 4;
+		ring_fd = io_uring_setup( RING_ENTRIES, &p );
+		if( ring_fd < 0 )
+		{
+		    memset( &p, 0, sizeof( p ) );
+		    p.flags = IORING_SETUP_CQSIZE;
+		    p.cq_entries = RING_ENTRIES * 4;
+		    ring_fd = io_uring_setup( RING_ENTRIES, &p );
+		    if( ring_fd < 0 )
+		    {
+		        return false;
+		    }
+		}
+		ring_disabled = p.flags & IORING_SETUP_R_DISABLED;
+		ring_features = p.features;
+		if( ! ( ring_features & IORING_FEAT_EXT_ARG ) || ! ( ring_features & IORING_FEAT_NODROP ) )
+		{
+		    return false;
+		}
+
+		sq_entries = p.sq_entries;
+		sq_size = p.sq_off.array + p.sq_entries * sizeof( unsigned );
+		cq_size = p.cq_off.cqes + p.cq_entries * sizeof( io_uring_cqe );
+		if( ring_features & IORING_FEAT_SINGLE_MMAP )
+		{
+		    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+		}
+		void* ptr = mmap( NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		            ring_fd, IORING_OFF_SQ_RING );
+		if( ptr == MAP_FAILED )
+		{
+		    return false;
+		}
+		sq_ptr = ( char* )ptr;
+		if( ring_features & IORING_FEAT_SINGLE_MMAP )
+		{
+		    cq_ptr = sq_ptr;
+		}
+		else
+		{
+		    ptr = mmap( NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		                ring_fd, IORING_OFF_CQ_RING );
+		    if( ptr == MAP_FAILED )
+		    {
+		        return false;
+		    }
+		    cq_ptr = ( char* )ptr;
+		}
+		ptr = mmap( NULL, sq_entries * sizeof( io_uring_sqe ), PROT_READ | PROT_WRITE,
+		            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES );
+		if( ptr == MAP_FAILED )
+		{
+		    return false;
+		}
+		sqes = ( io_uring_sqe* )ptr;
+
+		sq_head = ( unsigned* )( sq_ptr + p.sq_off.head );
+		sq_tail = ( unsigned* )( sq_ptr + p.sq_off.tail );
+		sq_mask = *( unsigned* )( sq_ptr + p.sq_off.ring_mask );
+		unsigned* array = ( unsigned* )( sq_ptr + p.sq_off.array );
+		for ( unsigned i = 0; i < sq_entries; ++i )
+		{
+		    array[i] = i;
+		}
+		sq_local_tail = sq_submitted = *sq_tail;
+		cq_head = ( unsigned* )( cq_ptr + p.cq_off.head );
+		cq_tail = ( unsigned* )( cq_ptr + p.cq_off.tail );
+		cq_mask = *( unsigned* )( cq_ptr + p.cq_off.ring_mask );
+		cqes = ( io_uring_cqe* )( cq_ptr + p.cq_off.cqes );
+
+		//recv buffers: read pool blocks, the data lands where chain_buffer::adopt expects it
+		for ( unsigned i = 0; i < BUFFER_ENTRIES; ++i )
+		{
+		    provide_buffer( i );
+		}
+
+		loop_states = ( conn_state** )calloc( loop_max_fd, sizeof( conn_state* ) );
+		if( ! loop_states )
+		{
+		    return false;
+		}
+		prep_accept();
+		prep_wake();
+		return true;
+	}
+
+	//a fresh block takes the buffer id the kernel just consumed
+	void uring_loop::provide_buffer( unsigned short bid )
+	{
+		char* block = loop_read_pool->get();
+		buf_blocks[ bid ] = block;
+		if( ! block )
+		{
+		    return;
+		}
+		io_uring_sqe* sqe = get_sqe( NULL, OP_PROVIDE );
+		sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd = 1;
+		sqe->addr = ( unsigned long long )( block + chain_buffer::block_offset() );
+		sqe->len = loop_read_pool->block_size() - chain_buffer::block_offset();
+		sqe->off = bid;
+		sqe->buf_group = BUFFER_GROUP;
+	}
+
+	io_uring_sqe* uring_loop::get_sqe( void* owner, OP op )
+	{
+		if( sq_local_tail - __atomic_load_n( sq_head, __ATOMIC_ACQUIRE ) >= sq_entries )
+		{
+		    //ring full, push what is queued to the kernel first
+		    enter( 0, 0 );
+		}
+		io_uring_sqe* sqe = &sqes[ sq_local_tail & sq_mask ];
+		memset( sqe, 0, sizeof( *sqe ) );
+		sqe->user_data = ( unsigned long long )owner | op;
+		sq_local_tail++;
+		return sqe;
+	}
+
+	//submits everything queued, waits for wait_nr completions or timeout_ms (-1: no timeout)
+	int uring_loop::enter( unsigned wait_nr, long timeout_ms )
+	{
+		__atomic_store_n( sq_tail, sq_local_tail, __ATOMIC_RELEASE );
+		unsigned to_submit = sq_local_tail - sq_submitted;
+		sq_submitted = sq_local_tail;
+
+		__kernel_timespec ts;
+		io_uring_getevents_arg arg;
+		memset( &arg, 0, sizeof( arg ) );
+		if( timeout_ms >= 0 )
+		{
+		    ts.tv_sec = timeout_ms / 1000;
+		    ts.tv_nsec = ( timeout_ms % 1000 ) * 1000000L;
+		    arg.ts = ( unsigned long long )&ts;
+		}
+		return io_uring_enter( ring_fd, to_submit, wait_nr,
+		            IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof( arg ) );
+	}
+
+	void uring_loop::prep_accept()
+	{
+		io_uring_sqe* sqe = get_sqe( NULL, OP_ACCEPT );
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = loop_listenfd;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		accept_armed = true;
+	}
+
+	//cancels the multishot accept, run() arms it again once the pool has recovered
+	void uring_loop::hold_accept()
+	{
+		if( ! accept_armed || accept_holding )
+		{
+		    return;
+		}
+		io_uring_sqe* sqe = get_sqe( NULL, OP_HOLD );
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = ( unsigned long long )OP_ACCEPT;
+		accept_holding = true;
+	}
+
+	void uring_loop::prep_wake()
+	{
+		io_uring_sqe* sqe = get_sqe( NULL, OP_WAKE );
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = loop_wake_fd;
+		sqe->addr = ( unsigned long long )&wake_value;
+		sqe->len = sizeof( wake_value );
+	}
+
+	void uring_loop::prep_recv( conn_state& s )
+	{
+		io_uring_sqe* sqe = get_sqe( &s, OP_RECV );
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = s.conn->sockfd();
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = BUFFER_GROUP;
+		s.recv_armed = true;
+		s.inflight++;
+	}
+
+	bool uring_loop::input_full( const conn_state& s ) const
+	{
+		size_t buffered = s.inbox.size() + ( s.busy ? 0 : s.conn->input_size() );
+		return buffered >= http_business::max_input_buffered();
+	}
+
+	//the multishot recv stays armed while there is room for input
+	void uring_loop::rearm_recv( conn_state& s )
+	{
+		if( s.closing || s.recv_armed || input_full( s ) )
+		{
+		    return;
+		}
+		prep_recv( s );
+	}
+
+	void uring_loop::start_send( conn_state& s )
+	{
+		http_business& conn = *s.conn;
+		if( ! s.io_block )
+		{
+		    s.io_block = loop_write_pool->get();
+		    if( ! s.io_block )
+		    {
+		        begin_close( s );
+		        return;
+		    }
+		}
+		struct msghdr* msg = ( struct msghdr* )s.io_block;
+		struct iovec* iv = ( struct iovec* )( msg + 1 );
+		int max = ( loop_write_pool->block_size() - sizeof( *msg ) ) / sizeof( *iv );
+		bool complete = false;
+		memset( msg, 0, sizeof( *msg ) );
+		msg->msg_iov = iv;
+		msg->msg_iovlen = conn.output_iovecs( iv, max, complete );
+
+		if( msg->msg_iovlen == 0 )
+		{
+		    int fd;
+		    off_t offset;
+		    size_t len;
+		    conn.output_file( fd, offset, len );
+		    start_fill( s, fd, offset, len );
+		    return;
+		}
+
+		io_uring_sqe* sqe = get_sqe( &s, OP_SEND );
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = conn.sockfd();
+		sqe->addr = ( unsigned long long )msg;
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL | ( complete ? 0 : MSG_MORE );
+		s.sending = true;
+		s.inflight++;
+		if( complete && conn.last_response() )
+		{
+		    //the FIN follows the last response without another trip through the loop
+		    sqe->flags |= IOSQE_IO_LINK;
+		    sqe = get_sqe( &s, OP_OTHER );
+		    sqe->opcode = IORING_OP_SHUTDOWN;
+		    sqe->fd = conn.sockfd();
+		    sqe->len = SHUT_WR;
+		    s.inflight++;
+		}
+		after_write( conn );
+	}
+
+	//a file body that isn't mapped: splice the next chunk of it into the pipe
+	void uring_loop::start_fill( conn_state& s, int fd, off_t offset, size_t len )
+	{
+		if( s.pipe_fds[0] < 0 && pipe2( s.pipe_fds, O_CLOEXEC | O_NONBLOCK ) < 0 )
+		{
+		    s.pipe_fds[0] = s.pipe_fds[1] = -1;
+		    begin_close( s );
+		    return;
+		}
+		io_uring_sqe* sqe = get_sqe( &s, OP_FILL );
+		sqe->opcode = IORING_OP_SPLICE;
+		sqe->fd = s.pipe_fds[1];
+		sqe->off = ( unsigned long long )-1;
+		sqe->splice_fd_in = fd;
+		sqe->splice_off_in = offset;
+		sqe->len = len < SPLICE_CHUNK ? len : SPLICE_CHUNK;
+		sqe->splice_flags = SPLICE_F_MOVE;
+		s.sending = true;
+		s.inflight++;
+		after_write( *s.conn );
+	}
+
+	//and from the pipe on to the socket
+	void uring_loop::start_drain( conn_state& s )
+	{
+		io_uring_sqe* sqe = get_sqe( &s, OP_DRAIN );
+		sqe->opcode = IORING_OP_SPLICE;
+		sqe->fd = s.conn->sockfd();
+		sqe->off = ( unsigned long long )-1;
+		sqe->splice_fd_in = s.pipe_fds[0];
+		sqe->splice_off_in = ( unsigned long long )-1;
+		sqe->len = s.piped;
+		sqe->splice_flags = SPLICE_F_MOVE;
+		s.sending = true;
+		s.inflight++;
+	}
+
+	void uring_loop::send_done( conn_state& s )
+	{
+		http_business& conn = *s.conn;
+		if( ! conn.finish_response() )
+		{
+		    begin_close( s );
+		    return;
+		}
+		bool more = conn.pending_input() || conn.producing();
+		if( ! more && s.io_block )
+		{
+		    loop_write_pool->put( s.io_block );
+		    s.io_block = NULL;
+		}
+		if( ! more )
+		{
+		    close_pipe( s );
+		}
+		after_write( conn );
+		if( more )
+		{
+		    dispatch( s );
+		}
+		else
+		{
+		    rearm_recv( s );
+		}
+	}
+
+	//false when the request was shed, s may be gone then
+	bool uring_loop::dispatch( conn_state& s )
+	{
+		s.busy = submit( *s.conn );
+		if( ! s.busy )
+		{
+		    begin_close( s );
+		    return false;
+		}
+		return true;
+	}
+
+	void uring_loop::begin_close( conn_state& s )
+	{
+		if( s.closing )
+		{
+		    return;
+		}
+		s.closing = true;
+		if( s.inflight > 0 )
+		{
+		    io_uring_sqe* sqe = get_sqe( &s, OP_OTHER );
+		    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		    sqe->fd = s.conn->sockfd();
+		    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+		    s.inflight++;
+		}
+		try_finalize( s );
+	}
+
+	void uring_loop::close_pipe( conn_state& s )
+	{
+		if( s.pipe_fds[0] >= 0 )
+		{
+		    close( s.pipe_fds[0] );
+		    close( s.pipe_fds[1] );
+		    s.pipe_fds[0] = s.pipe_fds[1] = -1;
+		}
+	}
+
+	//the state goes once neither a worker nor the kernel holds a reference to it
+	void uring_loop::try_finalize( conn_state& s )
+	{
+		if( ! s.closing || s.busy || s.inflight > 0 )
+		{
+		    return;
+		}
+		if( s.io_block )
+		{
+		    loop_write_pool->put( s.io_block );
+		}
+		close_pipe( s );
+		loop_states[ s.conn->sockfd() ] = NULL;
+		close_conn( *s.conn );
+		delete &s;
+	}
+
+	void uring_loop::handle_accept( int res, unsigned flags )
+	{
+		if( ! ( flags & IORING_CQE_F_MORE ) )
+		{
+		    accept_armed = false;
+		    accept_holding = false;
+		    if( ! accepts_held() )
+		    {
+		        prep_accept();
+		    }
+		}
+		if( res < 0 )
+		{
+		    if( res != -ECANCELED )
+		    {
+		        printf( "errno is: %d\n", -res );
+		    }
+		    return;
+		}
+		if( accepts_held() )
+		{
+		    hold_accept();
+		}
+
+		struct sockaddr_in client_address;
+		socklen_t client_addrlength = sizeof( client_address );
+		memset( &client_address, 0, sizeof( client_address ) );
+		getpeername( res, ( struct sockaddr* )&client_address, &client_addrlength );
+		http_business* conn = add_conn( res, client_address );
+		if( ! conn )
+		{
+		    return;
+		}
+		conn_state* s = new conn_state;
+		s->conn = conn;
+		s->inflight = 0;
+		s->busy = false;
+		s->recv_armed = false;
+		s->recv_paused = false;
+		s->sending = false;
+		s->closing = false;
+		s->inbox.init( loop_read_pool );
+		s->io_block = NULL;
+		s->pipe_fds[0] = s->pipe_fds[1] = -1;
+		s->piped = 0;
+		loop_states[ res ] = s;
+		prep_recv( *s );
+	}
+
+	void uring_loop::handle_recv( conn_state& s, int res, unsigned flags )
+	{
+		bool paused = s.recv_paused;
+		if( ! ( flags & IORING_CQE_F_MORE ) )
+		{
+		    s.recv_armed = false;
+		    s.recv_paused = false;
+		    s.inflight--;
+		}
+		if( flags & IORING_CQE_F_BUFFER )
+		{
+		    unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		    char* block = buf_blocks[ bid ];
+		    provide_buffer( bid );
+		    if( s.closing || res <= 0 )
+		    {
+		        loop_read_pool->put( block );
+		    }
+		    else if( s.busy )
+		    {
+		        metrics::count( COUNTER_BYTES_IN, res );
+		        s.inbox.adopt( block, res );
+		    }
+		    else
+		    {
+		        metrics::count( COUNTER_BYTES_IN, res );
+		        s.conn->adopt_input( block, res );
+		    }
+		}
+		if( s.closing )
+		{
+		    try_finalize( s );
+		    return;
+		}
+		if( res == 0 || ( res < 0 && res != -ENOBUFS && ! ( res == -ECANCELED && paused ) ) )
+		{
+		    //a recv cancelled to pause the input is not an error, rearm_recv() resumes it
+		    begin_close( s );
+		    return;
+		}
+
+		if( s.recv_armed && ! s.recv_paused && input_full( s ) )
+		{
+		    //stop reading until the buffered requests are answered
+		    io_uring_sqe* sqe = get_sqe( &s, OP_OTHER );
+		    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		    sqe->addr = ( unsigned long long )&s | OP_RECV;
+		    s.recv_paused = true;
+		    s.inflight++;
+		}
+		rearm_recv( s );
+		if( res > 0 && ! s.busy && ! s.sending )
+		{
+		    after_read( *s.conn );
+		    dispatch( s );
+		}
+	}
+
+	void uring_loop::handle_send( conn_state& s, int res )
+	{
+		s.inflight--;
+		s.sending = false;
+		if( s.closing )
+		{
+		    try_finalize( s );
+		    return;
+		}
+		if( res < 0 )
+		{
+		    begin_close( s );
+		    return;
+		}
+		metrics::count( COUNTER_BYTES_OUT, res );
+		s.conn->output_sent( res );
+		if( s.conn->writing() )
+		{
+		    start_send( s );
+		    return;
+		}
+		send_done( s );
+	}
+
+	void uring_loop::handle_fill( conn_state& s, int res )
+	{
+		s.inflight--;
+		s.sending = false;
+		if( s.closing )
+		{
+		    try_finalize( s );
+		    return;
+		}
+		if( res <= 0 )
+		{
+		    //an error, or the file was cut short under the response
+		    begin_close( s );
+		    return;
+		}
+		s.piped = res;
+		start_drain( s );
+	}
+
+	void uring_loop::handle_drain( conn_state& s, int res )
+	{
+		s.inflight--;
+		s.sending = false;
+		if( s.closing )
+		{
+		    try_finalize( s );
+		    return;
+		}
+		if( res == -EAGAIN )
+		{
+		    //the socket is full, splice the rest once it drains
+		    io_uring_sqe* sqe = get_sqe( &s, OP_POLL );
+		    sqe->opcode = IORING_OP_POLL_ADD;
+		    sqe->fd = s.conn->sockfd();
+		    sqe->poll32_events = POLLOUT;
+		    s.sending = true;
+		    s.inflight++;
+		    return;
+		}
+		if( res <= 0 )
+		{
+		    begin_close( s );
+		    return;
+		}
+		metrics::count( COUNTER_BYTES_OUT, res );
+		s.conn->output_sent( res );
+		s.piped -= res;
+		if( s.piped > 0 )
+		{
+		    start_drain( s );
+		}
+		else if( s.conn->writing() )
+		{
+		    start_send( s );
+		}
+		else
+		{
+		    send_done( s );
+		}
+	}
+
+	void uring_loop::handle_resumed( http_business& conn )
+	{
+		conn_state* s = loop_states[ conn.sockfd() ];
+		s->busy = false;
+		if( s->closing )
+		{
+		    try_finalize( *s );
+		    return;
+		}
+		bool more = s->inbox.size() > 0;
+		conn.take_input( s->inbox );
+		if( conn.writing() )
+		{
+		    start_send( *s );
+		}
+		else if( more )
+		{
+		    after_read( conn );
+		    if( ! dispatch( *s ) )
+		    {
+		        return;
+		    }
+		}
+		rearm_recv( *s );
+	}
+
+	void uring_loop::handle_cqe( const io_uring_cqe& cqe )
+	{
+		OP op = ( OP )( cqe.user_data & OP_MASK );
+		conn_state* s = ( conn_state* )( cqe.user_data & ~OP_MASK );
+		switch( op )
+		{
+		    case OP_ACCEPT:
+		        handle_accept( cqe.res, cqe.flags );
+		        break;
+		    case OP_WAKE:
+		        prep_wake();
+		        break;
+		    case OP_PROVIDE:
+		    case OP_HOLD:
+		        break;
+		    case OP_RECV:
+		        handle_recv( *s, cqe.res, cqe.flags );
+		        break;
+		    case OP_SEND:
+		        handle_send( *s, cqe.res );
+		        break;
+		    case OP_FILL:
+		        handle_fill( *s, cqe.res );
+		        break;
+		    case OP_DRAIN:
+		        handle_drain( *s, cqe.res );
+		        break;
+		    case OP_POLL:
+		        s->inflight--;
+		        s->sending = false;
+		        if( s->closing )
+		        {
+		            try_finalize( *s );
+		        }
+		        else
+		        {
+		            start_drain( *s );
+		        }
+		        break;
+		    default:
+		        s->inflight--;
+		        try_finalize( *s );
+		        break;
+		}
+	}
+
+	void uring_loop::run()
+	{
+		if( ring_disabled && io_uring_register( ring_fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0 ) < 0 )
+		{
+		    printf( "io_uring enable failure\n" );
+		    return;
+		}
+		while( true )
+		{
+		    if( ! accept_armed && ! accepts_held() )
+		    {
+		        prep_accept();
+		    }
+		    unsigned wait_nr = begin_wait() ? 1 : 0;
+		    long timeout = loop_wheel->empty() ? -1 : loop_wheel->tick();
+		    if( ! accept_armed && ( timeout < 0 || timeout > ACCEPT_RETRY_MS ) )
+		    {
+		        timeout = ACCEPT_RETRY_MS;
+		    }
+		    int ret = enter( wait_nr, timeout );
+		    end_wait();
+		    if( ret < 0 && errno != EINTR && errno != ETIME && errno != EAGAIN && errno != EBUSY )
+		    {
+		        printf( "io_uring failure\n" );
+		        break;
+		    }
+		    loop_now = timer_wheel::now_ms();
+
+		    unsigned head = *cq_head;
+		    unsigned tail = __atomic_load_n( cq_tail, __ATOMIC_ACQUIRE );
+		    while( head != tail )
+		    {
+		        io_uring_cqe cqe = cqes[ head & cq_mask ];
+		        head++;
+		        __atomic_store_n( cq_head, head, __ATOMIC_RELEASE );
+		        handle_cqe( cqe );
+		        if( head == tail )
+		        {
+		            tail = __atomic_load_n( cq_tail, __ATOMIC_ACQUIRE );
+		        }
+		    }
+
+		    loop_wheel->advance( loop_now, on_expire, this );
+		}
+	}
+}
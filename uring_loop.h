@@ -0,0 +1,111 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <linux/io_uring.h>
+#include "event_loop.h"
+#include "chain_buffer.h"
+
+namespace mj{
+	/*
+		completion backend on io_uring, driven with the raw syscalls.
+		one multishot accept and one multishot recv per connection stay armed,
+		recv lands in blocks of the read pool handed to the kernel as provided
+		buffers and is adopted by the connection without a copy.
+		output goes out in one sendmsg per batch of responses, a closing
+		response gets its shutdown linked behind it. a file body that isn't
+		mapped is spliced through a pipe of the connection, file to pipe then
+		pipe to socket, so a page cache miss never stalls the loop. a busy loop
+		enters the kernel once per batch.
+	*/
+	class uring_loop : public event_loop
+	{
+	public:
+		uring_loop( int port, threadpool< http_business >* pool, int max_fd, int max_events );
+		~uring_loop();
+
+		void run();
+
+	public:
+		static const unsigned RING_ENTRIES = 1024;
+		static const unsigned BUFFER_ENTRIES = 256;     //provided recv buffers, a power of two
+		static const int BUFFER_GROUP = 0;
+		static const size_t SPLICE_CHUNK = 65536;       //the default pipe capacity
+
+	protected:
+		bool open_backend();
+		void handle_resumed( http_business& conn );
+
+	private:
+		//low four bits of user_data, the rest is the conn_state pointer
+		enum OP { OP_ACCEPT, OP_RECV, OP_SEND, OP_POLL, OP_WAKE, OP_PROVIDE, OP_OTHER, OP_HOLD, OP_FILL, OP_DRAIN };
+
+		struct alignas( 16 ) conn_state
+		{
+			http_business* conn;
+			int inflight;           //submissions whose completion is still to come
+			bool busy;              //a worker owns the connection
+			bool recv_armed;
+			bool recv_paused;       //too much input buffered, the recv is being cancelled
+			bool sending;
+			bool closing;
+			chain_buffer inbox;     //input that arrived while busy
+			char* io_block;         //msghdr and iovecs of the send in flight
+			int pipe_fds[2];        //file bodies are spliced through it, -1 until one is
+			size_t piped;           //bytes of the file body waiting in the pipe
+		};
+
+		io_uring_sqe* get_sqe( void* owner, OP op );
+		int enter( unsigned wait_nr, long timeout_ms );
+		void provide_buffer( unsigned short bid );
+
+		void prep_accept();
+		void hold_accept();
+		void prep_recv( conn_state& s );
+		void rearm_recv( conn_state& s );
+		bool input_full( const conn_state& s ) const;
+		void prep_wake();
+		void start_send( conn_state& s );
+		void start_fill( conn_state& s, int fd, off_t offset, size_t len );
+		void start_drain( conn_state& s );
+		void send_done( conn_state& s );
+		void close_pipe( conn_state& s );
+		bool dispatch( conn_state& s );
+		void begin_close( conn_state& s );
+		void try_finalize( conn_state& s );
+
+		void handle_cqe( const io_uring_cqe& cqe );
+		void handle_accept( int res, unsigned flags );
+		void handle_recv( conn_state& s, int res, unsigned flags );
+		void handle_send( conn_state& s, int res );
+		void handle_fill( conn_state& s, int res );
+		void handle_drain( conn_state& s, int res );
+
+	private:
+		int ring_fd;
+		bool ring_disabled;
+		unsigned ring_features;
+		char* sq_ptr;
+		size_t sq_size;
+		char* cq_ptr;
+		size_t cq_size;
+		io_uring_sqe* sqes;
+		unsigned* sq_head;
+		unsigned* sq_tail;
+		unsigned sq_mask;
+		unsigned sq_entries;
+		unsigned sq_local_tail;
+		unsigned sq_submitted;
+		unsigned* cq_head;
+		unsigned* cq_tail;
+		unsigned cq_mask;
+		io_uring_cqe* cqes;
+
+		char* buf_blocks[ BUFFER_ENTRIES ];
+
+		conn_state** loop_states;           //indexed by fd like loop_users
+		unsigned long long wake_value;
+		bool accept_armed;                  //the multishot accept is in the kernel
+		bool accept_holding;                //and is being cancelled while the workers are overloaded
+	};
+}
+#endif